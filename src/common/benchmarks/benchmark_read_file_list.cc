@@ -0,0 +1,110 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * A micro-benchmark for parsing file indices of transport forms. It creates a
+ * synthetic file index and parses it through different ReadStreams. */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "transport_form.h"
+#include "file_list.h"
+#include "managed_buffer.h"
+#include "common_utilities.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+using namespace std;
+namespace tf = TransportForm;
+
+
+size_t create_index (TemporaryFile& tmp, unsigned cnt_entries)
+{
+	DynamicBuffer<uint8_t> buf;
+	size_t size = 0;
+
+	uint8_t sha1_sum[20] = { 0 };
+	char path[64];
+
+	for (unsigned i = 0; i < cnt_entries; i++)
+	{
+		/* Paths in ascending order, like tpm2_pack creates them */
+		snprintf (path, sizeof(path), "/usr/share/benchmark/dir%04u/file%08u", i / 1000, i);
+
+		FileRecord r(FILE_TYPE_REGULAR, 0, 0, 0644, i, sha1_sum, path);
+
+		buf.ensure_size (size + r.binary_size());
+		r.to_binary (buf.buf + size);
+		size += r.binary_size();
+	}
+
+	tmp.append_string (string((const char*) buf.buf, size));
+	tmp.close();
+
+	return size;
+}
+
+
+template<typename F>
+double measure (F f, unsigned repetitions)
+{
+	auto t1 = chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < repetitions; i++)
+		f();
+
+	auto t2 = chrono::steady_clock::now();
+	return chrono::duration<double, milli>(t2 - t1).count() / repetitions;
+}
+
+
+int main (int argc, char** argv)
+{
+	unsigned cnt_entries = 100000;
+	unsigned repetitions = 10;
+
+	if (argc > 3)
+	{
+		fprintf (stderr, "Usage: %s [<count of entries> [<repetitions>]]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 1)
+		cnt_entries = atoi (argv[1]);
+
+	if (argc > 2)
+		repetitions = atoi (argv[2]);
+
+	TemporaryFile tmp("tpm2-bench");
+	auto size = create_index (tmp, cnt_entries);
+
+	printf ("File index with %u entries (%zu bytes), %u repetitions\n",
+			cnt_entries, size, repetitions);
+
+	/* Chunked reads */
+	auto t_fd = measure ([&]() {
+		int fd = open (tmp.path().c_str(), O_RDONLY | O_CLOEXEC);
+		tf::FDReadStream rs(fd, true);
+
+		auto fl = tf::read_file_list (rs, size);
+		if (fl->begin() == fl->end())
+			abort();
+	}, repetitions);
+
+	printf ("  FDReadStream:   %8.2f ms\n", t_fd);
+
+	/* In place */
+	auto t_mmap = measure ([&]() {
+		tf::MmapReadStream rs(tmp.path());
+
+		auto fl = tf::read_file_list (rs, size);
+		if (fl->begin() == fl->end())
+			abort();
+	}, repetitions);
+
+	printf ("  MmapReadStream: %8.2f ms\n", t_mmap);
+
+	return 0;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <filesystem>
@@ -25,9 +26,13 @@ FileRecord::FileRecord()
 
 FileRecord::FileRecord(uint8_t type, uint32_t uid, uint32_t gid, uint16_t mode,
 		uint32_t size, uint8_t sha1_sum[], const string& path)
-	:
-		type(type), uid(uid), gid(gid), mode(mode), size(size), path(path)
+	: path(path)
 {
+	this->type = type;
+	this->uid = uid;
+	this->gid = gid;
+	this->mode = mode;
+	this->size = size;
 	memcpy (this->sha1_sum, sha1_sum, sizeof (this->sha1_sum));
 }
 
@@ -75,7 +80,14 @@ bool FileRecord::operator< (const FileRecord& o) const
 
 bool FileRecord::non_existent_or_matches (const string& root, ostream *out) const
 {
-	const auto target_path = simplify_path (root + "/" + path);
+	return FileAttributes::non_existent_or_matches (root, path, out);
+}
+
+
+bool FileAttributes::non_existent_or_matches (const string& root, string_view path,
+		ostream *out) const
+{
+	const auto target_path = simplify_path (root + "/" + string(path));
 
 	struct stat statbuf;
 
@@ -267,25 +279,123 @@ DummyFileRecord::DummyFileRecord(const string& path)
 }
 
 
-void FileList::add_file (FileRecord&& file)
+bool FileListEntry::non_existent_or_matches (const string& root, ostream *out) const
+{
+	return FileAttributes::non_existent_or_matches (root, path, out);
+}
+
+
+string_view FileList::store_path (const char *path, size_t len)
+{
+	if (block_fill + len + 1 > block_size)
+	{
+		block_size = max ((size_t) 65536, len + 1);
+		path_blocks.emplace_back (new char[block_size]);
+		block_fill = 0;
+		allocated_path_bytes += block_size;
+	}
+
+	char *dst = path_blocks.back().get() + block_fill;
+	memcpy (dst, path, len);
+	dst[len] = '\0';
+
+	block_fill += len + 1;
+	return string_view(dst, len);
+}
+
+
+void FileList::add_entry (FileListEntry&& e)
+{
+	if (sorted && !files.empty() && !(files.back().path < e.path))
+		sorted = false;
+
+	files.emplace_back (move(e));
+}
+
+
+void FileList::add_file (const FileRecord& file)
 {
-	files.emplace (move(file));
+	FileListEntry e;
+	static_cast<FileAttributes&>(e) = file;
+	e.path = store_path (file.path.c_str(), file.path.size());
+
+	add_entry (move(e));
 }
 
 
-set<FileRecord>::const_iterator FileList::begin() const noexcept
+void FileList::add_file_from_binary (const uint8_t *buf, size_t size)
 {
+	if (size < 0x24)
+		return;
+
+	FileListEntry e;
+	e.type = *buf;
+	e.uid = le32toh (*((uint32_t*) (buf + 0x01)));
+	e.gid = le32toh (*((uint32_t*) (buf + 0x05)));
+	e.mode = le16toh (*((uint16_t*) (buf + 0x09)));
+	e.size = le32toh (*((uint32_t*) (buf + 0x0b)));
+
+	memcpy (e.sha1_sum, buf + 0xf, 20);
+	e.path = store_path ((const char*) (buf + 0x23), size - 0x24);
+
+	add_entry (move(e));
+}
+
+
+void FileList::sort () const
+{
+	if (sorted)
+		return;
+
+	stable_sort (files.begin(), files.end(), [](auto& a, auto& b) {
+		return a.path < b.path;
+	});
+
+	files.erase (unique (files.begin(), files.end(), [](auto& a, auto& b) {
+		return a.path == b.path;
+	}), files.end());
+
+	sorted = true;
+}
+
+
+size_t FileList::size () const
+{
+	sort();
+	return files.size();
+}
+
+size_t FileList::memory_usage () const
+{
+	return files.capacity() * sizeof(FileListEntry) + allocated_path_bytes;
+}
+
+
+FileList::const_iterator FileList::begin() const
+{
+	sort();
 	return files.cbegin();
 }
 
 
-set<FileRecord>::const_iterator FileList::end() const noexcept
+FileList::const_iterator FileList::end() const
 {
+	sort();
 	return files.cend();
 }
 
 
-set<FileRecord>::const_iterator FileList::find(const FileRecord& file) const
+FileList::const_iterator FileList::find(const FileRecord& file) const
 {
-	return files.find(file);
+	sort();
+
+	auto i = lower_bound (files.cbegin(), files.cend(), file.path,
+			[](auto& e, auto& path) {
+				return e.path < path;
+			});
+
+	if (i != files.cend() && i->path == file.path)
+		return i;
+
+	return files.cend();
 }
@@ -6,8 +6,9 @@
 
 #include <memory>
 #include <ostream>
-#include <set>
 #include <string>
+#include <string_view>
+#include <vector>
 #include "common_utilities.h"
 #include "package_meta_data.h"
 
@@ -18,14 +19,23 @@ namespace TransportForm {
 }
 
 
-struct FileRecord
+/* The stored attributes of a file except for its path */
+struct FileAttributes
 {
-	/* Stored attributes */
 	uint8_t type = FILE_TYPE_REGULAR;
 	uint32_t uid = 0, gid = 0;
 	uint16_t mode = 0;
 	uint32_t size = 0;
 	char sha1_sum[20] = { 0 };
+
+	/* See FileRecord::non_existent_or_matches */
+	bool non_existent_or_matches (const std::string& root, std::string_view path,
+			std::ostream *out) const;
+};
+
+
+struct FileRecord : public FileAttributes
+{
 	std::string path;
 
 	FileRecord();
@@ -68,19 +78,64 @@ struct DummyFileRecord : public FileRecord
 };
 
 
+/* A compact, read-only file record in a FileList. The path points into the
+ * FileList's storage (and is null-terminated); hence it is only valid as long
+ * as the FileList exists. */
+struct FileListEntry : public FileAttributes
+{
+	std::string_view path;
+
+	bool non_existent_or_matches (const std::string& root, std::ostream *out = nullptr) const;
+};
+
+
+/* A set of files sorted by path. Entries are stored in a contiguous array and
+ * paths in a few large blocks, which is much more compact than individual
+ * FileRecords and cache-friendly to iterate over. */
 class FileList
 {
+public:
+	typedef std::vector<FileListEntry>::const_iterator const_iterator;
+
 private:
-	std::set<FileRecord> files;
+	/* Files are sorted lazily; if a path is added twice, the first entry
+	 * wins (like with a set). */
+	mutable std::vector<FileListEntry> files;
+	mutable bool sorted = true;
+
+	/* Blocks are never reallocated such that the paths stay valid. */
+	std::vector<std::unique_ptr<char[]>> path_blocks;
+	size_t block_size = 0;
+	size_t block_fill = 0;
+	size_t allocated_path_bytes = 0;
+
+	std::string_view store_path (const char *path, size_t len);
+	void add_entry (FileListEntry&& e);
 
 public:
-	/* Attention: File is moved. */
-	void add_file (FileRecord&& file);
+	FileList () = default;
+	FileList (const FileList&) = delete;
+	FileList& operator= (const FileList&) = delete;
+
+	void add_file (const FileRecord& file);
+
+	/* Add a file record from its binary representation (see
+	 * FileRecord::from_binary). */
+	void add_file_from_binary (const uint8_t *buf, size_t size);
+
+	/* Sort the files now instead of on first access. The list must not be
+	 * modified afterwards if it is accessed by multiple threads. */
+	void sort () const;
+
+	size_t size () const;
+
+	/* Approximate number of bytes allocated by the list */
+	size_t memory_usage () const;
 
-	std::set<FileRecord>::const_iterator begin() const noexcept;
-	std::set<FileRecord>::const_iterator end() const noexcept;
+	const_iterator begin() const;
+	const_iterator end() const;
 
-	std::set<FileRecord>::const_iterator find(const FileRecord& file) const;
+	const_iterator find(const FileRecord& file) const;
 };
 
 #endif /* __FILE_LIST_H */
@@ -0,0 +1,645 @@
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "tpm2_config.h"
+#include "section_codecs.h"
+#include "common_utilities.h"
+
+extern "C" {
+#include <zlib.h>
+#include <lzma.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+}
+
+using namespace std;
+
+
+namespace TransportForm
+{
+
+
+bool encoding_valid (uint8_t encoding)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_STORED:
+		case SEC_ENCODING_GZIP:
+		case SEC_ENCODING_XZ:
+		case SEC_ENCODING_ZSTD:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+bool encoding_supported (uint8_t encoding)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_STORED:
+		case SEC_ENCODING_GZIP:
+		case SEC_ENCODING_XZ:
+			return true;
+
+#ifdef WITH_ZSTD
+		case SEC_ENCODING_ZSTD:
+			return true;
+#endif
+
+		default:
+			return false;
+	}
+}
+
+
+string encoding_to_string (uint8_t encoding)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_STORED:
+			return "none";
+
+		case SEC_ENCODING_GZIP:
+			return "gzip";
+
+		case SEC_ENCODING_XZ:
+			return "xz";
+
+		case SEC_ENCODING_ZSTD:
+			return "zstd";
+
+		default:
+			return "invalid";
+	}
+}
+
+
+optional<uint8_t> encoding_from_string (const string& name)
+{
+	if (name == "none")
+		return SEC_ENCODING_STORED;
+	else if (name == "gzip")
+		return SEC_ENCODING_GZIP;
+	else if (name == "xz")
+		return SEC_ENCODING_XZ;
+	else if (name == "zstd")
+		return SEC_ENCODING_ZSTD;
+
+	return nullopt;
+}
+
+
+optional<pair<int, int>> compression_level_range (uint8_t encoding)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_GZIP:
+			return make_pair (Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+
+		case SEC_ENCODING_XZ:
+			return make_pair (0, 9);
+
+#ifdef WITH_ZSTD
+		case SEC_ENCODING_ZSTD:
+			return make_pair (1, ZSTD_maxCLevel());
+#endif
+
+		default:
+			return nullopt;
+	}
+}
+
+
+Compressor::~Compressor()
+{
+}
+
+Decompressor::~Decompressor()
+{
+}
+
+
+/* gzip */
+class GzipCompressor : public Compressor
+{
+protected:
+	z_stream zs;
+
+public:
+	GzipCompressor (int level)
+	{
+		memset (&zs, 0, sizeof(zs));
+
+		/* windowBits + 16 creates a gzip member, such that a section can be
+		 * extracted with common tools, too. */
+		auto ret = deflateInit2 (&zs, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+				Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+
+		if (ret == Z_STREAM_ERROR)
+			throw system_error (error_code (EINVAL, generic_category()),
+					"Invalid gzip compression level " + to_string (level));
+		else if (ret == Z_MEM_ERROR)
+			throw bad_alloc();
+		else if (ret != Z_OK)
+			throw system_error (error_code (EIO, generic_category()));
+	}
+
+	~GzipCompressor ()
+	{
+		deflateEnd (&zs);
+	}
+
+	int compress (const char *buf, size_t size, bool finish,
+			const function<int(const char*, size_t)>& out) override
+	{
+		char obuf[16384];
+		int ret;
+
+		do {
+			/* avail_in is only an uInt */
+			size_t chunk = MIN(size, (size_t) 1 << 30);
+			bool last = chunk == size;
+
+			zs.next_in = (Bytef*) buf;
+			zs.avail_in = chunk;
+
+			do {
+				zs.next_out = (Bytef*) obuf;
+				zs.avail_out = sizeof(obuf);
+
+				ret = deflate (&zs, finish && last ? Z_FINISH : Z_NO_FLUSH);
+				if (ret == Z_STREAM_ERROR)
+					return -EIO;
+
+				auto r = out (obuf, sizeof(obuf) - zs.avail_out);
+				if (r != 0)
+					return r;
+
+			} while (zs.avail_out == 0 || (finish && last && ret != Z_STREAM_END));
+
+			buf += chunk;
+			size -= chunk;
+
+		} while (size > 0);
+
+		return 0;
+	}
+};
+
+class GzipDecompressor : public Decompressor
+{
+protected:
+	z_stream zs;
+
+public:
+	GzipDecompressor ()
+	{
+		memset (&zs, 0, sizeof(zs));
+
+		if (inflateInit2 (&zs, 15 + 16) != Z_OK)
+			throw bad_alloc();
+	}
+
+	~GzipDecompressor ()
+	{
+		inflateEnd (&zs);
+	}
+
+	void reset () override
+	{
+		if (inflateReset (&zs) != Z_OK)
+			throw system_error (error_code (EIO, generic_category()));
+	}
+
+	void decode (const char*& in, size_t& in_size, char*& out, size_t& out_size) override
+	{
+		while (in_size > 0 && out_size > 0)
+		{
+			zs.next_in = (Bytef*) in;
+			zs.avail_in = MIN(in_size, (size_t) 1 << 30);
+			zs.next_out = (Bytef*) out;
+			zs.avail_out = MIN(out_size, (size_t) 1 << 30);
+
+			auto avail_in = zs.avail_in;
+			auto avail_out = zs.avail_out;
+
+			int ret = inflate (&zs, Z_NO_FLUSH);
+
+			in += avail_in - zs.avail_in;
+			in_size -= avail_in - zs.avail_in;
+			out += avail_out - zs.avail_out;
+			out_size -= avail_out - zs.avail_out;
+
+			/* A section may consist of multiple gzip members */
+			if (ret == Z_STREAM_END)
+				reset();
+			else if (ret == Z_MEM_ERROR)
+				throw bad_alloc();
+			else if (ret != Z_OK)
+				throw system_error (error_code (EIO, generic_category()));
+		}
+	}
+};
+
+
+/* xz */
+class XzCompressor : public Compressor
+{
+protected:
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+public:
+	XzCompressor (int level)
+	{
+		auto ret = lzma_easy_encoder (&strm, level < 0 ? LZMA_PRESET_DEFAULT : level,
+				LZMA_CHECK_CRC64);
+
+		if (ret == LZMA_MEM_ERROR)
+			throw bad_alloc();
+		else if (ret != LZMA_OK)
+			throw system_error (error_code (EINVAL, generic_category()),
+					"Invalid xz compression level " + to_string (level));
+	}
+
+	~XzCompressor ()
+	{
+		lzma_end (&strm);
+	}
+
+	int compress (const char *buf, size_t size, bool finish,
+			const function<int(const char*, size_t)>& out) override
+	{
+		char obuf[16384];
+		lzma_ret ret;
+
+		strm.next_in = (const uint8_t*) buf;
+		strm.avail_in = size;
+
+		do {
+			strm.next_out = (uint8_t*) obuf;
+			strm.avail_out = sizeof(obuf);
+
+			ret = lzma_code (&strm, finish ? LZMA_FINISH : LZMA_RUN);
+			if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+				return ret == LZMA_MEM_ERROR ? -ENOMEM : -EIO;
+
+			auto r = out (obuf, sizeof(obuf) - strm.avail_out);
+			if (r != 0)
+				return r;
+
+		} while (strm.avail_in > 0 || strm.avail_out == 0 || (finish && ret != LZMA_STREAM_END));
+
+		return 0;
+	}
+};
+
+class XzDecompressor : public Decompressor
+{
+protected:
+	lzma_stream strm = LZMA_STREAM_INIT;
+
+public:
+	XzDecompressor ()
+	{
+		reset();
+	}
+
+	~XzDecompressor ()
+	{
+		lzma_end (&strm);
+	}
+
+	void reset () override
+	{
+		/* Reinitializing reuses the decoder's memory */
+		auto ret = lzma_stream_decoder (&strm, UINT64_MAX, 0);
+		if (ret == LZMA_MEM_ERROR)
+			throw bad_alloc();
+		else if (ret != LZMA_OK)
+			throw system_error (error_code (EIO, generic_category()));
+	}
+
+	void decode (const char*& in, size_t& in_size, char*& out, size_t& out_size) override
+	{
+		while (in_size > 0 && out_size > 0)
+		{
+			strm.next_in = (const uint8_t*) in;
+			strm.avail_in = in_size;
+			strm.next_out = (uint8_t*) out;
+			strm.avail_out = out_size;
+
+			auto ret = lzma_code (&strm, LZMA_RUN);
+
+			in += in_size - strm.avail_in;
+			in_size = strm.avail_in;
+			out += out_size - strm.avail_out;
+			out_size = strm.avail_out;
+
+			/* A section may consist of multiple xz streams */
+			if (ret == LZMA_STREAM_END)
+				reset();
+			else if (ret == LZMA_MEM_ERROR)
+				throw bad_alloc();
+			else if (ret != LZMA_OK)
+				throw system_error (error_code (EIO, generic_category()));
+		}
+	}
+};
+
+
+#ifdef WITH_ZSTD
+/* zstd */
+class ZstdCompressor : public Compressor
+{
+protected:
+	ZSTD_CCtx *cctx;
+
+public:
+	ZstdCompressor (int level)
+	{
+		cctx = ZSTD_createCCtx();
+		if (!cctx)
+			throw bad_alloc();
+
+		if (level >= 0)
+		{
+			if (ZSTD_isError (ZSTD_CCtx_setParameter (cctx, ZSTD_c_compressionLevel, level)))
+			{
+				ZSTD_freeCCtx (cctx);
+				throw system_error (error_code (EINVAL, generic_category()),
+						"Invalid zstd compression level " + to_string (level));
+			}
+		}
+
+		/* The content checksum detects corruption like the other codecs do */
+		ZSTD_CCtx_setParameter (cctx, ZSTD_c_checksumFlag, 1);
+	}
+
+	~ZstdCompressor ()
+	{
+		ZSTD_freeCCtx (cctx);
+	}
+
+	int compress (const char *buf, size_t size, bool finish,
+			const function<int(const char*, size_t)>& out) override
+	{
+		char obuf[16384];
+		ZSTD_inBuffer ib = { buf, size, 0 };
+		size_t remaining;
+
+		do {
+			ZSTD_outBuffer ob = { obuf, sizeof(obuf), 0 };
+
+			remaining = ZSTD_compressStream2 (cctx, &ob, &ib,
+					finish ? ZSTD_e_end : ZSTD_e_continue);
+
+			if (ZSTD_isError (remaining))
+				return -EIO;
+
+			auto r = out (obuf, ob.pos);
+			if (r != 0)
+				return r;
+
+		} while (ib.pos < ib.size || (finish && remaining > 0));
+
+		return 0;
+	}
+};
+
+class ZstdDecompressor : public Decompressor
+{
+protected:
+	ZSTD_DCtx *dctx;
+
+public:
+	ZstdDecompressor ()
+	{
+		dctx = ZSTD_createDCtx();
+		if (!dctx)
+			throw bad_alloc();
+	}
+
+	~ZstdDecompressor ()
+	{
+		ZSTD_freeDCtx (dctx);
+	}
+
+	void reset () override
+	{
+		ZSTD_DCtx_reset (dctx, ZSTD_reset_session_only);
+	}
+
+	void decode (const char*& in, size_t& in_size, char*& out, size_t& out_size) override
+	{
+		/* Frames following each other are decoded as one stream */
+		while (in_size > 0 && out_size > 0)
+		{
+			ZSTD_inBuffer ib = { in, in_size, 0 };
+			ZSTD_outBuffer ob = { out, out_size, 0 };
+
+			auto ret = ZSTD_decompressStream (dctx, &ob, &ib);
+			if (ZSTD_isError (ret))
+				throw system_error (error_code (EIO, generic_category()));
+
+			in += ib.pos;
+			in_size -= ib.pos;
+			out += ob.pos;
+			out_size -= ob.pos;
+		}
+	}
+};
+#endif
+
+
+unique_ptr<Compressor> create_compressor (uint8_t encoding, int level)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_GZIP:
+			return make_unique<GzipCompressor> (level);
+
+		case SEC_ENCODING_XZ:
+			return make_unique<XzCompressor> (level);
+
+#ifdef WITH_ZSTD
+		case SEC_ENCODING_ZSTD:
+			return make_unique<ZstdCompressor> (level);
+#endif
+
+		default:
+			return nullptr;
+	}
+}
+
+
+unique_ptr<Decompressor> create_decompressor (uint8_t encoding)
+{
+	switch (encoding)
+	{
+		case SEC_ENCODING_GZIP:
+			return make_unique<GzipDecompressor>();
+
+		case SEC_ENCODING_XZ:
+			return make_unique<XzDecompressor>();
+
+#ifdef WITH_ZSTD
+		case SEC_ENCODING_ZSTD:
+			return make_unique<ZstdDecompressor>();
+#endif
+
+		default:
+			throw gp_exception ("Unsupported section encoding '" +
+					encoding_to_string (encoding) + "'");
+	}
+}
+
+
+
+/* Compress one block into a complete stream */
+static int compress_block (uint8_t encoding, int level, const char *buf, size_t size,
+		vector<char>& dst)
+{
+	try
+	{
+		auto c = create_compressor (encoding, level);
+		if (!c)
+			return -ENOTSUP;
+
+		return c->compress (buf, size, true, [&dst](const char *b, size_t s) {
+			dst.insert (dst.end(), b, b + s);
+			return 0;
+		});
+	}
+	catch (bad_alloc&)
+	{
+		return -ENOMEM;
+	}
+	catch (system_error& e)
+	{
+		return -e.code().value();
+	}
+}
+
+
+int compress_parallel (uint8_t encoding, int level, const char *buf, size_t size,
+		unsigned threads, const function<int(const char*, size_t)>& out,
+		size_t block_size)
+{
+	if (threads == 0 || block_size == 0)
+		return -EINVAL;
+
+	const size_t n_blocks = (size + block_size - 1) / block_size;
+	if (n_blocks == 0)
+		return 0;
+
+	threads = MIN((size_t) threads, n_blocks);
+
+	struct Block
+	{
+		vector<char> data;
+		int ret = 0;
+		bool done = false;
+	};
+
+	vector<Block> blocks(n_blocks);
+
+	/* Workers may run at most window blocks ahead of the writer to bound
+	 * memory usage. */
+	const size_t window = 2 * threads;
+
+	mutex m;
+	condition_variable cv;
+	size_t next = 0;
+	size_t written = 0;
+	bool abort = false;
+
+	auto worker = [&]() {
+		unique_lock<mutex> lk(m);
+
+		for (;;)
+		{
+			cv.wait (lk, [&]() {
+				return abort || next >= n_blocks || next < written + window;
+			});
+
+			if (abort || next >= n_blocks)
+				return;
+
+			auto i = next++;
+			lk.unlock();
+
+			auto offset = i * block_size;
+			auto ret = compress_block (encoding, level, buf + offset,
+					MIN(block_size, size - offset), blocks[i].data);
+
+			lk.lock();
+			blocks[i].ret = ret;
+			blocks[i].done = true;
+			cv.notify_all();
+		}
+	};
+
+	vector<thread> workers;
+
+	try
+	{
+		for (unsigned i = 0; i < threads; i++)
+			workers.emplace_back (worker);
+	}
+	catch (system_error& e)
+	{
+		/* Continue with the threads that could be created */
+		if (workers.empty())
+			return -e.code().value();
+	}
+
+	/* Pass the blocks on in order */
+	int ret = 0;
+
+	{
+		unique_lock<mutex> lk(m);
+
+		while (written < n_blocks)
+		{
+			auto& b = blocks[written];
+			cv.wait (lk, [&b]() { return b.done; });
+
+			if (b.ret != 0)
+			{
+				ret = b.ret;
+				break;
+			}
+
+			lk.unlock();
+			ret = out (b.data.data(), b.data.size());
+			lk.lock();
+
+			if (ret != 0)
+				break;
+
+			vector<char>().swap (b.data);
+			written++;
+			cv.notify_all();
+		}
+
+		abort = ret != 0;
+		cv.notify_all();
+	}
+
+	for (auto& t : workers)
+		t.join();
+
+	return ret;
+}
+
+
+}
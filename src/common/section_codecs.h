@@ -0,0 +1,99 @@
+/* This file is part of the TSClient LEGACY Package manager
+ *
+ * This module contains the compressors and decompressors for the sections of
+ * transport forms. */
+
+#ifndef __SECTION_CODECS_H
+#define __SECTION_CODECS_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+
+
+namespace TransportForm
+{
+	/* How a section is stored in transport forms of version 2 and later */
+	const uint8_t SEC_ENCODING_STORED = 0x00;
+	const uint8_t SEC_ENCODING_GZIP = 0x01;
+	const uint8_t SEC_ENCODING_XZ = 0x02;
+	const uint8_t SEC_ENCODING_ZSTD = 0x03;
+
+	/* @returns true if @param encoding is a valid encoding id, regardless of
+	 * whether it is supported by this build. */
+	bool encoding_valid (uint8_t encoding);
+
+	/* @returns true if sections with @param encoding can be written and read. */
+	bool encoding_supported (uint8_t encoding);
+
+	/* Names for the user interface; the functions are inverse. */
+	std::string encoding_to_string (uint8_t encoding);
+	std::optional<uint8_t> encoding_from_string (const std::string& name);
+
+	/* @returns the range of compression levels (inclusive) accepted by the
+	 * codec of @param encoding, or nullopt if the encoding is not supported
+	 * or does not take a level. */
+	std::optional<std::pair<int, int>> compression_level_range (uint8_t encoding);
+
+
+	class Compressor
+	{
+	public:
+		virtual ~Compressor() = 0;
+
+		/* Compress @param size bytes from @param buf and pass the compressed
+		 * data to @param out, which returns 0 on success or a -errno value. If
+		 * @param finish is true, the compressed stream is terminated.
+		 *
+		 * @returns 0 on success or -errno value in case of error */
+		virtual int compress (const char *buf, size_t size, bool finish,
+				const std::function<int(const char*, size_t)>& out) = 0;
+	};
+
+	class Decompressor
+	{
+	public:
+		virtual ~Decompressor() = 0;
+
+		/* Prepare for decoding a new section. */
+		virtual void reset () = 0;
+
+		/* Decode from @param in into @param out until either the input is
+		 * consumed or the output is full. Pointers and sizes are advanced.
+		 * Streams following each other are decoded as one.
+		 *
+		 * @raises std::system_error if the data is corrupt. */
+		virtual void decode (const char*& in, size_t& in_size,
+				char*& out, size_t& out_size) = 0;
+	};
+
+
+	/* @param level  Compression level, -1 means the codec's default.
+	 * @returns nullptr if the encoding is not supported or stored.
+	 * @raises std::system_error with EINVAL if the level is out of range. */
+	std::unique_ptr<Compressor> create_compressor (uint8_t encoding, int level = -1);
+
+	/* @raises gp_exception if the encoding is not supported. */
+	std::unique_ptr<Decompressor> create_decompressor (uint8_t encoding);
+
+
+	/* Amount of uncompressed data per independently compressed block */
+	const size_t PARALLEL_BLOCK_SIZE = 4 * 1024 * 1024;
+
+	/* Split @param size bytes from @param buf into blocks of @param block_size
+	 * bytes and compress each block into a stream of its own on @param threads
+	 * threads. The streams are passed to @param out in order, hence the output
+	 * is a sequence of concatenated streams that decompresses to the input.
+	 * Only a few blocks per thread are kept in memory at a time.
+	 *
+	 * @returns 0 on success or -errno value in case of error; the first error
+	 * returned by @param out is passed on. */
+	int compress_parallel (uint8_t encoding, int level, const char *buf, size_t size,
+			unsigned threads, const std::function<int(const char*, size_t)>& out,
+			size_t block_size = PARALLEL_BLOCK_SIZE);
+}
+
+#endif /* __SECTION_CODECS_H */
@@ -0,0 +1,1288 @@
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "tar_extractor.h"
+#include "common_utilities.h"
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+}
+
+using namespace std;
+namespace tf = TransportForm;
+
+
+static const size_t TAR_BLOCK_SIZE = 512;
+
+/* Files up to this size are handed to the writer threads, larger ones are
+ * streamed to disk by the decoding thread. The queue is bounded to limit the
+ * amount of memory that holds decoded data. */
+static const uint64_t MAX_QUEUED_FILE_SIZE = 1024 * 1024;
+static const uint64_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+static const size_t MAX_QUEUED_JOBS = 4096;
+
+
+/* A member of the archive after all extended headers have been applied */
+struct TarMember
+{
+	char type;
+	string path;
+	string link;
+
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	uint64_t size;
+	struct timespec mtime;
+
+	unsigned dev_major;
+	unsigned dev_minor;
+};
+
+
+/* Numbers are stored in octal, or in GNU's base-256 encoding if they are too
+ * large. */
+static uint64_t parse_number (const char *field, size_t size)
+{
+	auto f = (const unsigned char*) field;
+
+	if (f[0] & 0x80)
+	{
+		if (f[0] & 0x40)
+			throw gp_exception ("Negative number in tar header");
+
+		uint64_t v = f[0] & 0x3f;
+
+		for (size_t i = 1; i < size; i++)
+		{
+			if (v >> 56)
+				throw gp_exception ("Number in tar header too large");
+
+			v = (v << 8) | f[i];
+		}
+
+		return v;
+	}
+
+	size_t i = 0;
+	while (i < size && f[i] == ' ')
+		i++;
+
+	uint64_t v = 0;
+	for (; i < size && f[i] >= '0' && f[i] <= '7'; i++)
+	{
+		if (v >> 61)
+			throw gp_exception ("Number in tar header too large");
+
+		v = v * 8 + (f[i] - '0');
+	}
+
+	if (i < size && f[i] != ' ' && f[i] != '\0')
+		throw gp_exception ("Invalid number in tar header");
+
+	return v;
+}
+
+
+static bool verify_checksum (const char *header)
+{
+	auto h = (const unsigned char*) header;
+	uint64_t sum = 0;
+
+	/* The checksum field itself counts as spaces */
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : h[i];
+
+	return parse_number (header + 148, 8) == sum;
+}
+
+
+/* Data is padded to whole blocks */
+static uint64_t padding (uint64_t size)
+{
+	return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+
+static bool is_zero_block (const char *block)
+{
+	for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+	{
+		if (block[i])
+			return false;
+	}
+
+	return true;
+}
+
+
+static string parse_string (const char *field, size_t size)
+{
+	return string (field, strnlen (field, size));
+}
+
+
+/* Make a path relative to the archive's root without '.' components. Returns
+ * false if the path leaves the root. */
+static bool normalize_path (const string& path, string& rel)
+{
+	rel.clear();
+
+	size_t pos = 0;
+	while (pos < path.size())
+	{
+		auto end = path.find ('/', pos);
+		if (end == string::npos)
+			end = path.size();
+
+		auto len = end - pos;
+
+		if (len == 2 && path.compare (pos, 2, "..") == 0)
+			return false;
+
+		if (len > 0 && !(len == 1 && path[pos] == '.'))
+		{
+			if (!rel.empty())
+				rel += '/';
+
+			rel.append (path, pos, len);
+		}
+
+		pos = end + 1;
+	}
+
+	return true;
+}
+
+
+static struct timespec parse_pax_time (const string& value)
+{
+	struct timespec ts = { 0, 0 };
+
+	auto dot = value.find ('.');
+	ts.tv_sec = stoll (value.substr (0, dot));
+
+	if (dot != string::npos)
+	{
+		long mult = 100000000;
+		for (size_t i = dot + 1; i < value.size() && mult > 0; i++, mult /= 10)
+		{
+			if (value[i] < '0' || value[i] > '9')
+				break;
+
+			ts.tv_nsec += (value[i] - '0') * mult;
+		}
+	}
+
+	return ts;
+}
+
+
+/* Changing the umask to read it would affect files that other threads create
+ * meanwhile, hence it is taken from /proc/self/status. Only if that does not
+ * list it (Linux < 4.7, /proc not mounted) the umask is read by changing it,
+ * once. */
+static mode_t current_umask ()
+{
+	ifstream status("/proc/self/status");
+	string line;
+
+	while (getline (status, line))
+	{
+		if (line.compare (0, 6, "Umask:") == 0)
+			return strtoul (line.c_str() + 6, nullptr, 8) & 0777;
+	}
+
+	static const mode_t value = []() {
+		auto v = umask (0);
+		umask (v);
+		return v;
+	}();
+
+	return value;
+}
+
+
+/* Members at or below an excluded path are skipped */
+static bool is_excluded (const unordered_set<string>* excluded, const string& rel)
+{
+	if (!excluded || excluded->empty())
+		return false;
+
+	string path = "/" + rel;
+
+	for (;;)
+	{
+		if (excluded->find (path) != excluded->end())
+			return true;
+
+		auto pos = path.rfind ('/');
+		if (pos == 0 || pos == string::npos)
+			return false;
+
+		path.resize (pos);
+	}
+}
+
+
+static void make_parents (int dirfd, const string& rel, mode_t mode)
+{
+	for (auto pos = rel.find ('/'); pos != string::npos; pos = rel.find ('/', pos + 1))
+	{
+		auto parent = rel.substr (0, pos);
+
+		if (mkdirat (dirfd, parent.c_str(), mode) < 0 && errno != EEXIST)
+			throw system_error (error_code (errno, generic_category()),
+					"Failed to create directory /" + parent);
+	}
+}
+
+
+/* Create or open a file below @param dirfd without following any symlink, if
+ * the kernel supports it (Linux >= 5.6). Returns like openat. */
+static int open_beneath (int dirfd, const string& rel, int flags, mode_t mode)
+{
+#ifdef SYS_openat2
+	struct open_how how;
+	memset (&how, 0, sizeof(how));
+	how.flags = flags;
+	how.mode = mode;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+
+	int fd = syscall (SYS_openat2, dirfd, rel.c_str(), &how, sizeof(how));
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+
+	return openat (dirfd, rel.c_str(), flags, mode);
+}
+
+
+/* Run create, which returns -1 and sets errno on failure. Existing files are
+ * replaced and missing parent directories are created. */
+template<typename F>
+static int create_node (int dirfd, const string& rel, mode_t umask_value, F create)
+{
+	for (int attempt = 0; attempt < 3; attempt++)
+	{
+		int ret = create();
+		if (ret >= 0)
+			return ret;
+
+		if (errno == EEXIST)
+		{
+			if (unlinkat (dirfd, rel.c_str(), 0) < 0)
+				break;
+		}
+		else if (errno == ENOENT)
+		{
+			make_parents (dirfd, rel, 0777 & ~umask_value);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	throw system_error (error_code (errno, generic_category()),
+			"Failed to create /" + rel);
+}
+
+
+/* Create a symlink ('2') or a hardlink ('1') to @param target, which is
+ * relative to @param dirfd for hardlinks. */
+static void create_link (int dirfd, const string& rel, char type,
+		const string& target, mode_t umask_value)
+{
+	create_node (dirfd, rel, umask_value, [&]() {
+		if (type == '2')
+			return symlinkat (target.c_str(), dirfd, rel.c_str());
+		else
+			return linkat (dirfd, target.c_str(), dirfd, rel.c_str(), 0);
+	});
+}
+
+
+static void set_attributes (int dirfd, const string& rel, const TarMember& m,
+		bool same_owner, mode_t mode_mask)
+{
+	auto p = rel.empty() ? "." : rel.c_str();
+
+	/* chown clears the setuid and setgid bits, hence it must come first. */
+	if (same_owner && fchownat (dirfd, p, m.uid, m.gid, AT_SYMLINK_NOFOLLOW) < 0)
+	{
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to change owner of /" + rel);
+	}
+
+	if (m.type != '2' && fchmodat (dirfd, p, m.mode & mode_mask, 0) < 0)
+	{
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to change mode of /" + rel);
+	}
+
+	struct timespec times[2];
+	times[0].tv_sec = 0;
+	times[0].tv_nsec = UTIME_NOW;
+	times[1] = m.mtime;
+
+	if (utimensat (dirfd, p, times, AT_SYMLINK_NOFOLLOW) < 0)
+	{
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to set mtime of /" + rel);
+	}
+}
+
+
+class TarExtractor
+{
+private:
+	tf::ReadStream& rs;
+	uint64_t remaining;
+
+	int dirfd;
+	const unordered_set<string>* excluded;
+
+	bool same_owner;
+	mode_t mode_mask;
+	mode_t umask_value;
+
+	/* Directories get their final mode and mtime after all their content has
+	 * been extracted, because a read-only directory could not be filled and
+	 * its mtime would change. */
+	struct DelayedDirectory
+	{
+		string path;
+		TarMember m;
+	};
+
+	vector<DelayedDirectory> directories;
+
+	/* When staging, the extracted members are recorded and the directories'
+	 * attributes are left to commit_staged_archive. */
+	vector<StagedMember>* staged;
+
+	/* Symlinks and hardlinks are created after all other members, like GNU
+	 * tar's delayed links. Otherwise a symlink could redirect the members that
+	 * follow it out of the destination. A later member with the same path
+	 * replaces a delayed link. When staging, the links are only recorded. */
+	struct DelayedLink
+	{
+		string rel;
+		TarMember m;
+		string target;
+		bool cancelled;
+	};
+
+	vector<DelayedLink> links;
+	unordered_map<string, size_t> link_paths;
+
+	void create_links ();
+
+	unique_ptr<char[]> buf;
+	static const size_t buf_size = 65536;
+
+	/* Creating many small files is dominated by the latency of system calls,
+	 * hence small files are written by a pool of threads while the decoding
+	 * thread continues to read the archive. */
+	struct WriteJob
+	{
+		string rel;
+		TarMember m;
+
+		/* Points into the stream's memory or into buffer */
+		const char *data;
+		vector<char> buffer;
+	};
+
+	unsigned n_writers;
+	vector<thread> writers;
+
+	mutex jobs_mutex;
+	condition_variable jobs_cv;
+	condition_variable done_cv;
+	deque<WriteJob> jobs;
+	uint64_t queued_bytes = 0;
+	unsigned busy = 0;
+	bool writers_stop = false;
+	exception_ptr writer_error;
+
+	bool sync;
+
+	void start_writers ();
+	void stop_writers ();
+	void writer_loop ();
+	void enqueue (WriteJob&& job);
+
+	/* Wait until all queued files have been written.
+	 * @raises the first error of a writer thread. */
+	void wait_writers ();
+
+	void write_all (int fd, const char *data, size_t size, const string& rel);
+	void write_regular (const string& rel, const TarMember& m, const char *data);
+
+	void read (char *dst, size_t cnt);
+	void skip (uint64_t cnt);
+	void skip_data (uint64_t size);
+
+	/* Read the data of a GNU long name or pax header */
+	string read_data (uint64_t size);
+
+	template<typename F>
+	int create_node (const string& rel, F create);
+
+	int open_file (const string& rel);
+
+	void apply_metadata (const string& rel, const TarMember& m);
+
+	void extract_regular (const string& rel, const TarMember& m);
+	void extract_directory (const string& rel, const TarMember& m);
+	void extract_link (const string& rel, const TarMember& m, const string& target);
+	void extract_special (const string& rel, const TarMember& m);
+
+	void extract_member (const TarMember& m);
+
+public:
+	TarExtractor (tf::ReadStream& rs, uint64_t size, const string& dst,
+			const unordered_set<string>* excluded, unsigned n_writers, bool sync,
+			vector<StagedMember>* staged = nullptr);
+	~TarExtractor ();
+
+	void run ();
+};
+
+
+TarExtractor::TarExtractor (tf::ReadStream& rs, uint64_t size, const string& dst,
+		const unordered_set<string>* excluded, unsigned n_writers, bool sync,
+		vector<StagedMember>* staged)
+	:
+		rs(rs), remaining(size), excluded(excluded), staged(staged),
+		buf(new char[buf_size]), n_writers(n_writers), sync(sync)
+{
+	dirfd = open (dst.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to open " + dst);
+
+	/* Like tar, only root restores owners and permissions exactly. */
+	same_owner = geteuid() == 0;
+
+	umask_value = current_umask();
+
+	mode_mask = same_owner ? 07777 : (0777 & ~umask_value);
+}
+
+
+TarExtractor::~TarExtractor ()
+{
+	stop_writers();
+	close (dirfd);
+}
+
+
+void TarExtractor::start_writers ()
+{
+	if (n_writers <= 1)
+		return;
+
+	try
+	{
+		for (unsigned i = 0; i < n_writers; i++)
+			writers.emplace_back (&TarExtractor::writer_loop, this);
+	}
+	catch (system_error&)
+	{
+		/* Continue with the threads that could be created, or serially */
+	}
+}
+
+
+void TarExtractor::stop_writers ()
+{
+	{
+		unique_lock<mutex> lk(jobs_mutex);
+		writers_stop = true;
+		jobs.clear();
+	}
+
+	jobs_cv.notify_all();
+
+	for (auto& t : writers)
+		t.join();
+
+	writers.clear();
+}
+
+
+void TarExtractor::writer_loop ()
+{
+	unique_lock<mutex> lk(jobs_mutex);
+
+	for (;;)
+	{
+		jobs_cv.wait (lk, [this]() { return writers_stop || !jobs.empty(); });
+
+		if (jobs.empty())
+			return;
+
+		auto job = move (jobs.front());
+		jobs.pop_front();
+		busy++;
+
+		lk.unlock();
+
+		exception_ptr err;
+
+		try
+		{
+			write_regular (job.rel, job.m, job.data);
+		}
+		catch (...)
+		{
+			err = current_exception();
+		}
+
+		lk.lock();
+
+		busy--;
+		queued_bytes -= job.m.size;
+
+		/* Stop on the first error */
+		if (err && !writer_error)
+		{
+			writer_error = err;
+
+			for (auto& j : jobs)
+				queued_bytes -= j.m.size;
+
+			jobs.clear();
+		}
+
+		done_cv.notify_all();
+	}
+}
+
+
+void TarExtractor::enqueue (WriteJob&& job)
+{
+	unique_lock<mutex> lk(jobs_mutex);
+
+	done_cv.wait (lk, [this]() {
+		return writer_error ||
+			(jobs.size() < MAX_QUEUED_JOBS && queued_bytes < MAX_QUEUED_BYTES);
+	});
+
+	if (writer_error)
+		rethrow_exception (writer_error);
+
+	queued_bytes += job.m.size;
+	jobs.push_back (move (job));
+	jobs_cv.notify_one();
+}
+
+
+void TarExtractor::wait_writers ()
+{
+	if (writers.empty())
+		return;
+
+	unique_lock<mutex> lk(jobs_mutex);
+	done_cv.wait (lk, [this]() { return jobs.empty() && busy == 0; });
+
+	if (writer_error)
+		rethrow_exception (writer_error);
+}
+
+
+void TarExtractor::read (char *dst, size_t cnt)
+{
+	if (cnt > remaining)
+		throw gp_exception ("Truncated tar archive");
+
+	rs.read (dst, cnt);
+	remaining -= cnt;
+}
+
+
+void TarExtractor::skip (uint64_t cnt)
+{
+	if (cnt > remaining)
+		throw gp_exception ("Truncated tar archive");
+
+	rs.seek (rs.tell() + cnt);
+	remaining -= cnt;
+}
+
+
+void TarExtractor::skip_data (uint64_t size)
+{
+	if (size > remaining)
+		throw gp_exception ("Truncated tar archive");
+
+	skip (size + padding (size));
+}
+
+
+string TarExtractor::read_data (uint64_t size)
+{
+	/* Guard against absurd sizes of corrupt archives */
+	if (size > remaining)
+		throw gp_exception ("Truncated tar archive");
+
+	string s(size, '\0');
+	read (s.data(), size);
+	skip (padding (size));
+
+	return s;
+}
+
+
+template<typename F>
+int TarExtractor::create_node (const string& rel, F create)
+{
+	return ::create_node (dirfd, rel, umask_value, create);
+}
+
+
+int TarExtractor::open_file (const string& rel)
+{
+	const int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+
+	return create_node (rel, [&]() {
+		/* The staging directory contains no symlinks because they are
+		 * delayed, refusing to follow them guards the archive's data
+		 * nonetheless. The destination may contain symlinks to directories
+		 * legitimately (e.g. /lib -> usr/lib). */
+		if (staged)
+			return open_beneath (dirfd, rel, flags, 0600);
+		else
+			return openat (dirfd, rel.c_str(), flags, 0600);
+	});
+}
+
+
+void TarExtractor::apply_metadata (const string& rel, const TarMember& m)
+{
+	set_attributes (dirfd, rel, m, same_owner, mode_mask);
+}
+
+
+void TarExtractor::write_all (int fd, const char *data, size_t size, const string& rel)
+{
+	for (size_t written = 0; written < size;)
+	{
+		auto ret = ::write (fd, data + written, size - written);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			throw system_error (error_code (errno, generic_category()),
+					"Failed to write /" + rel);
+		}
+
+		written += ret;
+	}
+}
+
+
+/* Runs on the writer threads */
+void TarExtractor::write_regular (const string& rel, const TarMember& m, const char *data)
+{
+	int fd = open_file (rel);
+
+	try
+	{
+		write_all (fd, data, m.size, rel);
+	}
+	catch (...)
+	{
+		close (fd);
+		throw;
+	}
+
+	if (close (fd) < 0)
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to write /" + rel);
+
+	apply_metadata (rel, m);
+}
+
+
+void TarExtractor::extract_regular (const string& rel, const TarMember& m)
+{
+	if (!writers.empty() && m.size <= MAX_QUEUED_FILE_SIZE)
+	{
+		if (m.size > remaining)
+			throw gp_exception ("Truncated tar archive");
+
+		WriteJob job{rel, m, nullptr, {}};
+
+		/* Avoid copying the data if it is in memory already */
+		if (m.size > 0)
+		{
+			job.data = rs.read_view (m.size);
+			if (job.data)
+				remaining -= m.size;
+			else
+			{
+				job.buffer.resize (m.size);
+				read (job.buffer.data(), m.size);
+				job.data = job.buffer.data();
+			}
+		}
+
+		skip (padding (m.size));
+		enqueue (move (job));
+		return;
+	}
+
+	int fd = open_file (rel);
+
+	try
+	{
+		uint64_t to_copy = m.size;
+
+		while (to_copy > 0)
+		{
+			size_t chunk = MIN(to_copy, (uint64_t) buf_size);
+			if (chunk > remaining)
+				throw gp_exception ("Truncated tar archive");
+
+			/* Write directly from the stream's memory if possible */
+			const char *data = rs.read_view (chunk);
+			if (data)
+				remaining -= chunk;
+			else
+			{
+				read (buf.get(), chunk);
+				data = buf.get();
+			}
+
+			write_all (fd, data, chunk, rel);
+			to_copy -= chunk;
+		}
+
+		skip (padding (m.size));
+	}
+	catch (...)
+	{
+		close (fd);
+		throw;
+	}
+
+	if (close (fd) < 0)
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to write /" + rel);
+
+	apply_metadata (rel, m);
+}
+
+
+void TarExtractor::extract_directory (const string& rel, const TarMember& m)
+{
+	if (!rel.empty())
+	{
+		struct stat st;
+
+		/* Keep existing directories but replace anything else */
+		if (fstatat (dirfd, rel.c_str(), &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+				!S_ISDIR (st.st_mode))
+		{
+			/* A writer thread may have created it as parent directory in
+			 * the meantime. */
+			create_node (rel, [&]() {
+				auto ret = mkdirat (dirfd, rel.c_str(), 0700);
+				if (ret < 0 && errno == EEXIST &&
+						fstatat (dirfd, rel.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+						S_ISDIR (st.st_mode))
+				{
+					return 0;
+				}
+
+				return ret;
+			});
+		}
+	}
+
+	skip_data (m.size);
+	directories.push_back ({rel, m});
+}
+
+
+void TarExtractor::extract_link (const string& rel, const TarMember& m,
+		const string& target)
+{
+	skip_data (m.size);
+
+	if (staged)
+		return;
+
+	link_paths[rel] = links.size();
+	links.push_back ({rel, m, target, false});
+}
+
+
+void TarExtractor::create_links ()
+{
+	for (auto& l : links)
+	{
+		if (l.cancelled)
+			continue;
+
+		create_link (dirfd, l.rel, l.m.type, l.target, umask_value);
+
+		if (l.m.type == '2')
+			apply_metadata (l.rel, l.m);
+	}
+}
+
+
+void TarExtractor::extract_special (const string& rel, const TarMember& m)
+{
+	mode_t type = m.type == '3' ? S_IFCHR : (m.type == '4' ? S_IFBLK : S_IFIFO);
+
+	create_node (rel, [&]() {
+		return mknodat (dirfd, rel.c_str(), type | 0600,
+				makedev (m.dev_major, m.dev_minor));
+	});
+
+	skip_data (m.size);
+	apply_metadata (rel, m);
+}
+
+
+void TarExtractor::extract_member (const TarMember& m)
+{
+	string rel;
+	if (!normalize_path (m.path, rel))
+		throw gp_exception ("Unsafe path in tar archive: " + m.path);
+
+	if (is_excluded (excluded, rel))
+	{
+		skip_data (m.type == '1' || m.type == '2' ? 0 : m.size);
+		return;
+	}
+
+	if (rel.empty() && m.type != '5')
+		throw gp_exception ("Invalid member of tar archive: " + m.path);
+
+	string target;
+	if (m.type == '2')
+		target = m.link;
+	else if (m.type == '1' && (!normalize_path (m.link, target) || target.empty()))
+		throw gp_exception ("Invalid hardlink target in tar archive: " + m.link);
+
+	if (staged && m.type != 'V')
+	{
+		staged->push_back ({rel, m.type == '5', m.mode, m.uid, m.gid, m.mtime,
+				m.type == '1' || m.type == '2' ? m.type : (char) 0, target});
+	}
+
+	/* A member replaces a delayed link of the same path */
+	if (!link_paths.empty())
+	{
+		auto i = link_paths.find (rel);
+		if (i != link_paths.end())
+		{
+			links[i->second].cancelled = true;
+			link_paths.erase (i);
+		}
+	}
+
+	switch (m.type)
+	{
+		case '5':
+			extract_directory (rel, m);
+			break;
+
+		case '2':
+		case '1':
+			extract_link (rel, m, target);
+			break;
+
+		case '3':
+		case '4':
+		case '6':
+			extract_special (rel, m);
+			break;
+
+		case 'S':
+		case 'M':
+			throw gp_exception ("Unsupported member type in tar archive: " + m.path);
+
+		case 'V':
+			skip_data (m.size);
+			break;
+
+		default:
+			/* Like tar, treat unknown types as regular files */
+			extract_regular (rel, m);
+			break;
+	}
+}
+
+
+void TarExtractor::run ()
+{
+	char header[TAR_BLOCK_SIZE];
+
+	start_writers();
+
+	/* Values of GNU long name and pax extended headers apply to the next
+	 * member. */
+	string long_name, long_link;
+	map<string, string> pax;
+
+	while (remaining >= TAR_BLOCK_SIZE)
+	{
+		read (header, sizeof(header));
+
+		/* The end of the archive is marked with zero blocks */
+		if (is_zero_block (header))
+			break;
+
+		if (!verify_checksum (header))
+			throw gp_exception ("Invalid checksum in tar header");
+
+		TarMember m;
+		m.type = header[156];
+		m.size = parse_number (header + 124, 12);
+
+		switch (m.type)
+		{
+			case 'L':
+				long_name = read_data (m.size);
+				long_name.resize (strnlen (long_name.c_str(), long_name.size()));
+				continue;
+
+			case 'K':
+				long_link = read_data (m.size);
+				long_link.resize (strnlen (long_link.c_str(), long_link.size()));
+				continue;
+
+			case 'x':
+			{
+				auto data = read_data (m.size);
+
+				/* Records have the form "<length> <key>=<value>\n", where length
+				 * includes the whole record. */
+				size_t pos = 0;
+				while (pos < data.size())
+				{
+					auto sp = data.find (' ', pos);
+					if (sp == string::npos || sp == pos || sp - pos > 20 ||
+							data.find_first_not_of ("0123456789", pos) != sp)
+						throw gp_exception ("Invalid pax header in tar archive");
+
+					size_t len = stoull (data.substr (pos, sp - pos));
+					if (len > data.size() - pos || sp >= pos + len)
+						throw gp_exception ("Invalid pax header in tar archive");
+
+					auto end = pos + len - 1;
+					auto eq = data.find ('=', sp + 1);
+
+					if (eq == string::npos || eq == sp + 1 || eq >= end ||
+							data[end] != '\n')
+						throw gp_exception ("Invalid pax header in tar archive");
+
+					pax[data.substr (sp + 1, eq - sp - 1)] =
+						data.substr (eq + 1, end - eq - 1);
+
+					pos += len;
+				}
+
+				continue;
+			}
+
+			case 'g':
+				skip_data (m.size);
+				continue;
+
+			default:
+				break;
+		}
+
+		/* A regular member */
+		if (!long_name.empty())
+			m.path = long_name;
+		else
+		{
+			m.path = parse_string (header, 100);
+
+			/* POSIX ustar splits long names into a prefix and a name */
+			if (memcmp (header + 257, "ustar\0", 6) == 0 && header[345])
+				m.path = parse_string (header + 345, 155) + "/" + m.path;
+		}
+
+		m.link = long_link.empty() ? parse_string (header + 157, 100) : long_link;
+
+		m.mode = parse_number (header + 100, 8) & 07777;
+		m.uid = parse_number (header + 108, 8);
+		m.gid = parse_number (header + 116, 8);
+		m.mtime.tv_sec = parse_number (header + 136, 12);
+		m.mtime.tv_nsec = 0;
+		m.dev_major = parse_number (header + 329, 8);
+		m.dev_minor = parse_number (header + 337, 8);
+
+		try
+		{
+			for (auto& [key, value] : pax)
+			{
+				if (key == "path")
+					m.path = value;
+				else if (key == "linkpath")
+					m.link = value;
+				else if (key == "size")
+					m.size = stoull (value);
+				else if (key == "uid")
+					m.uid = stoul (value);
+				else if (key == "gid")
+					m.gid = stoul (value);
+				else if (key == "mtime")
+					m.mtime = parse_pax_time (value);
+			}
+		}
+		catch (const logic_error&)
+		{
+			throw gp_exception ("Invalid pax header in tar archive");
+		}
+
+		long_name.clear();
+		long_link.clear();
+		pax.clear();
+
+		extract_member (m);
+	}
+
+	wait_writers();
+
+	/* The targets of hardlinks have been written now */
+	create_links();
+
+	/* Finally set the directories' attributes, children first */
+	if (!staged)
+	{
+		for (auto i = directories.rbegin(); i != directories.rend(); i++)
+			apply_metadata (i->path, i->m);
+	}
+
+	/* One sync for all files is much cheaper than syncing each file */
+	if (sync && syncfs (dirfd) < 0)
+		throw system_error (error_code (errno, generic_category()), "syncfs failed");
+}
+
+
+void extract_tar_archive (tf::ReadStream& rs, uint64_t size, const string& dst,
+		const unordered_set<string>* excluded, unsigned writers, bool sync)
+{
+	TarExtractor e(rs, size, dst, excluded, writers, sync);
+	e.run();
+}
+
+
+vector<StagedMember> stage_tar_archive (tf::ReadStream& rs, uint64_t size,
+		const string& staging, unsigned writers)
+{
+	vector<StagedMember> members;
+
+	TarExtractor e(rs, size, staging, nullptr, writers, false, &members);
+	e.run();
+
+	return members;
+}
+
+
+static int open_directory (const string& path)
+{
+	int fd = open (path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error (error_code (errno, generic_category()),
+				"Failed to open " + path);
+
+	return fd;
+}
+
+
+static TarMember to_tar_member (const StagedMember& sm)
+{
+	TarMember m{};
+	m.type = sm.directory ? '5' : (sm.link_type ? sm.link_type : '0');
+	m.mode = sm.mode;
+	m.uid = sm.uid;
+	m.gid = sm.gid;
+	m.mtime = sm.mtime;
+
+	return m;
+}
+
+
+void link_staged_archive (const string& staging, const vector<StagedMember>& members)
+{
+	/* Like when extracting, a later member with the same path replaces a
+	 * link. */
+	unordered_map<string, const StagedMember*> last;
+
+	for (auto& sm : members)
+	{
+		if (sm.link_type || !last.empty())
+			last[sm.path] = &sm;
+	}
+
+	if (last.empty())
+		return;
+
+	bool same_owner = geteuid() == 0;
+	auto umask_value = current_umask();
+	mode_t mode_mask = same_owner ? 07777 : (0777 & ~umask_value);
+
+	int fd = open_directory (staging);
+
+	try
+	{
+		for (auto& sm : members)
+		{
+			if (!sm.link_type || last[sm.path] != &sm)
+				continue;
+
+			create_link (fd, sm.path, sm.link_type, sm.link, umask_value);
+
+			if (sm.link_type == '2')
+				set_attributes (fd, sm.path, to_tar_member (sm), same_owner, mode_mask);
+		}
+	}
+	catch (...)
+	{
+		close (fd);
+		throw;
+	}
+
+	close (fd);
+}
+
+
+static bool commit_members (int src_fd, int dst_fd,
+		const vector<StagedMember>& members,
+		const unordered_set<string>* excluded, bool sync)
+{
+	bool same_owner = geteuid() == 0;
+	auto umask_value = current_umask();
+	mode_t mode_mask = same_owner ? 07777 : (0777 & ~umask_value);
+
+	vector<const StagedMember*> directories;
+
+	for (auto& sm : members)
+	{
+		if (is_excluded (excluded, sm.path))
+			continue;
+
+		auto p = sm.path.c_str();
+
+		if (sm.directory)
+		{
+			/* Keep existing directories but replace anything else, like
+			 * extract_tar_archive. */
+			if (!sm.path.empty() && mkdirat (dst_fd, p, 0700) < 0)
+			{
+				struct stat st;
+				int err = errno;
+
+				if (err == ENOENT)
+				{
+					make_parents (dst_fd, sm.path, 0777 & ~umask_value);
+					err = mkdirat (dst_fd, p, 0700) < 0 ? errno : 0;
+				}
+				else if (err == EEXIST &&
+						fstatat (dst_fd, p, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+						!S_ISDIR (st.st_mode))
+				{
+					err = unlinkat (dst_fd, p, 0) < 0 || mkdirat (dst_fd, p, 0700) < 0 ?
+						errno : 0;
+				}
+				else if (err == EEXIST)
+				{
+					err = 0;
+				}
+
+				if (err)
+					throw system_error (error_code (err, generic_category()),
+							"Failed to create directory /" + sm.path);
+			}
+
+			directories.push_back (&sm);
+			continue;
+		}
+
+		/* Hardlinks are moved name by name, hence they stay linked. */
+		int ret = renameat (src_fd, p, dst_fd, p);
+		if (ret < 0 && errno == ENOENT)
+		{
+			make_parents (dst_fd, sm.path, 0777 & ~umask_value);
+			ret = renameat (src_fd, p, dst_fd, p);
+		}
+
+		if (ret < 0 && errno == EXDEV)
+			return false;
+
+		if (ret < 0)
+			throw system_error (error_code (errno, generic_category()),
+					"Failed to move /" + sm.path);
+	}
+
+	for (auto i = directories.rbegin(); i != directories.rend(); i++)
+	{
+		set_attributes (dst_fd, (*i)->path, to_tar_member (**i), same_owner, mode_mask);
+	}
+
+	if (sync && syncfs (dst_fd) < 0)
+		throw system_error (error_code (errno, generic_category()), "syncfs failed");
+
+	return true;
+}
+
+
+bool commit_staged_archive (const string& staging,
+		const vector<StagedMember>& members, const string& dst,
+		const unordered_set<string>* excluded, bool sync)
+{
+	int src_fd = open_directory (staging);
+	int dst_fd = -1;
+
+	try
+	{
+		dst_fd = open_directory (dst);
+
+		auto ret = commit_members (src_fd, dst_fd, members, excluded, sync);
+
+		close (src_fd);
+		close (dst_fd);
+		return ret;
+	}
+	catch (...)
+	{
+		close (src_fd);
+
+		if (dst_fd >= 0)
+			close (dst_fd);
+
+		throw;
+	}
+}
@@ -0,0 +1,100 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * This module extracts tar archives in-process, such that the archive section
+ * of a transport form can be unpacked without running tar. It understands the
+ * ustar format with GNU long name and pax extensions, which is what GNU tar
+ * creates. */
+
+#ifndef __TAR_EXTRACTOR_H
+#define __TAR_EXTRACTOR_H
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "transport_form.h"
+
+extern "C" {
+#include <sys/types.h>
+#include <time.h>
+}
+
+
+/* Extract the tar archive of @param size bytes at the current position of
+ * @param rs into the directory @param dst.
+ *
+ * Members whose path (like "/etc/foo", relative to the archive's root) or one
+ * of whose parent directories is in @param excluded are skipped. Existing files
+ * are replaced, existing directories are kept. Modes and timestamps are
+ * restored. When running as root, the numeric owners are restored as well,
+ * like they are stored in the package's file index. Symlinks and hardlinks are
+ * created after all other members, such that members cannot be redirected
+ * through a symlink of the archive.
+ *
+ * Small files are written by @param writers threads while the archive is
+ * decoded; 1 extracts everything on the calling thread. If @param sync is true,
+ * the filesystem is synced once after all files have been written.
+ *
+ * @raises std::system_error if a file cannot be created, gp_exception if the
+ *         archive is malformed or uses unsupported features, and what rs
+ *         raises. */
+void extract_tar_archive (TransportForm::ReadStream& rs, uint64_t size,
+		const std::string& dst,
+		const std::unordered_set<std::string>* excluded = nullptr,
+		unsigned writers = 1, bool sync = false);
+
+
+/* A member of an archive that has been extracted to a staging directory, with
+ * its path relative to the archive's root (like "usr/bin/foo", "" for the root
+ * itself). Directories carry the attributes that are applied when the staged
+ * archive is committed. Symlinks and hardlinks have a link_type of '2' or '1'
+ * like in tar headers and their target in link; they are created by
+ * link_staged_archive. */
+struct StagedMember
+{
+	std::string path;
+	bool directory;
+
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mtime;
+
+	char link_type = 0;
+	std::string link;
+};
+
+/* Like extract_tar_archive, but extract into the directory @param staging
+ * where the files are not visible yet. Files get their final attributes
+ * already, directories keep theirs private until they are committed.
+ *
+ * Symlinks and hardlinks are not created yet, such that an archive that has
+ * not been verified cannot redirect the files that follow them out of the
+ * staging directory.
+ *
+ * @returns the archive's members in the order of the archive.
+ * @raises like extract_tar_archive. */
+std::vector<StagedMember> stage_tar_archive (TransportForm::ReadStream& rs,
+		uint64_t size, const std::string& staging, unsigned writers = 1);
+
+/* Create the symlinks and hardlinks of a staged archive in the staging
+ * directory. Call this only after the archive has been verified.
+ *
+ * @raises std::system_error if a link cannot be created. */
+void link_staged_archive (const std::string& staging,
+		const std::vector<StagedMember>& members);
+
+/* Move the files of a staged archive into @param dst, which behaves like
+ * extracting the archive there with extract_tar_archive. Files are renamed,
+ * such that each appears atomically. Excluded files remain in the staging
+ * directory, which must be removed afterwards.
+ *
+ * @returns false if a file could not be renamed because it would cross a
+ *          filesystem boundary. In that case the archive must be extracted to
+ *          dst directly; files that have been moved already are replaced then.
+ * @raises std::system_error if a file cannot be moved. */
+bool commit_staged_archive (const std::string& staging,
+		const std::vector<StagedMember>& members, const std::string& dst,
+		const std::unordered_set<std::string>* excluded = nullptr,
+		bool sync = false);
+
+#endif /* __TAR_EXTRACTOR_H */
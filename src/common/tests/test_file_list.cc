@@ -0,0 +1,107 @@
+#define BOOST_TEST_MODULE test_file_list
+
+#include <boost/test/included/unit_test.hpp>
+#include "file_list.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+static FileRecord make_record (const string& path, uint32_t size)
+{
+	uint8_t sha1_sum[20];
+	memset (sha1_sum, size & 0xff, sizeof(sha1_sum));
+
+	return FileRecord(FILE_TYPE_REGULAR, 1, 2, 0644, size, sha1_sum, path);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_sorted_and_unique)
+{
+	FileList fl;
+
+	fl.add_file (make_record ("/usr/bin/b", 1));
+	fl.add_file (make_record ("/usr/bin/a", 2));
+	fl.add_file (make_record ("/etc", 3));
+	fl.add_file (make_record ("/usr/bin/a", 4));
+
+	vector<string> paths;
+	for (auto& f : fl)
+		paths.emplace_back (f.path);
+
+	BOOST_TEST (paths == vector<string>({ "/etc", "/usr/bin/a", "/usr/bin/b" }));
+	BOOST_TEST (fl.size() == 3);
+
+	/* Like with a set, the first file wins. */
+	auto i = fl.find (DummyFileRecord ("/usr/bin/a"));
+	BOOST_REQUIRE ((i != fl.end()));
+	BOOST_TEST (i->size == 2);
+	BOOST_TEST (i->uid == 1);
+	BOOST_TEST (i->gid == 2);
+	BOOST_TEST (i->mode == 0644);
+	BOOST_TEST (i->sha1_sum[19] == 2);
+
+	BOOST_TEST ((fl.find (DummyFileRecord ("/usr/bin")) == fl.end()));
+	BOOST_TEST ((fl.find (DummyFileRecord ("/zzz")) == fl.end()));
+}
+
+
+BOOST_AUTO_TEST_CASE (test_binary_records)
+{
+	FileList fl;
+	uint8_t buf[256];
+
+	auto r = make_record ("/usr/lib/libtest.so", 42);
+	r.to_binary (buf);
+	fl.add_file_from_binary (buf, r.binary_size());
+
+	auto i = fl.find (DummyFileRecord ("/usr/lib/libtest.so"));
+	BOOST_REQUIRE ((i != fl.end()));
+	BOOST_TEST (i->size == 42);
+	BOOST_TEST (memcmp (i->sha1_sum, r.sha1_sum, 20) == 0);
+
+	/* Paths are null-terminated */
+	BOOST_TEST (strcmp (i->path.data(), "/usr/lib/libtest.so") == 0);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_many_paths)
+{
+	/* Spans multiple path blocks, and one path is larger than a block. */
+	FileList fl;
+	vector<string> paths;
+
+	for (unsigned i = 0; i < 10000; i++)
+		paths.push_back ("/usr/share/test/" + to_string (100000 + i));
+
+	paths.push_back ("/usr/share/x" + string(100000, 'y'));
+
+	for (auto i = paths.rbegin(); i != paths.rend(); i++)
+		fl.add_file (make_record (*i, i->size()));
+
+	BOOST_REQUIRE (fl.size() == paths.size());
+
+	size_t j = 0;
+	for (auto& f : fl)
+	{
+		BOOST_TEST (f.path == paths[j]);
+		BOOST_TEST (f.size == paths[j].size());
+		j++;
+	}
+}
+
+
+BOOST_AUTO_TEST_CASE (test_memory_usage)
+{
+	FileList fl;
+	auto empty = fl.memory_usage();
+
+	string long_path (100000, 'p');
+	fl.add_file (make_record ("/a", 1));
+	fl.add_file (make_record (long_path, 2));
+
+	BOOST_TEST (fl.memory_usage() >= empty + 65536 + long_path.size() +
+			2 * sizeof(FileListEntry));
+}
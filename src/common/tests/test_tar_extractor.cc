@@ -0,0 +1,389 @@
+#define BOOST_TEST_MODULE test_tar_extractor
+
+#include <boost/test/included/unit_test.hpp>
+#include "tar_extractor.h"
+#include "transport_form.h"
+#include "common_utilities.h"
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+namespace fs = std::filesystem;
+namespace tf = TransportForm;
+
+
+struct TemporaryDirectory
+{
+	fs::path path;
+
+	TemporaryDirectory ()
+	{
+		char tmpl[] = "/tmp/test_tar_extractor_XXXXXX";
+		BOOST_REQUIRE (mkdtemp (tmpl));
+		path = tmpl;
+	}
+
+	~TemporaryDirectory ()
+	{
+		fs::remove_all (path);
+	}
+};
+
+
+static void write_file (const fs::path& p, const string& content)
+{
+	ofstream o(p, ios::binary);
+	o << content;
+}
+
+static string read_file (const fs::path& p)
+{
+	ifstream i(p, ios::binary);
+	stringstream ss;
+	ss << i.rdbuf();
+	return ss.str();
+}
+
+
+/* Create an archive of dir with GNU tar like tpm2_pack does */
+static void create_archive (const fs::path& dir, const fs::path& archive,
+		const string& options = "")
+{
+	auto cmd = "tar " + options + " -cf " + archive.string() + " -C " + dir.string() + " .";
+	BOOST_REQUIRE (system (cmd.c_str()) == 0);
+}
+
+static void extract (const fs::path& archive, const fs::path& dst,
+		const unordered_set<string>* excluded = nullptr, unsigned writers = 1)
+{
+	tf::MmapReadStream rs(archive.string());
+	extract_tar_archive (rs, fs::file_size (archive), dst.string(), excluded, writers);
+}
+
+/* Without the stream's memory being available */
+static void extract_buffered (const fs::path& archive, const fs::path& dst,
+		unsigned writers = 1)
+{
+	int fd = open (archive.c_str(), O_RDONLY | O_CLOEXEC);
+	BOOST_REQUIRE (fd >= 0);
+
+	tf::FDReadStream rs(fd, true);
+	extract_tar_archive (rs, fs::file_size (archive), dst.string(), nullptr, writers, true);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_extract)
+{
+	TemporaryDirectory src, dst, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	string long_name (150, 'n');
+	string content (100000, 'x');
+
+	fs::create_directories (src.path / "usr/bin");
+	fs::create_directories (src.path / "etc");
+	fs::create_directories (src.path / "ro");
+	write_file (src.path / "usr/bin/prog", content);
+	write_file (src.path / "usr" / long_name, "long");
+	write_file (src.path / "etc/conf", "new");
+	write_file (src.path / "empty", "");
+	fs::create_symlink ("bin/prog", src.path / "usr/link");
+	fs::create_hard_link (src.path / "usr/bin/prog", src.path / "usr/hard");
+	chmod ((src.path / "usr/bin/prog").c_str(), 04751);
+	chmod ((src.path / "ro").c_str(), 0555);
+
+	create_archive (src.path, archive);
+
+	/* Existing files are replaced, excluded ones are kept */
+	fs::create_directories (dst.path / "etc");
+	fs::create_directories (dst.path / "usr/bin");
+	write_file (dst.path / "etc/conf", "old");
+	write_file (dst.path / "usr/bin/prog", "old");
+
+	unordered_set<string> excluded = { "/etc/conf" };
+	extract (archive, dst.path, &excluded);
+
+	BOOST_TEST (read_file (dst.path / "usr/bin/prog") == content);
+	BOOST_TEST (read_file (dst.path / "usr" / long_name) == "long");
+	BOOST_TEST (read_file (dst.path / "etc/conf") == "old");
+	BOOST_TEST (read_file (dst.path / "empty") == "");
+	BOOST_TEST (fs::read_symlink (dst.path / "usr/link") == "bin/prog");
+	BOOST_TEST (fs::equivalent (dst.path / "usr/hard", dst.path / "usr/bin/prog"));
+
+	struct stat st_src, st_dst;
+	BOOST_REQUIRE (stat ((src.path / "usr/bin/prog").c_str(), &st_src) == 0);
+	BOOST_REQUIRE (stat ((dst.path / "usr/bin/prog").c_str(), &st_dst) == 0);
+	BOOST_TEST (st_dst.st_mtime == st_src.st_mtime);
+
+	if (geteuid() == 0)
+		BOOST_TEST ((st_dst.st_mode & 07777) == 04751U);
+
+	BOOST_REQUIRE (stat ((dst.path / "ro").c_str(), &st_dst) == 0);
+	BOOST_TEST (S_ISDIR (st_dst.st_mode));
+	BOOST_TEST ((st_dst.st_mode & 0777) == 0555U);
+
+	/* Excluding a directory excludes its content */
+	TemporaryDirectory dst2;
+	excluded = { "/usr" };
+	extract (archive, dst2.path, &excluded);
+
+	BOOST_TEST (!fs::exists (dst2.path / "usr"));
+	BOOST_TEST (read_file (dst2.path / "etc/conf") == "new");
+}
+
+
+BOOST_AUTO_TEST_CASE (test_extract_pax)
+{
+	TemporaryDirectory src, dst, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	string long_dir (120, 'd');
+	string long_name (200, 'n');
+
+	fs::create_directories (src.path / long_dir);
+	write_file (src.path / long_dir / long_name, "pax");
+	fs::create_symlink (long_name, src.path / long_dir / "link");
+
+	create_archive (src.path, archive, "--format=posix");
+	extract_buffered (archive, dst.path);
+
+	BOOST_TEST (read_file (dst.path / long_dir / long_name) == "pax");
+	BOOST_TEST (fs::read_symlink (dst.path / long_dir / "link") == long_name);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_extract_parallel)
+{
+	TemporaryDirectory src, dst, dst2, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	/* Many small files, a few large ones and hardlinks to queued files */
+	for (int d = 0; d < 20; d++)
+	{
+		auto dir = src.path / ("dir" + to_string (d));
+		fs::create_directories (dir);
+
+		for (int f = 0; f < 50; f++)
+			write_file (dir / to_string (f), string (f * 37, 'a' + d % 26));
+
+		write_file (dir / "large", string (3 * 1024 * 1024 + d, 'L'));
+		fs::create_hard_link (dir / "7", dir / "hard");
+		chmod (dir.c_str(), 0750);
+	}
+
+	create_archive (src.path, archive);
+
+	extract (archive, dst.path, nullptr, 4);
+	extract_buffered (archive, dst2.path, 4);
+
+	for (auto& root : { dst.path, dst2.path })
+	{
+		size_t cnt = 0;
+
+		for (auto& e : fs::recursive_directory_iterator (src.path))
+		{
+			auto rel = fs::relative (e.path(), src.path);
+			auto p = root / rel;
+
+			BOOST_REQUIRE (fs::exists (p));
+			BOOST_TEST ((fs::status (p).permissions() == e.status().permissions()));
+
+			if (e.is_regular_file())
+				BOOST_TEST ((read_file (p) == read_file (e.path())));
+
+			cnt++;
+		}
+
+		BOOST_TEST (cnt == 20U * 53);
+		BOOST_TEST (fs::equivalent (root / "dir3/hard", root / "dir3/7"));
+	}
+
+	/* Errors of writer threads are reported */
+	TemporaryDirectory dst3;
+	fs::create_directories (dst3.path / "dir5/17");
+	write_file (dst3.path / "dir5/17/x", "");
+
+	BOOST_CHECK_THROW (extract (archive, dst3.path, nullptr, 4), system_error);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_stage_and_commit)
+{
+	TemporaryDirectory src, dst, staging, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	fs::create_directories (src.path / "usr/bin");
+	fs::create_directories (src.path / "etc");
+	fs::create_directories (src.path / "ro");
+	write_file (src.path / "usr/bin/prog", string (100000, 'p'));
+	write_file (src.path / "etc/conf", "new");
+	write_file (src.path / "ro/file", "ro");
+	fs::create_symlink ("bin/prog", src.path / "usr/link");
+	fs::create_hard_link (src.path / "usr/bin/prog", src.path / "usr/hard");
+	chmod ((src.path / "ro").c_str(), 0555);
+
+	create_archive (src.path, archive);
+
+	fs::create_directories (dst.path / "etc");
+	fs::create_directories (dst.path / "usr");
+	write_file (dst.path / "etc/conf", "old");
+	write_file (dst.path / "usr/bin", "a file where a directory belongs");
+
+	vector<StagedMember> members;
+	{
+		tf::MmapReadStream rs(archive.string());
+		members = stage_tar_archive (rs, fs::file_size (archive),
+				staging.path.string(), 3);
+	}
+
+	/* Nothing is visible before the archive is committed, and links are
+	 * only created once the archive has been verified. */
+	BOOST_TEST (members.size() == 10U);
+	BOOST_TEST (read_file (dst.path / "etc/conf") == "old");
+	BOOST_TEST (!fs::exists (dst.path / "ro"));
+	BOOST_TEST (read_file (staging.path / "ro/file") == "ro");
+	BOOST_TEST (!fs::is_symlink (staging.path / "usr/link"));
+	BOOST_TEST (!(fs::exists (staging.path / "usr/hard") &&
+				fs::exists (staging.path / "usr/bin/prog")));
+
+	link_staged_archive (staging.path.string(), members);
+
+	unordered_set<string> excluded = { "/etc/conf" };
+	BOOST_REQUIRE (commit_staged_archive (staging.path.string(), members,
+				dst.path.string(), &excluded));
+
+	BOOST_TEST (read_file (dst.path / "usr/bin/prog") == string (100000, 'p'));
+	BOOST_TEST (read_file (dst.path / "etc/conf") == "old");
+	BOOST_TEST (read_file (dst.path / "ro/file") == "ro");
+	BOOST_TEST (fs::read_symlink (dst.path / "usr/link") == "bin/prog");
+	BOOST_TEST (fs::equivalent (dst.path / "usr/hard", dst.path / "usr/bin/prog"));
+
+	struct stat st_src, st_dst;
+	BOOST_REQUIRE (stat ((src.path / "ro").c_str(), &st_src) == 0);
+	BOOST_REQUIRE (stat ((dst.path / "ro").c_str(), &st_dst) == 0);
+	BOOST_TEST ((st_dst.st_mode & 0777) == 0555U);
+	BOOST_TEST (st_dst.st_mtime == st_src.st_mtime);
+
+	/* Excluded files remain staged */
+	BOOST_TEST (read_file (staging.path / "etc/conf") == "new");
+	BOOST_TEST (!fs::exists (staging.path / "usr/bin/prog"));
+}
+
+
+/* Build a ustar header by hand to test malicious archives */
+static string make_header (const string& name, char type, uint64_t size,
+		const string& link = "")
+{
+	string h(512, '\0');
+
+	memcpy (h.data(), name.c_str(), MIN(name.size(), (size_t) 100));
+	memcpy (h.data() + 157, link.c_str(), MIN(link.size(), (size_t) 100));
+	snprintf (h.data() + 100, 8, "%07o", 0644);
+	snprintf (h.data() + 108, 8, "%07o", 0);
+	snprintf (h.data() + 116, 8, "%07o", 0);
+	snprintf (h.data() + 124, 12, "%011lo", (unsigned long) size);
+	snprintf (h.data() + 136, 12, "%011o", 0);
+	h[156] = type;
+	memcpy (h.data() + 257, "ustar\0" "00", 8);
+
+	memset (h.data() + 148, ' ', 8);
+	unsigned sum = 0;
+	for (auto c : h)
+		sum += (unsigned char) c;
+
+	snprintf (h.data() + 148, 8, "%06o", sum);
+	return h;
+}
+
+
+BOOST_AUTO_TEST_CASE (test_malformed_archives)
+{
+	TemporaryDirectory dst, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	/* Paths must not leave the destination */
+	write_file (archive, make_header ("./../escape", '0', 0) + string(1024, '\0'));
+	BOOST_CHECK_THROW (extract (archive, dst.path), gp_exception);
+	BOOST_TEST (!fs::exists (tmp.path / "escape"));
+
+	/* Truncated data */
+	write_file (archive, make_header ("./file", '0', 1000) + string(512, 'a'));
+	BOOST_CHECK_THROW (extract (archive, dst.path), gp_exception);
+
+	/* Wrong checksum */
+	auto h = make_header ("./file", '0', 0);
+	h[0] = 'x';
+	write_file (archive, h + string(1024, '\0'));
+	BOOST_CHECK_THROW (extract (archive, dst.path), gp_exception);
+
+	/* Malformed pax records */
+	for (string record : { "x path=a\n", "1 path=a\n", "7 path=a\n", "12 path=ab\n",
+			"7 path=", "9 path=ab", "9 =path\n\n", "8 path\n\n\n", "4 a=\n", "-9 path=a\n" })
+	{
+		auto data = record + string(512 - record.size(), '\0');
+		write_file (archive, make_header ("./PaxHeaders/file", 'x', record.size()) +
+				data + make_header ("./file", '0', 0) + string(1024, '\0'));
+
+		BOOST_CHECK_THROW (extract (archive, dst.path), gp_exception);
+	}
+
+	/* Absolute paths are extracted relative to the destination */
+	write_file (archive, make_header ("/abs", '0', 3) + "abc" + string(509, '\0') +
+			string(1024, '\0'));
+	extract (archive, dst.path);
+	BOOST_TEST (read_file (dst.path / "abs") == "abc");
+}
+
+
+BOOST_AUTO_TEST_CASE (test_symlink_escape)
+{
+	TemporaryDirectory dst, staging, outside, tmp;
+	auto archive = tmp.path / "a.tar";
+
+	/* A symlink out of the destination, followed by a member below it */
+	write_file (archive,
+			make_header ("./esc", '2', 0, outside.path.string()) +
+			make_header ("./esc/owned", '0', 5) + "owned" + string(507, '\0') +
+			string(1024, '\0'));
+
+	/* Staging must not write outside before the archive has been verified;
+	 * afterwards the directory in place of the link is not replaced. */
+	vector<StagedMember> members;
+	{
+		tf::MmapReadStream rs(archive.string());
+		members = stage_tar_archive (rs, fs::file_size (archive),
+				staging.path.string(), 2);
+	}
+
+	BOOST_TEST (!fs::exists (outside.path / "owned"));
+	BOOST_TEST (!fs::is_symlink (staging.path / "esc"));
+
+	BOOST_CHECK_THROW (link_staged_archive (staging.path.string(), members), system_error);
+	BOOST_TEST (!fs::exists (outside.path / "owned"));
+
+	/* The same holds when extracting directly */
+	BOOST_CHECK_THROW (extract (archive, dst.path), system_error);
+	BOOST_TEST (!fs::exists (outside.path / "owned"));
+	BOOST_TEST (read_file (dst.path / "esc/owned") == "owned");
+
+	/* A later member replaces a link of the same path */
+	TemporaryDirectory dst2;
+	write_file (archive,
+			make_header ("./f", '2', 0, outside.path.string()) +
+			make_header ("./f", '0', 1) + "f" + string(511, '\0') +
+			string(1024, '\0'));
+
+	extract (archive, dst2.path);
+	BOOST_TEST (!fs::is_symlink (dst2.path / "f"));
+	BOOST_TEST (read_file (dst2.path / "f") == "f");
+}
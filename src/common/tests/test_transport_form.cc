@@ -0,0 +1,680 @@
+#define BOOST_TEST_MODULE test_transport_form
+
+#include <boost/test/included/unit_test.hpp>
+#include "transport_form.h"
+#include "common_utilities.h"
+#include "file_list.h"
+#include "managed_buffer.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+extern "C" {
+#include <fcntl.h>
+}
+
+using namespace std;
+namespace tf = TransportForm;
+
+
+/* Generate some compressible content */
+static string make_content (char c, size_t size)
+{
+	string s;
+
+	for (size_t i = 0; i < size; i++)
+		s += (char) (c + (i % 7));
+
+	return s;
+}
+
+
+BOOST_AUTO_TEST_CASE (test_write_read_v2)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto desc = make_content ('a', 1000);
+	auto index = make_content ('A', 100000);
+	auto archive = make_content ('0', 300000);
+
+	tf::TableOfContents toc;
+	toc.version = 2;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_DESC, 0, desc.size()));
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_FILE_INDEX, 0, index.size()));
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, archive.size()));
+
+	toc.sections[0].encoding = tf::SEC_ENCODING_STORED;
+	toc.sections[1].encoding = tf::SEC_ENCODING_GZIP;
+	toc.sections[2].encoding = tf::SEC_ENCODING_GZIP;
+	toc.update_starts();
+
+	{
+		tf::Writer w(tmp.path());
+		BOOST_TEST (tf::write_sections (w, toc,
+					{ desc.c_str(), index.c_str(), archive.c_str() }) == 0);
+	}
+
+	BOOST_TEST (toc.sections[0].encoded_size == desc.size());
+	BOOST_TEST (toc.sections[2].encoded_size < archive.size());
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+
+	BOOST_TEST (rtoc.version == 2);
+	BOOST_REQUIRE (rtoc.sections.size() == 3);
+
+	for (size_t i = 0; i < 3; i++)
+	{
+		BOOST_TEST (rtoc.sections[i].type == toc.sections[i].type);
+		BOOST_TEST (rtoc.sections[i].encoding == toc.sections[i].encoding);
+		BOOST_TEST (rtoc.sections[i].start == toc.sections[i].start);
+		BOOST_TEST (rtoc.sections[i].size == toc.sections[i].size);
+		BOOST_TEST (rtoc.sections[i].offset == toc.sections[i].offset);
+		BOOST_TEST (rtoc.sections[i].encoded_size == toc.sections[i].encoded_size);
+	}
+
+	/* Read the sections in reverse order */
+	vector<string> contents = { desc, index, archive };
+
+	for (ssize_t i = 2; i >= 0; i--)
+	{
+		string buf(rtoc.sections[i].size, '\0');
+
+		rs->seek (rtoc.sections[i].start);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == contents[i]);
+	}
+
+	/* Read across section boundaries and from within compressed sections */
+	{
+		auto pos = rtoc.sections[2].start - 10;
+		string buf(20, '\0');
+
+		rs->seek (pos);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == index.substr (index.size() - 10) + archive.substr (0, 10));
+
+		rs->seek (rtoc.sections[2].start + 12345);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == archive.substr (12345, 20));
+		BOOST_TEST (rs->tell() == rtoc.sections[2].start + 12365);
+	}
+
+	/* Reading past the end fails */
+	{
+		char c;
+		rs->seek (rtoc.sections[2].start + archive.size());
+		BOOST_CHECK_THROW (rs->read (&c, 1), system_error);
+	}
+}
+
+
+BOOST_AUTO_TEST_CASE (test_multiple_members_per_section)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto part1 = make_content ('a', 50000);
+	auto part2 = make_content ('A', 70000);
+
+	tf::TableOfContents toc;
+	toc.version = 2;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, part1.size() + part2.size()));
+	toc.sections[0].encoding = tf::SEC_ENCODING_GZIP;
+	toc.update_starts();
+
+	{
+		tf::Writer w(tmp.path());
+		BOOST_TEST (w.write_toc (toc) == 0);
+
+		size_t offset1, size1, offset2, size2;
+
+		BOOST_TEST (w.begin_section (tf::SEC_ENCODING_GZIP) == 0);
+		BOOST_TEST (w.write (part1.c_str(), part1.size()) == 0);
+		BOOST_TEST (w.end_section (offset1, size1) == 0);
+
+		BOOST_TEST (w.begin_section (tf::SEC_ENCODING_GZIP) == 0);
+		BOOST_TEST (w.write (part2.c_str(), part2.size()) == 0);
+		BOOST_TEST (w.end_section (offset2, size2) == 0);
+
+		BOOST_TEST (offset2 == offset1 + size1);
+
+		toc.sections[0].offset = offset1;
+		toc.sections[0].encoded_size = size1 + size2;
+		BOOST_TEST (w.write_toc (toc) == 0);
+	}
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+	BOOST_REQUIRE (rtoc.sections.size() == 1);
+
+	string buf(rtoc.sections[0].size, '\0');
+	rs->seek (rtoc.sections[0].start);
+	rs->read (buf.data(), buf.size());
+
+	BOOST_TEST (buf == part1 + part2);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_section_codecs)
+{
+	auto index = make_content ('A', 100000);
+	auto part1 = make_content ('a', 50000);
+	auto part2 = make_content ('0', 70000);
+
+	for (uint8_t encoding : { tf::SEC_ENCODING_XZ, tf::SEC_ENCODING_ZSTD })
+	{
+		TemporaryFile tmp("test_transport_form");
+		tmp.close();
+
+		tf::TableOfContents toc;
+		toc.version = 3;
+		toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_FILE_INDEX, 0, index.size()));
+		toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, part1.size() + part2.size()));
+		toc.sections[0].encoding = tf::SEC_ENCODING_GZIP;
+		toc.sections[1].encoding = encoding;
+		toc.update_starts();
+
+		{
+			tf::Writer w(tmp.path());
+
+			if (!tf::encoding_supported (encoding))
+			{
+				BOOST_TEST (w.begin_section (encoding) == -ENOTSUP);
+				continue;
+			}
+
+			BOOST_TEST (w.write_toc (toc) == 0);
+
+			uint64_t offset, size, offset1, size1, offset2, size2;
+
+			BOOST_TEST (w.begin_section (tf::SEC_ENCODING_GZIP) == 0);
+			BOOST_TEST (w.write (index.c_str(), index.size()) == 0);
+			BOOST_TEST (w.end_section (offset, size) == 0);
+
+			/* Two streams in one section */
+			BOOST_TEST (w.begin_section (encoding, 1) == 0);
+			BOOST_TEST (w.write (part1.c_str(), part1.size()) == 0);
+			BOOST_TEST (w.end_section (offset1, size1) == 0);
+
+			BOOST_TEST (w.begin_section (encoding) == 0);
+			BOOST_TEST (w.write (part2.c_str(), part2.size()) == 0);
+			BOOST_TEST (w.end_section (offset2, size2) == 0);
+
+			BOOST_TEST (size1 + size2 < part1.size() + part2.size());
+
+			toc.sections[0].offset = offset;
+			toc.sections[0].encoded_size = size;
+			toc.sections[1].offset = offset1;
+			toc.sections[1].encoded_size = size1 + size2;
+			BOOST_TEST (w.write_toc (toc) == 0);
+		}
+
+		auto rs = tf::open_read_stream (tmp.path());
+		auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+		BOOST_REQUIRE (rtoc.sections.size() == 2);
+		BOOST_TEST (rtoc.sections[1].encoding == encoding);
+
+		/* Switch between decoders */
+		string buf(rtoc.sections[1].size, '\0');
+		rs->seek (rtoc.sections[1].start);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == part1 + part2);
+
+		buf.resize (rtoc.sections[0].size);
+		rs->seek (rtoc.sections[0].start);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == index);
+
+		buf.resize (20);
+		rs->seek (rtoc.sections[1].start + part1.size() - 10);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST (buf == part1.substr (part1.size() - 10) + part2.substr (0, 10));
+	}
+}
+
+
+BOOST_AUTO_TEST_CASE (test_compress_parallel)
+{
+	auto data = make_content ('a', 1000000);
+
+	for (uint8_t encoding : { tf::SEC_ENCODING_GZIP, tf::SEC_ENCODING_XZ })
+	{
+		string encoded;
+		size_t streams = 0;
+
+		BOOST_TEST (tf::compress_parallel (encoding, 1, data.c_str(), data.size(), 4,
+					[&](const char *b, size_t s) {
+						encoded.append (b, s);
+						streams++;
+						return 0;
+					}, 65536) == 0);
+
+		BOOST_TEST (streams == 16);
+
+		/* The streams decode as one */
+		auto d = tf::create_decompressor (encoding);
+		string decoded(data.size(), '\0');
+
+		const char *in = encoded.c_str();
+		size_t in_size = encoded.size();
+		char *out = decoded.data();
+		size_t out_size = decoded.size();
+
+		d->decode (in, in_size, out, out_size);
+		BOOST_TEST (in_size == 0);
+		BOOST_TEST (out_size == 0);
+		BOOST_TEST (decoded == data);
+	}
+
+	/* Errors of the output function are passed on */
+	BOOST_TEST (tf::compress_parallel (tf::SEC_ENCODING_GZIP, 1, data.c_str(), data.size(), 4,
+				[](const char*, size_t) { return -ENOSPC; }, 65536) == -ENOSPC);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_writer_threads)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto head = make_content ('a', 1000);
+	auto data = make_content ('0', 3 * tf::PARALLEL_BLOCK_SIZE + 1000);
+
+	tf::TableOfContents toc;
+	toc.version = 3;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, 2 * head.size() + data.size()));
+	toc.sections[0].encoding = tf::SEC_ENCODING_GZIP;
+	toc.update_starts();
+
+	{
+		tf::Writer w(tmp.path());
+		w.set_threads (4);
+
+		BOOST_TEST (w.write_toc (toc) == 0);
+
+		/* Small writes before and after the parallel one */
+		uint64_t offset, size;
+		BOOST_TEST (w.begin_section (tf::SEC_ENCODING_GZIP, 1) == 0);
+		BOOST_TEST (w.write (head.c_str(), head.size()) == 0);
+		BOOST_TEST (w.write (data.c_str(), data.size()) == 0);
+		BOOST_TEST (w.write (head.c_str(), head.size()) == 0);
+		BOOST_TEST (w.end_section (offset, size) == 0);
+
+		toc.sections[0].offset = offset;
+		toc.sections[0].encoded_size = size;
+		BOOST_TEST (w.write_toc (toc) == 0);
+	}
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+	BOOST_REQUIRE (rtoc.sections.size() == 1);
+
+	string buf(rtoc.sections[0].size, '\0');
+	rs->seek (rtoc.sections[0].start);
+	rs->read (buf.data(), buf.size());
+
+	BOOST_TEST ((buf == head + data + head));
+}
+
+
+BOOST_AUTO_TEST_CASE (test_stream_archive)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto desc = make_content ('a', 1000);
+	auto index = make_content ('A', 10000);
+	auto archive = make_content ('0', 3 * tf::PARALLEL_BLOCK_SIZE + 12345);
+
+	tf::TransportForm tf;
+	tf.set_desc (desc.c_str(), desc.size());
+	tf.set_file_index (index.c_str(), index.size());
+
+	/* Deliver the archive in small, odd chunks like a pipe would */
+	size_t archive_pos = 0;
+	tf.set_archive ([&](char *buf, size_t size) -> ssize_t {
+		auto cnt = MIN(MIN(size, (size_t) 65521), archive.size() - archive_pos);
+		memcpy (buf, archive.c_str() + archive_pos, cnt);
+		archive_pos += cnt;
+		return cnt;
+	});
+
+	for (unsigned threads : { 1, 3 })
+	{
+		archive_pos = 0;
+
+		{
+			tf::Writer w(tmp.path());
+			w.set_threads (threads);
+			BOOST_TEST (tf.write (w) == 0);
+		}
+
+		auto rs = tf::open_read_stream (tmp.path());
+		auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+		BOOST_REQUIRE (rtoc.sections.size() == 3);
+
+		auto& sec = rtoc.sections[2];
+		BOOST_TEST (sec.type == tf::SEC_TYPE_ARCHIVE);
+		BOOST_TEST (sec.start == rtoc.sections[1].start + index.size());
+		BOOST_REQUIRE (sec.size == archive.size());
+
+		string buf(sec.size, '\0');
+		rs->seek (sec.start);
+		rs->read (buf.data(), buf.size());
+		BOOST_TEST ((buf == archive));
+	}
+
+	/* Errors of the source are passed on */
+	tf.set_archive ([](char*, size_t) -> ssize_t { return -EIO; });
+
+	tf::Writer w(tmp.path());
+	BOOST_TEST (tf.write (w) == -EIO);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_encoding_names)
+{
+	for (uint8_t e = 0; e < 4; e++)
+	{
+		auto parsed = tf::encoding_from_string (tf::encoding_to_string (e));
+		BOOST_REQUIRE (parsed.has_value());
+		BOOST_TEST (*parsed == e);
+	}
+
+	BOOST_TEST (!tf::encoding_from_string ("lz4").has_value());
+	BOOST_TEST (!tf::encoding_valid (4));
+
+	{
+		TemporaryFile tmp("test_transport_form");
+		tmp.close();
+
+		tf::Writer w(tmp.path());
+		BOOST_TEST (w.begin_section (tf::SEC_ENCODING_XZ, 10) == -EINVAL);
+		BOOST_TEST (w.begin_section (tf::SEC_ENCODING_GZIP, 10) == -EINVAL);
+	}
+
+	auto range = tf::compression_level_range (tf::SEC_ENCODING_GZIP);
+	BOOST_REQUIRE (range.has_value());
+	BOOST_TEST (range->first == 0);
+	BOOST_TEST (range->second == 9);
+	BOOST_TEST (!tf::compression_level_range (tf::SEC_ENCODING_STORED).has_value());
+}
+
+
+BOOST_AUTO_TEST_CASE (test_read_v1)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto desc = make_content ('a', 3000);
+
+	tf::TableOfContents toc;
+	toc.version = 1;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_DESC, 0, desc.size()));
+	toc.update_starts();
+
+	{
+		char buf[64];
+		toc.to_binary (buf);
+
+		auto f = gzopen (tmp.path().c_str(), "we");
+		BOOST_REQUIRE (f);
+
+		gzwrite (f, buf, toc.binary_size());
+		gzwrite (f, desc.c_str(), desc.size());
+		gzclose (f);
+	}
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+
+	BOOST_TEST (rtoc.version == 1);
+	BOOST_REQUIRE (rtoc.sections.size() == 1);
+	BOOST_TEST (rtoc.sections[0].start == toc.binary_size());
+
+	string buf(rtoc.sections[0].size, '\0');
+	rs->read (buf.data(), buf.size());
+	BOOST_TEST (buf == desc);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_toc_v3_large_sections)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	const uint64_t big = 5ULL * 1024 * 1024 * 1024;
+
+	tf::TableOfContents toc;
+	toc.version = 3;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_DESC, 0, 100));
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, big));
+	toc.sections[0].encoded_size = 100;
+	toc.sections[1].encoding = tf::SEC_ENCODING_GZIP;
+	toc.sections[1].offset = big + 12345;
+	toc.sections[1].encoded_size = big / 2;
+	toc.update_starts();
+
+	BOOST_TEST (toc.binary_size() == 2 + 2 * 34);
+	BOOST_TEST (toc.sections[1].start == toc.binary_size() + 100);
+
+	{
+		char buf[128];
+		toc.to_binary (buf);
+
+		auto f = fopen (tmp.path().c_str(), "we");
+		BOOST_REQUIRE (f);
+		BOOST_REQUIRE (fwrite (buf, toc.binary_size(), 1, f) == 1);
+		fclose (f);
+	}
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto rtoc = tf::TableOfContents::read_from_binary (*rs);
+
+	BOOST_TEST (rtoc.version == 3);
+	BOOST_REQUIRE (rtoc.sections.size() == 2);
+	BOOST_TEST (rtoc.sections[1].size == big);
+	BOOST_TEST (rtoc.sections[1].offset == big + 12345);
+	BOOST_TEST (rtoc.sections[1].encoded_size == big / 2);
+
+	/* Positions beyond 4GiB must not be truncated */
+	rs->seek (big + 1);
+	BOOST_TEST (rs->tell() == big + 1);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_mmap_read_stream)
+{
+	TemporaryFile tmp("test_transport_form");
+
+	/* A config files section */
+	string content("/etc/b.conf\0/etc/a.conf\0/etc/c.conf\0", 36);
+	tmp.append_string (content);
+	tmp.close();
+
+	tf::MmapReadStream rs(tmp.path());
+	BOOST_TEST (rs.get_filename() == tmp.path());
+
+	rs.seek (12);
+	auto view = rs.read_view (11);
+	BOOST_REQUIRE (view);
+	BOOST_TEST (string(view, 11) == "/etc/a.conf");
+	BOOST_TEST (rs.tell() == 23);
+
+	BOOST_CHECK_THROW (rs.read_view (14), system_error);
+
+	rs.seek (0);
+	auto l = tf::read_config_files (rs, content.size());
+	BOOST_TEST (*l == vector<string>({ "/etc/a.conf", "/etc/b.conf", "/etc/c.conf" }));
+}
+
+
+BOOST_AUTO_TEST_CASE (test_sectioned_read_view)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto stored = make_content ('a', 5000);
+	auto compressed = make_content ('A', 5000);
+
+	tf::TableOfContents toc;
+	toc.version = 3;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_DESC, 0, stored.size()));
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, compressed.size()));
+	toc.sections[1].encoding = tf::SEC_ENCODING_GZIP;
+	toc.update_starts();
+
+	{
+		tf::Writer w(tmp.path());
+		BOOST_TEST (tf::write_sections (w, toc, { stored.c_str(), compressed.c_str() }) == 0);
+	}
+
+	auto rs = tf::open_read_stream (tmp.path());
+
+	/* Stored sections can be accessed in place */
+	rs->seek (toc.sections[0].start + 10);
+	auto view = rs->read_view (100);
+	BOOST_REQUIRE (view);
+	BOOST_TEST (string(view, 100) == stored.substr (10, 100));
+	BOOST_TEST (rs->tell() == toc.sections[0].start + 110);
+
+	/* But not beyond their end */
+	BOOST_TEST (rs->read_view (stored.size()) == nullptr);
+	BOOST_TEST (rs->tell() == toc.sections[0].start + 110);
+
+	/* Neither compressed ones */
+	rs->seek (toc.sections[1].start);
+	BOOST_TEST (rs->read_view (10) == nullptr);
+}
+
+
+/* Records the raw data that a SectionedReadStream reads */
+struct RecordingObserver : public tf::SectionedReadStream::RawDataObserver
+{
+	vector<pair<uint64_t, string>> data;
+
+	void observe (uint64_t offset, const char *d, size_t size) override
+	{
+		data.emplace_back (offset, string(d, size));
+	}
+};
+
+
+BOOST_AUTO_TEST_CASE (test_raw_data_observer)
+{
+	TemporaryFile tmp("test_transport_form");
+	tmp.close();
+
+	auto stored = make_content ('a', 5000);
+	auto compressed = make_content ('A', 100000);
+
+	tf::TableOfContents toc;
+	toc.version = 3;
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_DESC, 0, stored.size()));
+	toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_ARCHIVE, 0, compressed.size()));
+	toc.sections[1].encoding = tf::SEC_ENCODING_GZIP;
+	toc.update_starts();
+
+	{
+		tf::Writer w(tmp.path());
+		BOOST_TEST (tf::write_sections (w, toc, { stored.c_str(), compressed.c_str() }) == 0);
+	}
+
+	ifstream f(tmp.path(), ios::binary);
+	string file((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+
+	auto rs = tf::open_read_stream (tmp.path());
+	auto srs = dynamic_cast<tf::SectionedReadStream*> (rs.get());
+	BOOST_REQUIRE (srs);
+
+	RecordingObserver o;
+	srs->set_raw_observer (&o);
+
+	/* Through read, read_view and the decoder */
+	string buf(1000, '\0');
+	rs->seek (toc.sections[0].start);
+	rs->read (buf.data(), buf.size());
+	BOOST_REQUIRE (rs->read_view (stored.size() - buf.size()));
+
+	buf.resize (compressed.size());
+	rs->read (buf.data(), buf.size());
+	BOOST_TEST ((buf == compressed));
+
+	/* The observed data is the file's content, in order */
+	BOOST_REQUIRE (o.data.size() >= 3U);
+
+	uint64_t next = o.data.front().first;
+	for (auto& [offset, d] : o.data)
+	{
+		BOOST_TEST (offset == next);
+		BOOST_TEST ((d == file.substr (offset, d.size())));
+		next = offset + d.size();
+	}
+
+	BOOST_TEST (next > file.size() - 100);
+
+	/* Removing the observer */
+	srs->set_raw_observer (nullptr);
+	auto cnt = o.data.size();
+	rs->seek (toc.sections[0].start);
+	rs->read (buf.data(), 10);
+	BOOST_TEST (o.data.size() == cnt);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_read_file_list_chunked)
+{
+	TemporaryFile tmp("test_transport_form");
+
+	/* Create an index that spans multiple chunks, including a record that is
+	 * larger than a chunk. */
+	DynamicBuffer<uint8_t> buf;
+	size_t size = 0;
+	uint8_t sha1_sum[20] = { 0 };
+
+	vector<string> paths;
+	for (unsigned i = 0; i < 3000; i++)
+		paths.push_back ("/usr/share/test/file" + to_string(1000 + i));
+
+	paths.push_back ("/usr/share/x" + string(100000, 'y'));
+
+	for (auto& p : paths)
+	{
+		FileRecord r(FILE_TYPE_REGULAR, 1, 2, 0644, p.size(), sha1_sum, p);
+
+		buf.ensure_size (size + r.binary_size());
+		r.to_binary (buf.buf + size);
+		size += r.binary_size();
+	}
+
+	tmp.append_string (string((const char*) buf.buf, size));
+	tmp.close();
+
+	int fd = open (tmp.path().c_str(), O_RDONLY);
+	BOOST_REQUIRE (fd >= 0);
+
+	tf::FDReadStream rs1(fd, true);
+	tf::MmapReadStream rs2(tmp.path());
+
+	auto fl1 = tf::read_file_list (rs1, size);
+	auto fl2 = tf::read_file_list (rs2, size);
+
+	size_t cnt = 0;
+	auto i2 = fl2->begin();
+
+	for (auto i1 = fl1->begin(); i1 != fl1->end(); i1++, i2++, cnt++)
+	{
+		BOOST_REQUIRE (i2 != fl2->end());
+		BOOST_TEST (i1->path == i2->path);
+		BOOST_TEST (i1->size == i1->path.size());
+		BOOST_TEST (i1->uid == 1);
+		BOOST_TEST (i1->gid == 2);
+	}
+
+	BOOST_TEST (cnt == paths.size());
+	BOOST_TEST ((i2 == fl2->end()));
+}
@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <cerrno>
 #include <cstring>
+#include <limits>
 #include <system_error>
 #include "transport_form.h"
 #include "architecture.h"
@@ -9,7 +10,10 @@
 
 extern "C" {
 #include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 }
 
@@ -23,27 +27,270 @@ namespace TransportForm
 /* A file writer */
 Writer::Writer (const string& filename)
 {
-	f = gzopen (filename.c_str(), "we");
+	fd = open (filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
 
-	if (!f)
+	if (fd < 0)
 		throw system_error (error_code (errno, generic_category()));
 }
 
 
 Writer::~Writer ()
 {
-	gzclose (f);
+	close (fd);
 }
 
 
-int Writer::write (const char *buf, int size)
+int Writer::write_out (const char *buf, size_t size)
 {
-	int cnt = gzwrite (f, buf, size);
+	size_t written = 0;
 
-	if (cnt != size)
-		return -errno;
-	else
+	while (written < size)
+	{
+		ssize_t ret = ::write (fd, buf + written, size - written);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		if (ret == 0)
+			return -EIO;
+
+		written += ret;
+	}
+
+	pos += size;
+	return 0;
+}
+
+
+void Writer::set_threads (unsigned threads)
+{
+	this->threads = MAX(threads, 1U);
+}
+
+
+int Writer::ensure_compressor ()
+{
+	if (compressor)
 		return 0;
+
+	try
+	{
+		compressor = create_compressor (section_encoding, section_level);
+	}
+	catch (bad_alloc&)
+	{
+		return -ENOMEM;
+	}
+	catch (system_error& e)
+	{
+		return -e.code().value();
+	}
+
+	return 0;
+}
+
+
+int Writer::finish_stream ()
+{
+	if (!compressor || !compressor_used)
+		return 0;
+
+	auto r = compressor->compress (nullptr, 0, true, [this](const char *b, size_t s) {
+		return write_out (b, s);
+	});
+
+	compressor = nullptr;
+	compressor_used = false;
+
+	return r;
+}
+
+
+int Writer::write_toc (const TableOfContents& toc)
+{
+	if (in_section)
+		return -EINVAL;
+
+	ManagedBuffer<char> buf(toc.binary_size());
+	toc.to_binary (buf.buf);
+
+	/* Reserve space */
+	if (pos == 0)
+		return write_out (buf.buf, buf.size);
+
+	if (pos < buf.size)
+		return -EINVAL;
+
+	/* Overwrite the TOC written before */
+	size_t written = 0;
+
+	while (written < buf.size)
+	{
+		ssize_t ret = pwrite (fd, buf.buf + written, buf.size - written, written);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		if (ret == 0)
+			return -EIO;
+
+		written += ret;
+	}
+
+	return 0;
+}
+
+
+int Writer::begin_section (uint8_t encoding, int level)
+{
+	if (in_section)
+		return -EINVAL;
+
+	if (!encoding_valid (encoding))
+		return -EINVAL;
+
+	if (!encoding_supported (encoding))
+		return -ENOTSUP;
+
+	section_encoding = encoding;
+	section_level = level;
+	section_offset = pos;
+
+	/* Create the compressor right away to validate the level */
+	compressor = nullptr;
+	compressor_used = false;
+
+	if (encoding != SEC_ENCODING_STORED)
+	{
+		auto r = ensure_compressor();
+		if (r != 0)
+			return r;
+	}
+
+	in_section = true;
+	return 0;
+}
+
+
+int Writer::write (const char *buf, size_t size)
+{
+	if (!in_section)
+		return -EINVAL;
+
+	if (section_encoding == SEC_ENCODING_STORED)
+		return write_out (buf, size);
+
+	/* Large writes are compressed in parallel into streams of their own, hence
+	 * a stream in progress must be terminated first. */
+	if (threads > 1 && size >= 2 * PARALLEL_BLOCK_SIZE)
+	{
+		auto r = finish_stream();
+		if (r != 0)
+			return r;
+
+		return compress_parallel (section_encoding, section_level, buf, size, threads,
+				[this](const char *b, size_t s) {
+					return write_out (b, s);
+				});
+	}
+
+	auto r = ensure_compressor();
+	if (r != 0)
+		return r;
+
+	compressor_used = true;
+	return compressor->compress (buf, size, false, [this](const char *b, size_t s) {
+		return write_out (b, s);
+	});
+}
+
+
+int Writer::write_from (const DataSource& src, uint64_t& size)
+{
+	if (!in_section)
+		return -EINVAL;
+
+	/* Parallel compression needs a few blocks per thread at once */
+	size_t buf_size = threads > 1 ?
+		2 * (size_t) threads * PARALLEL_BLOCK_SIZE : PARALLEL_BLOCK_SIZE;
+
+	unique_ptr<char[]> buf(new (nothrow) char[buf_size]);
+	if (!buf)
+		return -ENOMEM;
+
+	size = 0;
+
+	for (bool eof = false; !eof;)
+	{
+		size_t cnt = 0;
+
+		while (cnt < buf_size)
+		{
+			auto r = src (buf.get() + cnt, buf_size - cnt);
+			if (r < 0)
+				return r;
+
+			if (r == 0)
+			{
+				eof = true;
+				break;
+			}
+
+			cnt += r;
+		}
+
+		if (cnt > 0)
+		{
+			auto r = write (buf.get(), cnt);
+			if (r != 0)
+				return r;
+
+			size += cnt;
+		}
+	}
+
+	return 0;
+}
+
+
+int Writer::end_section (uint64_t& offset, uint64_t& encoded_size)
+{
+	if (!in_section)
+		return -EINVAL;
+
+	in_section = false;
+
+	if (section_encoding != SEC_ENCODING_STORED)
+	{
+		/* Empty sections consist of an empty stream */
+		if (pos == section_offset && !compressor_used)
+		{
+			auto r = ensure_compressor();
+			if (r != 0)
+				return r;
+
+			compressor_used = true;
+		}
+
+		auto r = finish_stream();
+		compressor = nullptr;
+
+		if (r != 0)
+			return r;
+	}
+
+	offset = section_offset;
+	encoded_size = pos - section_offset;
+
+	return 0;
 }
 
 
@@ -61,128 +308,586 @@ string ReadStream::get_filename() const
 	return "";
 }
 
+const char *ReadStream::read_view (size_t cnt)
+{
+	return nullptr;
+}
+
 
 GZReadStream::GZReadStream (const string& filename)
 	: filename(filename)
 {
 	f = gzopen (filename.c_str(), "re");
 
-	if (!f)
-		throw system_error (error_code (errno, generic_category()));
+	if (!f)
+		throw system_error (error_code (errno, generic_category()));
+}
+
+
+GZReadStream::~GZReadStream ()
+{
+	gzclose (f);
+}
+
+
+string GZReadStream::get_filename() const
+{
+	return filename;
+}
+
+void GZReadStream::read (char *buf, size_t cnt)
+{
+	/* gzread can only read up to INT_MAX bytes at once */
+	while (cnt > 0)
+	{
+		unsigned chunk = MIN(cnt, (size_t) 1 << 30);
+
+		int ret = gzread (f, buf, chunk);
+
+		if (ret < 0)
+			throw system_error (error_code (errno, generic_category()));
+
+		if (ret != (int) chunk)
+			throw system_error (error_code (ENODATA, generic_category()));
+
+		buf += chunk;
+		cnt -= chunk;
+	}
+}
+
+
+uint64_t GZReadStream::tell ()
+{
+	/* z_off_t is 64 bit wide with large file support */
+	z_off_t ret = gztell (f);
+	if (ret < 0)
+		throw system_error (error_code (EIO, generic_category()));
+
+	return ret;
+}
+
+
+void GZReadStream::seek (uint64_t pos)
+{
+	if (pos > (uint64_t) numeric_limits<z_off_t>::max())
+		throw system_error (error_code (EOVERFLOW, generic_category()));
+
+	if (gzseek (f, pos, SEEK_SET) < 0)
+		throw system_error (error_code (EIO, generic_category()));
+}
+
+
+FDReadStream::FDReadStream(int fd, bool close)
+	: fd(fd), close(close)
+{
+}
+
+FDReadStream::~FDReadStream()
+{
+	if (close && fd >= 0)
+		::close(fd);
+}
+
+void FDReadStream::read(char* buf, size_t cnt)
+{
+	size_t read_total = 0;
+
+	while (read_total < cnt)
+	{
+		ssize_t ret = ::read(fd, buf + read_total, cnt - read_total);
+		if (ret < 0)
+			throw system_error(error_code(errno, generic_category()));
+
+		if (ret == 0)
+		{
+			if (errno == EINTR)
+				continue;
+			else
+				throw system_error(error_code(errno, generic_category()));
+		}
+
+		read_total += ret;
+	}
+}
+
+uint64_t FDReadStream::tell()
+{
+	off_t ret = lseek(fd, 0, SEEK_CUR);
+	if (ret < 0)
+		throw system_error(error_code(errno, generic_category()));
+
+	return ret;
+}
+
+void FDReadStream::seek(uint64_t pos)
+{
+	if (pos > (uint64_t) numeric_limits<off_t>::max())
+		throw system_error(error_code(EOVERFLOW, generic_category()));
+
+	if (lseek(fd, pos, SEEK_SET) < 0)
+		throw system_error(error_code(errno, generic_category()));
+}
+
+
+MmapReadStream::MmapReadStream (const string& filename)
+	: filename(filename)
+{
+	int fd = open (filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error (error_code (errno, generic_category()));
+
+	try
+	{
+		map (fd);
+	}
+	catch (...)
+	{
+		close (fd);
+		throw;
+	}
+
+	close (fd);
+}
+
+MmapReadStream::MmapReadStream (int fd, const string& filename)
+	: filename(filename)
+{
+	map (fd);
+}
+
+MmapReadStream::~MmapReadStream ()
+{
+	if (data)
+		munmap ((void*) data, size);
+}
+
+void MmapReadStream::map (int fd)
+{
+	struct stat statbuf;
+	if (fstat (fd, &statbuf) < 0)
+		throw system_error (error_code (errno, generic_category()));
+
+	if ((uint64_t) statbuf.st_size > numeric_limits<size_t>::max())
+		throw system_error (error_code (EFBIG, generic_category()));
+
+	size = statbuf.st_size;
+
+	/* Empty files cannot be mapped */
+	if (size == 0)
+		return;
+
+	void *addr = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED)
+		throw system_error (error_code (errno, generic_category()));
+
+	data = (const char*) addr;
+}
+
+string MmapReadStream::get_filename() const
+{
+	return filename;
+}
+
+void MmapReadStream::read (char *buf, size_t cnt)
+{
+	memcpy (buf, read_view (cnt), cnt);
+}
+
+uint64_t MmapReadStream::tell ()
+{
+	return pos;
+}
+
+void MmapReadStream::seek (uint64_t pos)
+{
+	this->pos = pos;
+}
+
+const char *MmapReadStream::read_view (size_t cnt)
+{
+	if (pos > size || cnt > size - pos)
+		throw system_error (error_code (ENODATA, generic_category()));
+
+	auto ret = data + pos;
+	pos += cnt;
+	return ret;
+}
+
+
+SectionedReadStream::SectionedReadStream (int fd, const string& filename)
+	: fd(fd), filename(filename)
+{
+	try
+	{
+		/* Map the file if possible */
+		struct stat statbuf;
+		if (fstat (fd, &statbuf) < 0)
+			throw system_error (error_code (errno, generic_category()));
+
+		if (statbuf.st_size > 0 && (uint64_t) statbuf.st_size <= numeric_limits<size_t>::max())
+		{
+			void *addr = mmap (nullptr, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr != MAP_FAILED)
+			{
+				map = (const char*) addr;
+				map_size = statbuf.st_size;
+			}
+		}
+
+		/* To read the TOC, the entire file is represented as one stored
+		 * pseudo-section. */
+		TOCSection whole_file (0, 0, numeric_limits<uint64_t>::max());
+		sections.push_back (whole_file);
+
+		auto toc = TableOfContents::read_from_binary (*this);
+
+		/* Version 1 transport forms that are not compressed at all are simply
+		 * read as they are. */
+		if (toc.version >= 2)
+		{
+			sections.clear();
+
+			TOCSection toc_sec (0, 0, toc.binary_size());
+			toc_sec.encoded_size = toc_sec.size;
+			sections.push_back (toc_sec);
+
+			vector<TOCSection> secs(toc.sections);
+			sort (secs.begin(), secs.end(), [](auto& a, auto& b) {
+				return a.start < b.start;
+			});
+
+			for (auto& sec : secs)
+			{
+				auto& last = sections.back();
+				if (sec.start < last.start + last.size)
+					throw InvalidToc (filename, "Overlapping sections");
+
+				sections.push_back (sec);
+			}
+		}
+
+		pos = 0;
+	}
+	catch (...)
+	{
+		if (map)
+			munmap ((void*) map, map_size);
+
+		::close (fd);
+		throw;
+	}
+}
+
+SectionedReadStream::~SectionedReadStream ()
+{
+	if (map)
+		munmap ((void*) map, map_size);
+
+	::close (fd);
+}
+
+string SectionedReadStream::get_filename() const
+{
+	return filename;
+}
+
+void SectionedReadStream::open_section (size_t i)
+{
+	auto encoding = sections[i].encoding;
+
+	if (decoder && decoder_encoding == encoding)
+	{
+		decoder->reset();
+	}
+	else
+	{
+		decoder = create_decompressor (encoding);
+		decoder_encoding = encoding;
+	}
+
+	in_ptr = nullptr;
+	in_avail = 0;
+
+	dec_section = i;
+	dec_pos = sections[i].start;
+	dec_in_consumed = 0;
+}
+
+size_t SectionedReadStream::decode (char *buf, size_t cnt)
+{
+	const auto& sec = sections[dec_section];
+	size_t remaining = cnt;
+
+	while (remaining > 0)
+	{
+		if (in_avail == 0 && map)
+		{
+			size_t to_read = MIN((uint64_t) SIZE_MAX, sec.encoded_size - dec_in_consumed);
+			if (to_read == 0 || sec.offset + dec_in_consumed + to_read > map_size)
+				throw system_error (error_code (ENODATA, generic_category()));
+
+			in_ptr = map + sec.offset + dec_in_consumed;
+			in_avail = to_read;
+			dec_in_consumed += to_read;
+		}
+		else if (in_avail == 0)
+		{
+			size_t to_read = MIN((uint64_t) sizeof(in_buf), sec.encoded_size - dec_in_consumed);
+			if (to_read == 0)
+				throw system_error (error_code (ENODATA, generic_category()));
+
+			ssize_t ret = pread (fd, in_buf, to_read, sec.offset + dec_in_consumed);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				throw system_error (error_code (errno, generic_category()));
+			}
+
+			if (ret == 0)
+				throw system_error (error_code (ENODATA, generic_category()));
+
+			dec_in_consumed += ret;
+			in_ptr = in_buf;
+			in_avail = ret;
+		}
+
+		auto in_start = in_ptr;
+		auto in_offset = sec.offset + dec_in_consumed - in_avail;
+
+		decoder->decode (in_ptr, in_avail, buf, remaining);
+
+		if (raw_observer && in_ptr > in_start)
+			raw_observer->observe (in_offset, in_start, in_ptr - in_start);
+	}
+
+	dec_pos += cnt;
+	return cnt;
+}
+
+void SectionedReadStream::read (char *buf, size_t cnt)
+{
+	while (cnt > 0)
+	{
+		/* Find the section that contains the current position */
+		size_t i = 0;
+		for (; i < sections.size(); i++)
+		{
+			if (pos >= sections[i].start && pos - sections[i].start < sections[i].size)
+				break;
+		}
+
+		if (i >= sections.size())
+			throw system_error (error_code (ENODATA, generic_category()));
+
+		const auto& sec = sections[i];
+		size_t to_read = MIN((uint64_t) cnt, sec.start + sec.size - pos);
+
+		if (sec.encoding == SEC_ENCODING_STORED && map)
+		{
+			auto offset = sec.offset + (pos - sec.start);
+			if (offset > map_size || to_read > map_size - offset)
+				throw system_error (error_code (ENODATA, generic_category()));
+
+			memcpy (buf, map + offset, to_read);
+
+			if (raw_observer)
+				raw_observer->observe (offset, map + offset, to_read);
+		}
+		else if (sec.encoding == SEC_ENCODING_STORED)
+		{
+			size_t read_total = 0;
+
+			while (read_total < to_read)
+			{
+				ssize_t ret = pread (fd, buf + read_total, to_read - read_total,
+						sec.offset + (pos - sec.start) + read_total);
+
+				if (ret < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					throw system_error (error_code (errno, generic_category()));
+				}
+
+				if (ret == 0)
+					throw system_error (error_code (ENODATA, generic_category()));
+
+				read_total += ret;
+			}
+
+			if (raw_observer)
+				raw_observer->observe (sec.offset + (pos - sec.start), buf, to_read);
+		}
+		else
+		{
+			/* Only restart decoding if we cannot continue from the current
+			 * position */
+			if (dec_section != (ssize_t) i || dec_pos > pos)
+				open_section (i);
+
+			while (dec_pos < pos)
+			{
+				char tmp[8192];
+				decode (tmp, MIN((uint64_t) sizeof(tmp), pos - dec_pos));
+			}
+
+			decode (buf, to_read);
+		}
+
+		pos += to_read;
+		buf += to_read;
+		cnt -= to_read;
+	}
 }
 
-
-GZReadStream::~GZReadStream ()
+uint64_t SectionedReadStream::tell ()
 {
-	gzclose (f);
+	return pos;
 }
 
-
-string GZReadStream::get_filename() const
+void SectionedReadStream::seek (uint64_t pos)
 {
-	return filename;
+	/* Decoders are repositioned lazily during the next read. */
+	this->pos = pos;
 }
 
-void GZReadStream::read (char *buf, size_t cnt)
+const char *SectionedReadStream::read_view (size_t cnt)
 {
-	int ret = gzread (f, buf, cnt);
-
-	if (ret < 0)
-		throw system_error (error_code (errno, generic_category()));
+	if (!map)
+		return nullptr;
 
-	if (ret != (int) cnt)
-		throw system_error (error_code (ENODATA, generic_category()));
-}
+	for (auto& sec : sections)
+	{
+		if (pos >= sec.start && pos - sec.start < sec.size)
+		{
+			if (sec.encoding != SEC_ENCODING_STORED || cnt > sec.start + sec.size - pos)
+				return nullptr;
 
+			auto offset = sec.offset + (pos - sec.start);
+			if (offset > map_size || cnt > map_size - offset)
+				throw system_error (error_code (ENODATA, generic_category()));
 
-size_t GZReadStream::tell ()
-{
-	int ret = gztell (f);
-	if (ret < 0)
-		throw system_error (error_code (EIO, generic_category()));
+			pos += cnt;
 
-	return ret;
-}
+			if (raw_observer)
+				raw_observer->observe (offset, map + offset, cnt);
 
+			return map + offset;
+		}
+	}
 
-void GZReadStream::seek (size_t pos)
-{
-	if (gzseek (f, pos, SEEK_SET) < 0)
-		throw system_error (error_code (EIO, generic_category()));
+	return nullptr;
 }
 
-
-FDReadStream::FDReadStream(int fd, bool close)
-	: fd(fd), close(close)
+void SectionedReadStream::set_raw_observer (RawDataObserver *observer)
 {
+	raw_observer = observer;
 }
 
-FDReadStream::~FDReadStream()
-{
-	if (close && fd >= 0)
-		::close(fd);
-}
 
-void FDReadStream::read(char* buf, size_t cnt)
+unique_ptr<ReadStream> open_read_stream (const string& filename)
 {
-	size_t read_total = 0;
+	int fd = open (filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error (error_code (errno, generic_category()));
 
-	while (read_total < cnt)
+	/* Version 1 transport forms are entirely gzip compressed */
+	unsigned char magic[2];
+	ssize_t ret = pread (fd, magic, sizeof(magic), 0);
+	if (ret < 0)
 	{
-		ssize_t ret = ::read(fd, buf + read_total, cnt - read_total);
-		if (ret < 0)
-			throw system_error(error_code(errno, generic_category()));
-
-		if (ret == 0)
-		{
-			if (errno == EINTR)
-				continue;
-			else
-				throw system_error(error_code(errno, generic_category()));
-		}
-
-		read_total += ret;
+		int err = errno;
+		close (fd);
+		throw system_error (error_code (err, generic_category()));
 	}
-}
 
-size_t FDReadStream::tell()
-{
-	int ret = lseek(fd, 0, SEEK_CUR);
-	if (ret < 0)
-		throw system_error(error_code(errno, generic_category()));
+	if (ret == 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+	{
+		close (fd);
+		return make_unique<GZReadStream> (filename);
+	}
 
-	return ret;
+	return make_unique<SectionedReadStream> (fd, filename);
 }
 
-void FDReadStream::seek(size_t pos)
+
+TOCSection::TOCSection (uint8_t type, uint64_t start, uint64_t size)
+	: type(type), start(start), size(size)
 {
-	if (lseek(fd, pos, SEEK_SET) < 0)
-		throw system_error(error_code(errno, generic_category()));
 }
 
 
-TOCSection::TOCSection (uint8_t type, uint32_t start, uint32_t size)
-	: type(type), start(start), size(size)
+unsigned TOCSection::binary_size (uint8_t version)
 {
+	if (version >= 3)
+		return 34;
+
+	return version >= 2 ? 18 : 9;
 }
 
 
-void TOCSection::to_binary (char *buf) const
+void TOCSection::to_binary (char *buf, uint8_t version) const
 {
-	buf[0] = (uint8_t) type;
-	*((uint32_t*) (buf + 1)) = htole32 (start);
-	*((uint32_t*) (buf + 5)) = htole32 (size);
+	if (version >= 3)
+	{
+		buf[0] = (uint8_t) type;
+		buf[1] = (uint8_t) encoding;
+		*((uint64_t*) (buf + 2)) = htole64 (start);
+		*((uint64_t*) (buf + 10)) = htole64 (size);
+		*((uint64_t*) (buf + 18)) = htole64 (offset);
+		*((uint64_t*) (buf + 26)) = htole64 (encoded_size);
+	}
+	else if (version >= 2)
+	{
+		buf[0] = (uint8_t) type;
+		buf[1] = (uint8_t) encoding;
+		*((uint32_t*) (buf + 2)) = htole32 (start);
+		*((uint32_t*) (buf + 6)) = htole32 (size);
+		*((uint32_t*) (buf + 10)) = htole32 (offset);
+		*((uint32_t*) (buf + 14)) = htole32 (encoded_size);
+	}
+	else
+	{
+		buf[0] = (uint8_t) type;
+		*((uint32_t*) (buf + 1)) = htole32 (start);
+		*((uint32_t*) (buf + 5)) = htole32 (size);
+	}
 }
 
 
-TOCSection TOCSection::read_from_binary (ReadStream& rs)
+TOCSection TOCSection::read_from_binary (ReadStream& rs, uint8_t version)
 {
-	char buf[9];
-	rs.read (buf, 9);
+	char buf[34];
+	rs.read (buf, binary_size (version));
 
 	uint8_t type = *((uint8_t*) buf);
-	uint32_t start = le32toh (*((uint32_t*) (buf + 1)));
-	uint32_t size = le32toh (*((uint32_t*) (buf + 5)));
+	uint8_t encoding = SEC_ENCODING_STORED;
+	uint64_t start, size, offset = 0, encoded_size = 0;
+
+	if (version >= 3)
+	{
+		encoding = *((uint8_t*) (buf + 1));
+		start = le64toh (*((uint64_t*) (buf + 2)));
+		size = le64toh (*((uint64_t*) (buf + 10)));
+		offset = le64toh (*((uint64_t*) (buf + 18)));
+		encoded_size = le64toh (*((uint64_t*) (buf + 26)));
+	}
+	else if (version >= 2)
+	{
+		encoding = *((uint8_t*) (buf + 1));
+		start = le32toh (*((uint32_t*) (buf + 2)));
+		size = le32toh (*((uint32_t*) (buf + 6)));
+		offset = le32toh (*((uint32_t*) (buf + 10)));
+		encoded_size = le32toh (*((uint32_t*) (buf + 14)));
+	}
+	else
+	{
+		start = le32toh (*((uint32_t*) (buf + 1)));
+		size = le32toh (*((uint32_t*) (buf + 5)));
+	}
 
 	switch (type)
 	{
@@ -201,13 +906,26 @@ TOCSection TOCSection::read_from_binary (ReadStream& rs)
 			throw InvalidToc (rs.get_filename(), "Invalid section type " + to_string(type));
 	}
 
-	return TOCSection(type, start, size);
+	/* Unsupported encodings are only detected when reading the section, such
+	 * that other sections can still be read. */
+	if (!encoding_valid (encoding))
+		throw InvalidToc (rs.get_filename(), "Invalid section encoding " + to_string(encoding));
+
+	if (encoding == SEC_ENCODING_STORED && version >= 2 && encoded_size != size)
+		throw InvalidToc (rs.get_filename(), "Invalid size of stored section");
+
+	TOCSection sec(type, start, size);
+	sec.encoding = encoding;
+	sec.offset = offset;
+	sec.encoded_size = encoded_size;
+
+	return sec;
 }
 
 
 unsigned TableOfContents::binary_size() const
 {
-	return 2 + sections.size() * TOCSection::binary_size;
+	return 2 + sections.size() * TOCSection::binary_size (version);
 }
 
 
@@ -217,7 +935,19 @@ void TableOfContents::to_binary (char *buf) const
 	buf[1] = (uint8_t) sections.size();
 
 	for (size_t i = 0; i < sections.size(); i++)
-		sections[i].to_binary (buf + 2 + i * TOCSection::binary_size);
+		sections[i].to_binary (buf + 2 + i * TOCSection::binary_size (version), version);
+}
+
+
+void TableOfContents::update_starts()
+{
+	uint64_t pos = binary_size();
+
+	for (auto& s : sections)
+	{
+		s.start = pos;
+		pos += s.size;
+	}
 }
 
 
@@ -228,7 +958,7 @@ TableOfContents TableOfContents::read_from_binary (ReadStream& rs)
 	rs.read(buf, 2);
 
 	uint8_t version = ((uint8_t*) buf)[0];
-	if (version != 1)
+	if (version < 1 || version > 3)
 		throw InvalidToc (rs.get_filename(), "Invalid version " + to_string(version));
 
 	TableOfContents toc;
@@ -238,7 +968,7 @@ TableOfContents TableOfContents::read_from_binary (ReadStream& rs)
 
 	while (sec_count > 0)
 	{
-		toc.sections.emplace_back (TOCSection::read_from_binary (rs));
+		toc.sections.emplace_back (TOCSection::read_from_binary (rs, version));
 		sec_count--;
 	}
 
@@ -246,6 +976,66 @@ TableOfContents TableOfContents::read_from_binary (ReadStream& rs)
 }
 
 
+/* Record where a section of toc has been written to */
+static int set_section_position (const TableOfContents& toc, TOCSection& sec,
+		uint64_t offset, uint64_t encoded_size)
+{
+	/* Version 2 has only 32 bit fields */
+	if (toc.version < 3 && (
+				offset > numeric_limits<uint32_t>::max() ||
+				encoded_size > numeric_limits<uint32_t>::max() ||
+				sec.start + sec.size > numeric_limits<uint32_t>::max()))
+		return -EFBIG;
+
+	sec.offset = offset;
+	sec.encoded_size = encoded_size;
+	return 0;
+}
+
+
+static int write_section (Writer& w, const TableOfContents& toc, TOCSection& sec,
+		const char *data, int level)
+{
+	auto r = w.begin_section (sec.encoding, level);
+	if (r != 0)
+		return r;
+
+	r = w.write (data, sec.size);
+	if (r != 0)
+		return r;
+
+	uint64_t offset, encoded_size;
+	r = w.end_section (offset, encoded_size);
+	if (r != 0)
+		return r;
+
+	return set_section_position (toc, sec, offset, encoded_size);
+}
+
+
+int write_sections (Writer& w, TableOfContents& toc, const vector<const char*>& data,
+		int level)
+{
+	if (toc.version < 2 || data.size() != toc.sections.size())
+		return -EINVAL;
+
+	/* Reserve space for the TOC */
+	auto r = w.write_toc (toc);
+	if (r != 0)
+		return r;
+
+	for (size_t i = 0; i < toc.sections.size(); i++)
+	{
+		r = write_section (w, toc, toc.sections[i], data[i], level);
+		if (r != 0)
+			return r;
+	}
+
+	/* Fill in the sections' offsets */
+	return w.write_toc (toc);
+}
+
+
 /* A class that represents a transport form */
 void TransportForm::set_desc (const char *desc, size_t size)
 {
@@ -293,6 +1083,21 @@ void TransportForm::set_archive (const uint8_t *archive, size_t size)
 {
 	this->archive = archive;
 	this->archive_size = size;
+	archive_src = nullptr;
+}
+
+
+void TransportForm::set_archive (DataSource src)
+{
+	archive = nullptr;
+	archive_size = 0;
+	archive_src = move (src);
+}
+
+void TransportForm::set_encoding (uint8_t encoding, int level)
+{
+	this->encoding = encoding;
+	this->level = level;
 }
 
 
@@ -307,7 +1112,7 @@ TableOfContents TransportForm::get_toc() const
 
 	/* First build the toc and update the positions later once the toc's size is
 	 * clear. */
-	t.version = 1;
+	t.version = 3;
 
 	t.sections.push_back (TOCSection (SEC_TYPE_DESC, 0, desc_size));
 
@@ -336,18 +1141,16 @@ TableOfContents TransportForm::get_toc() const
 
 
 	/* Add archive */
-	if (archive)
+	if (archive || archive_src)
 		t.sections.push_back (TOCSection (SEC_TYPE_ARCHIVE, 0, archive_size));
 
 
-	/* Update offsets */
-	uint32_t pos = t.binary_size();
-
+	/* Compress all sections independently */
 	for (auto& s : t.sections)
-	{
-		s.start = pos;
-		pos += s.size;
-	}
+		s.encoding = encoding;
+
+	/* Update offsets */
+	t.update_starts();
 
 	return t;
 }
@@ -358,84 +1161,98 @@ int TransportForm::write (Writer& w)
 	if (!desc)
 		return -ENOMEM;
 
-	if ((file_index == nullptr) != (archive == nullptr))
+	bool have_archive = archive || archive_src;
+
+	if ((file_index == nullptr) != !have_archive)
 		return -ENOMEM;
 
 	if ((config_files != nullptr) && (file_index == nullptr))
 		return -ENOMEM;
 
-	/* Write toc */
+	TableOfContents toc = get_toc();
+	vector<const char*> data;
+
+	for (auto& sec : toc.sections)
 	{
-		TableOfContents toc = get_toc();
-		auto toc_size = toc.binary_size();
+		switch (sec.type)
+		{
+			case SEC_TYPE_DESC:
+				data.push_back (desc);
+				break;
+
+			case SEC_TYPE_FILE_INDEX:
+				data.push_back (file_index);
+				break;
 
-		ManagedBuffer<char> buf(toc_size);
-		toc.to_binary (buf.buf);
+			case SEC_TYPE_CONFIG_FILES:
+				data.push_back (config_files);
+				break;
 
-		auto r = w.write (buf.buf, toc_size);
-		if (r != 0)
-			return r;
+			case SEC_TYPE_PREINST:
+				data.push_back (preinst);
+				break;
+
+			case SEC_TYPE_CONFIGURE:
+				data.push_back (configure);
+				break;
+
+			case SEC_TYPE_UNCONFIGURE:
+				data.push_back (unconfigure);
+				break;
+
+			case SEC_TYPE_POSTRM:
+				data.push_back (postrm);
+				break;
+
+			case SEC_TYPE_ARCHIVE:
+				data.push_back ((const char*) archive);
+				break;
+
+			default:
+				return -EINVAL;
+		}
 	}
 
-	/* Write desc */
-	auto r = w.write (desc, desc_size);
+	if (!archive_src)
+		return write_sections (w, toc, data, level);
+
+	/* The archive is the last section, hence the positions of the other
+	 * sections do not depend on its size. Write them first, then stream the
+	 * archive and fill in its size afterwards. */
+	if (toc.version < 2 || toc.sections.back().type != SEC_TYPE_ARCHIVE)
+		return -EINVAL;
+
+	auto r = w.write_toc (toc);
 	if (r != 0)
 		return r;
 
-	/* Write file index if there */
-	if (file_index)
-	{
-		r = w.write (file_index, file_index_size);
-		if (r != 0)
-			return r;
-	}
-
-	/* Write config files if there */
-	if (config_files)
+	for (size_t i = 0; i < toc.sections.size() - 1; i++)
 	{
-		r = w.write (config_files, config_files_size);
+		r = write_section (w, toc, toc.sections[i], data[i], level);
 		if (r != 0)
 			return r;
 	}
 
-	/* Write maintainer scripts if present */
-	if (preinst)
-	{
-		r = w.write (preinst, preinst_size);
-		if (r != 0)
-			return r;
-	}
+	auto& sec = toc.sections.back();
 
-	if (configure)
-	{
-		r = w.write (configure, configure_size);
-		if (r != 0)
-			return r;
-	}
+	r = w.begin_section (sec.encoding, level);
+	if (r != 0)
+		return r;
 
-	if (unconfigure)
-	{
-		r = w.write (unconfigure, unconfigure_size);
-		if (r != 0)
-			return r;
-	}
+	r = w.write_from (archive_src, sec.size);
+	if (r != 0)
+		return r;
 
-	if (postrm)
-	{
-		r = w.write (postrm, postrm_size);
-		if (r != 0)
-			return r;
-	}
+	uint64_t offset, encoded_size;
+	r = w.end_section (offset, encoded_size);
+	if (r != 0)
+		return r;
 
-	/* Write archive if there */
-	if (archive)
-	{
-		r = w.write ((const char*) archive, archive_size);
-		if (r != 0)
-			return r;
-	}
+	r = set_section_position (toc, sec, offset, encoded_size);
+	if (r != 0)
+		return r;
 
-	return 0;
+	return w.write_toc (toc);
 }
 
 
@@ -450,10 +1267,21 @@ ReadTransportForm read_transport_form (ReadStream& rs)
 	if (rtf.toc.sections.size() == 0 || rtf.toc.sections[0].type != SEC_TYPE_DESC)
 		throw InvalidToc (rs.get_filename(), "There is no desc section.");
 
-	ManagedBuffer<char> buf(rtf.toc.sections[0].size);
-	rs.read (buf.buf, buf.size);
+	auto desc_size = rtf.toc.sections[0].size;
+
+	/* Parse directly from the stream's memory if possible */
+	auto view = rs.read_view (desc_size);
+	if (view)
+	{
+		rtf.mdata = read_package_meta_data_from_xml (view, desc_size);
+	}
+	else
+	{
+		ManagedBuffer<char> buf(desc_size);
+		rs.read (buf.buf, buf.size);
 
-	rtf.mdata = read_package_meta_data_from_xml (buf.buf, buf.size);
+		rtf.mdata = read_package_meta_data_from_xml (buf.buf, buf.size);
+	}
 
 	/* Read the file index and ensure that the archive section is there if and
 	 * only if the index is in the file. */
@@ -469,93 +1297,118 @@ string filename_from_mdata (const PackageMetaData& mdata)
 }
 
 
+/* Parse all complete file records in buf and return the number of bytes
+ * consumed. */
+static size_t parse_file_records (const char *buf, size_t size, FileList& fl)
+{
+	size_t pos = 0;
+
+	while (size - pos >= 0x24)
+	{
+		size_t crec_size = strnlen (buf + pos + 0x23, size - pos - 0x23) + 0x24;
+		if (crec_size > size - pos)
+			break;
+
+		fl.add_file_from_binary ((const uint8_t*) buf + pos, crec_size);
+		pos += crec_size;
+	}
+
+	return pos;
+}
+
 shared_ptr<FileList> read_file_list (ReadStream& rs, size_t size)
 {
 	auto fl = make_shared<FileList>();
-	DynamicBuffer<char> buf;
-	size_t buf_fill = 0;
 
-	size_t crec_size = 0;
+	/* Parse directly from the stream's memory if possible */
+	auto view = size > 0 ? rs.read_view (size) : nullptr;
+	if (view)
+	{
+		parse_file_records (view, size, *fl);
+		fl->sort();
+		return fl;
+	}
+
+	/* Otherwise read chunks and only move the incomplete record at the end of
+	 * each chunk to the beginning of the buffer. */
+	DynamicBuffer<char> buf(65536);
+	size_t buf_fill = 0;
 
-	/* File records are delimited by null characters in their paths. So we
-	 * have to read until you encounter such a null character. */
-	for (;;)
+	while (size > 0)
 	{
-		if (size > 0)
-		{
-			auto to_read = MIN(size, 4096);
+		/* A single record may be larger than the buffer */
+		if (buf_fill == buf.size)
+			buf.ensure_size (buf.size * 2);
 
-			buf.ensure_size (buf_fill + to_read);
-			rs.read (buf.buf + buf_fill, to_read);
+		auto to_read = MIN(size, buf.size - buf_fill);
+		rs.read (buf.buf + buf_fill, to_read);
 
-			buf_fill += to_read;
-			size -= to_read;
+		buf_fill += to_read;
+		size -= to_read;
+
+		auto consumed = parse_file_records (buf.buf, buf_fill, *fl);
+		if (consumed > 0)
+		{
+			memmove (buf.buf, buf.buf + consumed, buf_fill - consumed);
+			buf_fill -= consumed;
 		}
+	}
 
-		if (buf_fill < 0x24)
-			return fl;
+	fl->sort();
+	return fl;
+}
 
-		for (;;)
-		{
-			crec_size = strnlen (buf.buf + 0x23, buf_fill - 0x23) + 0x24;
 
-			if (crec_size <= buf_fill)
-			{
-				FileRecord r;
-				FileRecord::from_binary ((uint8_t*) buf.buf, crec_size, r);
-				fl->add_file (move(r));
+/* Parse all complete entries in buf and return the number of bytes consumed. */
+static size_t parse_config_files (const char *buf, size_t size, vector<string>& l)
+{
+	size_t pos = 0;
 
-				memmove (buf.buf, buf.buf + crec_size, buf_fill - crec_size);
-				buf_fill -= crec_size;
-			}
-			else
-			{
-				break;
-			}
-		}
+	while (pos < size)
+	{
+		/* Entries are delimited by null characters. */
+		size_t entry_size = strnlen (buf + pos, size - pos);
+		if (entry_size == size - pos)
+			break;
+
+		l.emplace_back (buf + pos, entry_size);
+		pos += entry_size + 1;
 	}
 
+	return pos;
 }
 
-
 shared_ptr<vector<string>> read_config_files (ReadStream& rs, size_t size)
 {
 	auto l = make_shared<vector<string>>();
-	DynamicBuffer<char> buf;
-	size_t buf_fill = 0;
-	size_t entry_size = 0;
 
-	/* List entries are delimited by null characters. */
-	for (;;)
+	/* Parse directly from the stream's memory if possible */
+	auto view = size > 0 ? rs.read_view (size) : nullptr;
+	if (view)
+	{
+		parse_config_files (view, size, *l);
+	}
+	else
 	{
-		if (size > 0)
+		DynamicBuffer<char> buf(4096);
+		size_t buf_fill = 0;
+
+		while (size > 0)
 		{
-			auto to_read = MIN(size, 4096);
+			if (buf_fill == buf.size)
+				buf.ensure_size (buf.size * 2);
 
-			buf.ensure_size (buf_fill + to_read);
+			auto to_read = MIN(size, buf.size - buf_fill);
 			rs.read (buf.buf + buf_fill, to_read);
 
 			buf_fill += to_read;
 			size -= to_read;
-		}
 
-		if (buf_fill < 1)
-			break;
-
-		for (;;)
-		{
-			entry_size = strnlen (buf.buf, buf_fill) + 1;
-
-			if (entry_size <= buf_fill)
+			auto consumed = parse_config_files (buf.buf, buf_fill, *l);
+			if (consumed > 0)
 			{
-				/* entry_size is always >= 1 */
-				l->emplace_back(buf.buf, entry_size - 1);
-				memmove (buf.buf, buf.buf + entry_size, buf_fill - entry_size);
-				buf_fill -= entry_size;
-			}
-			else
-			{
-				break;
+				memmove (buf.buf, buf.buf + consumed, buf_fill - consumed);
+				buf_fill -= consumed;
 			}
 		}
 	}
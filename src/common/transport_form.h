@@ -6,11 +6,14 @@
 #define __TRANSPORT_FORM_H
 
 #include <exception>
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
 #include <vector>
 #include "package_meta_data.h"
 #include "file_list.h"
+#include "section_codecs.h"
 
 extern "C" {
 #include <zlib.h>
@@ -19,11 +22,41 @@ extern "C" {
 
 namespace TransportForm
 {
+	/* Prototypes */
+	struct TOCSection;
+	struct TableOfContents;
+
+	/* A source of data of unknown size. It fills up to size bytes of buf and
+	 * returns the number of bytes read, 0 at the end of the data or a -errno
+	 * value in case of error. */
+	typedef std::function<ssize_t(char *buf, size_t size)> DataSource;
+
+	/* Writes transport forms of version 2 or 3, in which each section is compressed
+	 * independently (and the TOC is not compressed at all) such that readers can
+	 * seek to each section without decompressing the data before it. The
+	 * compression algorithm can be chosen per section. */
 	class Writer
 	{
 	private:
-		gzFile f;
+		int fd;
+		uint64_t pos = 0;
+
+		/* Compressor of the current stream in the section (nullptr if the
+		 * section is stored or no stream is open) */
+		std::unique_ptr<Compressor> compressor;
+		bool compressor_used = false;
+
+		bool in_section = false;
+		uint8_t section_encoding = 0;
+		int section_level = -1;
+		uint64_t section_offset = 0;
 
+		unsigned threads = 1;
+
+		int write_out (const char *buf, size_t size);
+
+		int ensure_compressor ();
+		int finish_stream ();
 
 	public:
 		/* @raises std::system_error if it cannot open the file. */
@@ -32,8 +65,44 @@ namespace TransportForm
 
 		~Writer ();
 
+		/* Compress large writes on @param threads threads. The data is split
+		 * into blocks which are compressed into separate streams, see
+		 * compress_parallel. The default is 1, which produces a single stream
+		 * per section. */
+		void set_threads (unsigned threads);
+
+		/* Write the TOC to the beginning of the file. It must be called before
+		 * the first section is written to reserve space, and again after the
+		 * last section has been written to fill in the sections' offsets. The
+		 * TOC's binary size must not change in between.
+		 *
+		 * @returns 0 on success or -errno value in case of error */
+		int write_toc (const TableOfContents& toc);
+
+		/* Start a new section at the current position of the file. All data
+		 * written until end_section is called is encoded with @param encoding
+		 * (one of the SEC_ENCODING_* constants) at compression level @param
+		 * level (-1 is the codec's default).
+		 *
+		 * @returns 0 on success or -errno value in case of error; -ENOTSUP if
+		 * the encoding is not supported. */
+		int begin_section (uint8_t encoding, int level = -1);
+
 		/* @returns 0 on success or -errno value in case of error */
-		int write (const char *buf, int size);
+		int write (const char *buf, size_t size);
+
+		/* Write all data from @param src to the current section and store its
+		 * amount in @param size. Only a bounded amount of data is buffered, but
+		 * enough to keep all compression threads busy.
+		 *
+		 * @returns 0 on success or -errno value in case of error */
+		int write_from (const DataSource& src, uint64_t& size);
+
+		/* Finish the current section and store its position and encoded size in
+		 * @param offset and @param encoded_size.
+		 *
+		 * @returns 0 on success or -errno value in case of error */
+		int end_section (uint64_t& offset, uint64_t& encoded_size);
 	};
 
 
@@ -47,9 +116,20 @@ namespace TransportForm
 
 		virtual std::string get_filename() const;
 
+		/* Positions are 64 bit wide on all platforms such that transport forms
+		 * of more than 4GiB can be read. */
 		virtual void read (char *buf, size_t cnt) = 0;
-		virtual size_t tell () = 0;
-		virtual void seek (size_t pos) = 0;
+		virtual uint64_t tell () = 0;
+		virtual void seek (uint64_t pos) = 0;
+
+		/* If the next cnt bytes are available in memory, return a pointer to
+		 * them and advance the position like read would do. Otherwise return
+		 * nullptr and do not change the position. The memory stays valid as
+		 * long as the stream exists. The default implementation always returns
+		 * nullptr.
+		 *
+		 * @raises std::system_error */
+		virtual const char *read_view (size_t cnt);
 	};
 
 	class GZReadStream : public ReadStream
@@ -72,11 +152,11 @@ namespace TransportForm
 		void read (char *buf, size_t cnt) override;
 
 		/* @raises std::system_error */
-		size_t tell () override;
+		uint64_t tell () override;
 
 		/* Absolute seek. "[C]an be extremely slow" (zlib manual) ...
 		 * @raises std::system_error */
-		void seek (size_t pos) override;
+		void seek (uint64_t pos) override;
 	};
 
 	class FDReadStream : public ReadStream
@@ -92,11 +172,130 @@ namespace TransportForm
 		virtual ~FDReadStream();
 
 		void read (char *buf, size_t cnt) override;
-		size_t tell () override;
-		void seek (size_t pos) override;
+		uint64_t tell () override;
+		void seek (uint64_t pos) override;
+	};
+
+	/* Maps an entire file into memory and hands out views into it. */
+	class MmapReadStream : public ReadStream
+	{
+	protected:
+		const std::string filename;
+
+		const char *data = nullptr;
+		size_t size = 0;
+		uint64_t pos = 0;
+
+		void map (int fd);
+
+	public:
+		/* @raises std::system_error if the file cannot be opened or mapped. */
+		MmapReadStream (const std::string& filename);
+
+		/* Map the file referred to by fd; fd is not closed and may be closed
+		 * once the object has been constructed.
+		 * @raises std::system_error if the file cannot be mapped. */
+		MmapReadStream (int fd, const std::string& filename);
+		MmapReadStream (const MmapReadStream& o) = delete;
+
+		virtual ~MmapReadStream();
+
+		std::string get_filename() const override;
+
+		/* @raises std::system_error */
+		void read (char *buf, size_t cnt) override;
+		uint64_t tell () override;
+		void seek (uint64_t pos) override;
+
+		/* @raises std::system_error if less than cnt bytes are left */
+		const char *read_view (size_t cnt) override;
+	};
+
+	/* Reads transport forms of version 2 and 3. Positions refer to the uncompressed
+	 * representation of the transport form (like with version 1), hence the
+	 * starts in the TOC can be used for seeking. But in contrast to
+	 * GZReadStream, seeking to the start of a section is cheap because each
+	 * section is decoded independently. */
+	class SectionedReadStream : public ReadStream
+	{
+	public:
+		/* Receives the raw data that the stream reads from its file, e.g. to
+		 * compute a digest of the file while it is decoded. Data is reported
+		 * again if the stream seeks backwards, and parts of the file that are
+		 * skipped are not reported. */
+		class RawDataObserver
+		{
+		public:
+			virtual ~RawDataObserver () = default;
+
+			/* @param offset is the position of data in the file. */
+			virtual void observe (uint64_t offset, const char *data, size_t size) = 0;
+		};
+
+	protected:
+		int fd;
+		const std::string filename;
+
+		/* The file is mapped into memory if possible, such that stored sections
+		 * can be accessed without copying and compressed sections can be
+		 * decoded without intermediate buffers. Otherwise pread is used. */
+		const char *map = nullptr;
+		size_t map_size = 0;
+
+		/* Sections in the order of their start positions; the TOC itself is
+		 * represented by a stored pseudo-section at position 0. */
+		std::vector<TOCSection> sections;
+
+		uint64_t pos = 0;
+
+		/* Decoder state: the section that is currently decoded and the
+		 * position up to which it has been decoded. */
+		ssize_t dec_section = -1;
+		uint64_t dec_pos = 0;
+		uint64_t dec_in_consumed = 0;
+
+		std::unique_ptr<Decompressor> decoder;
+		uint8_t decoder_encoding = SEC_ENCODING_STORED;
+
+		const char *in_ptr = nullptr;
+		size_t in_avail = 0;
+		char in_buf[16384];
+
+		RawDataObserver *raw_observer = nullptr;
+
+		void open_section (size_t i);
+		size_t decode (char *buf, size_t cnt);
+
+	public:
+		/* Takes ownership of fd.
+		 * @raises std::system_error and InvalidToc. */
+		SectionedReadStream (int fd, const std::string& filename);
+		SectionedReadStream (const SectionedReadStream& o) = delete;
+
+		virtual ~SectionedReadStream();
+
+		std::string get_filename() const override;
+
+		/* @raises std::system_error, InvalidToc */
+		void read (char *buf, size_t cnt) override;
+		uint64_t tell () override;
+		void seek (uint64_t pos) override;
+
+		/* Only succeeds for data within a single stored section */
+		const char *read_view (size_t cnt) override;
+
+		/* The observer is not owned by the stream; nullptr removes it. */
+		void set_raw_observer (RawDataObserver *observer);
 	};
 
 
+	/* Open a transport form (or a file of similar format) with the right
+	 * ReadStream for its version.
+	 *
+	 * @raises std::system_error if it cannot open the file, and InvalidToc. */
+	std::unique_ptr<ReadStream> open_read_stream (const std::string& filename);
+
+
 	const uint8_t SEC_TYPE_DESC = 0x00;
 	const uint8_t SEC_TYPE_FILE_INDEX = 0x01;
 	const uint8_t SEC_TYPE_CONFIG_FILES = 0x02;
@@ -110,16 +309,21 @@ namespace TransportForm
 	struct TOCSection
 	{
 		uint8_t type;
-		uint32_t start;
-		uint32_t size;
+		uint64_t start;
+		uint64_t size;
 
-		TOCSection (uint8_t type, uint32_t start, uint32_t size);
+		/* Only used by version 2 and later */
+		uint8_t encoding = SEC_ENCODING_STORED;
+		uint64_t offset = 0;
+		uint64_t encoded_size = 0;
 
-		static const unsigned binary_size = 9;
-		void to_binary(char *buf) const;
+		TOCSection (uint8_t type, uint64_t start, uint64_t size);
+
+		static unsigned binary_size (uint8_t version);
+		void to_binary(char *buf, uint8_t version) const;
 
 		/* @raises InvalidToc and what rs raises */
-		static TOCSection read_from_binary (ReadStream& rs);
+		static TOCSection read_from_binary (ReadStream& rs, uint8_t version);
 	};
 
 	struct TableOfContents
@@ -131,11 +335,26 @@ namespace TransportForm
 		unsigned binary_size() const;
 		void to_binary(char *buf) const;
 
+		/* Set the sections' starts such that they follow the TOC in the order
+		 * in which they are stored. */
+		void update_starts();
+
 		/* @raises InvalidToc and what rs raises. */
 		static TableOfContents read_from_binary (ReadStream& rs);
 	};
 
 
+	/* Write a TOC followed by sections to @param w. @param data must hold the
+	 * content of each section in toc (which must have the section's sizes set
+	 * already). The encodings of the sections are taken from toc, their
+	 * offsets and encoded sizes are updated. @param level is the compression
+	 * level used for all sections.
+	 *
+	 * @returns 0 on success or -errno value in case of error */
+	int write_sections (Writer& w, TableOfContents& toc,
+			const std::vector<const char*>& data, int level = -1);
+
+
 	class TransportForm
 	{
 	private:
@@ -168,6 +387,11 @@ namespace TransportForm
 		const uint8_t *archive = nullptr;
 		size_t archive_size = 0;
 
+		DataSource archive_src;
+
+		uint8_t encoding = SEC_ENCODING_GZIP;
+		int level = -1;
+
 
 	public:
 		void set_desc (const char *desc, size_t size);
@@ -181,6 +405,15 @@ namespace TransportForm
 
 		void set_archive (const uint8_t *archive, size_t size);
 
+		/* Stream the archive from @param src during write instead of taking it
+		 * from memory. Its size is filled into the TOC after it has been
+		 * written, which is possible because it is the last section. */
+		void set_archive (DataSource src);
+
+		/* Encoding of all sections (SEC_ENCODING_*) and compression level (-1
+		 * is the codec's default); defaults to gzip. */
+		void set_encoding (uint8_t encoding, int level = -1);
+
 		TableOfContents get_toc() const;
 
 
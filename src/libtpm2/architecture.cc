@@ -4,6 +4,13 @@
 using namespace std;
 
 
+/* Out-of-line definitions s.t. the constants may be bound to references (e.g.
+ * by std::make_shared) */
+const int Architecture::invalid;
+const int Architecture::amd64;
+const int Architecture::i386;
+
+
 const string Architecture::to_string(int a)
 {
 	switch (a)
@@ -1,3 +1,4 @@
+#include <cstring>
 #include <exception>
 #include "crypto_tools.h"
 #include "common_utilities.h"
@@ -12,7 +13,7 @@ extern "C" {
 
 using namespace std;
 
-bool verify_sha256_fd (int fd, std::string digest)
+void sha256_digest_from_hex (const std::string& digest, unsigned char* bytes)
 {
 	if (digest.size() != 64)
 		throw invalid_argument("digest must have 64 charecters in [0-9a-fA-F]");
@@ -30,10 +31,14 @@ bool verify_sha256_fd (int fd, std::string digest)
 		}
 	}
 
-	unsigned char bytes[32];
-
 	for (int i = 0; i < 32; i++)
 		bytes[i] = ascii_to_byte(cstr + i*2);
+}
+
+bool verify_sha256_fd (int fd, std::string digest)
+{
+	unsigned char bytes[32];
+	sha256_digest_from_hex (digest, bytes);
 
 	return verify_sha256_fd (fd, bytes);
 }
@@ -92,3 +97,50 @@ bool verify_sha256_fd (int fd, const unsigned char* digest)
 
 	return ret_val;
 }
+
+
+SHA256Context::SHA256Context ()
+{
+	md_ctx = EVP_MD_CTX_new();
+	if (!md_ctx)
+		throw bad_alloc();
+
+	if (EVP_DigestInit_ex(md_ctx, EVP_sha256(), nullptr) <= 0)
+	{
+		EVP_MD_CTX_free (md_ctx);
+		throw gp_exception ("EVP_DigestInit(SHA256) failed");
+	}
+}
+
+SHA256Context::~SHA256Context ()
+{
+	EVP_MD_CTX_free (md_ctx);
+}
+
+void SHA256Context::update (const char* data, size_t size)
+{
+	if (EVP_DigestUpdate(md_ctx, (const unsigned char*) data, size) <= 0)
+		throw gp_exception ("EVP_DigestUpdate failed");
+}
+
+void SHA256Context::finish (unsigned char* digest)
+{
+	unsigned char buf[EVP_MAX_MD_SIZE];
+	unsigned size;
+
+	if (EVP_DigestFinal_ex(md_ctx, buf, &size) <= 0)
+		throw gp_exception ("EVP_DigestFinal failed");
+
+	if (size != 32)
+		throw gp_exception ("EVP_DigestFinal_ex returned wrong SHA256 digest size");
+
+	memcpy (digest, buf, size);
+}
+
+bool SHA256Context::verify (const unsigned char* digest)
+{
+	unsigned char buf[32];
+	finish (buf);
+
+	return CRYPTO_memcmp(buf, digest, sizeof(buf)) == 0;
+}
@@ -2,12 +2,40 @@
 #ifndef __CRYPTO_TOOLS_H
 #define __CRYPTO_TOOLS_H
 
+#include <cstddef>
 #include <string>
 
+struct evp_md_ctx_st;
+
 /* Warning: Both functions modifiy the position within fd */
 bool verify_sha256_fd (int fd, std::string digest);
 
 /* digest is of size 32 bytes */
 bool verify_sha256_fd (int fd, const unsigned char* digest);
 
+/* Convert a digest in hex notation to its 32 bytes.
+ * @raises std::invalid_argument if it is not a valid SHA256 digest. */
+void sha256_digest_from_hex (const std::string& digest, unsigned char* bytes);
+
+/* Computes a SHA256 digest of data that arrives in pieces */
+class SHA256Context
+{
+private:
+	struct evp_md_ctx_st* md_ctx;
+
+public:
+	SHA256Context ();
+	SHA256Context (const SHA256Context&) = delete;
+	~SHA256Context ();
+
+	void update (const char* data, size_t size);
+
+	/* Finishes the computation and stores the digest (32 bytes) in digest. */
+	void finish (unsigned char* digest);
+
+	/* digest is of size 32 bytes. Finishes the computation.
+	 * @returns true if the digest of all data matches */
+	bool verify (const unsigned char* digest);
+};
+
 #endif /* __CRYPTO_TOOLS_H */
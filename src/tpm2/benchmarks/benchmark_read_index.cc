@@ -0,0 +1,173 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * A micro-benchmark for opening repository indexes. It creates a synthetic
+ * index of version 1 with many package versions and reads it repeatedly. */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "standard_repo_index.h"
+#include "crypto_tools.h"
+#include "common_utilities.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+static void write_file (const fs::path& p, const string& content)
+{
+	FILE* f = fopen (p.c_str(), "wb");
+	if (!f || fwrite (content.data(), 1, content.size(), f) != content.size())
+		throw gp_exception ("Cannot write '" + p.string() + "'");
+
+	fclose (f);
+}
+
+
+/* Each package has a few versions and dependencies */
+void create_index (const fs::path& dir, unsigned cnt_packages, unsigned cnt_versions)
+{
+	string plist;
+	vector<string> specs;
+	char buf[512];
+
+	for (unsigned i = 0; i < cnt_packages; i++)
+	{
+		for (unsigned j = 0; j < cnt_versions; j++)
+		{
+			snprintf (buf, sizeof(buf),
+					"<pkg file_version=\"2.0\">\n"
+					"<name>package-%06u</name>\n"
+					"<arch>amd64</arch>\n"
+					"<version>1.%u.0</version>\n"
+					"<source_version>1.%u.0</source_version>\n"
+					"<pre-dependencies/>\n"
+					"<dependencies>\n"
+					"<dep><name>package-%06u</name><arch>amd64</arch>"
+					"<constr type=\"geq\">1.0</constr></dep>\n"
+					"</dependencies>\n"
+					"<triggers/>\n"
+					"</pkg>\n",
+					i, j, j, (i + 1) % cnt_packages);
+
+			plist += buf;
+			plist += string (64, '0') + "\n";
+
+			snprintf (buf, sizeof(buf), "package-%06u@amd64:1.%u.0", i, j);
+			specs.push_back (buf);
+		}
+	}
+
+	/* The file index's directory; all file lists are empty and start at its
+	 * end */
+	size_t directory_size = 9;
+	for (auto& spec : specs)
+		directory_size += spec.size() + 9;
+
+	string directory;
+	uint64_t end = htole64 (directory_size);
+
+	for (auto& spec : specs)
+	{
+		directory += spec;
+		directory += '\0';
+		directory.append ((const char*) &end, 8);
+	}
+
+	directory += '\0';
+	directory.append ((const char*) &end, 8);
+
+	SHA256Context ctx;
+	ctx.update (directory.data(), directory.size());
+
+	unsigned char digest[32];
+	ctx.finish (digest);
+
+	string hex;
+	for (auto c : digest)
+	{
+		snprintf (buf, sizeof(buf), "%02x", (unsigned) c);
+		hex += buf;
+	}
+
+	write_file (dir / "bench.files", directory);
+	write_file (dir / "index.index",
+			"tpm_repo_index 1.0\nbench.files " + hex + "\n" + plist);
+}
+
+
+template<typename F>
+double measure (F f, unsigned repetitions)
+{
+	auto t1 = chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < repetitions; i++)
+		f();
+
+	auto t2 = chrono::steady_clock::now();
+	return chrono::duration<double, milli>(t2 - t1).count() / repetitions;
+}
+
+
+int main (int argc, char** argv)
+{
+	unsigned cnt_packages = 10000;
+	unsigned cnt_versions = 3;
+	unsigned repetitions = 5;
+
+	if (argc > 4)
+	{
+		fprintf (stderr, "Usage: %s [<count of packages> [<versions per package> [<repetitions>]]]\n",
+				argv[0]);
+		return 1;
+	}
+
+	if (argc > 1)
+		cnt_packages = atoi (argv[1]);
+
+	if (argc > 2)
+		cnt_versions = atoi (argv[2]);
+
+	if (argc > 3)
+		repetitions = atoi (argv[3]);
+
+	char tmpl[] = "/tmp/tpm2-bench-XXXXXX";
+	if (!mkdtemp (tmpl))
+	{
+		perror ("mkdtemp");
+		return 1;
+	}
+
+	fs::path dir(tmpl);
+
+	try
+	{
+		create_index (dir, cnt_packages, cnt_versions);
+
+		printf ("Index with %u packages of %u versions each, %u repetitions\n",
+				cnt_packages, cnt_versions, repetitions);
+
+		auto params = make_shared<Parameters>();
+
+		auto t_read = measure ([&]() {
+			StandardRepoIndex index(params, dir / "index.index");
+			index.read (false);
+
+			if (!index.get_digest ("package-000000", Architecture::amd64, VersionNumber("1.0.0")))
+				abort();
+		}, repetitions);
+
+		printf ("  read: %8.2f ms\n", t_read);
+	}
+	catch (exception& e)
+	{
+		fprintf (stderr, "%s\n", e.what());
+		fs::remove_all (dir);
+		return 1;
+	}
+
+	fs::remove_all (dir);
+	return 0;
+}
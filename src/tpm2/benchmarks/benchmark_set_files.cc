@@ -0,0 +1,149 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * A micro-benchmark for registering the files of a package in the package
+ * database. It creates a database in a temporary directory and stores the
+ * file list of a large synthetic package repeatedly, optionally next to the
+ * files of other packages. */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include "package_db.h"
+#include "architecture.h"
+#include "common_utilities.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+shared_ptr<FileList> create_file_list (const char* name, unsigned cnt_files)
+{
+	auto files = make_shared<FileList>();
+	uint8_t sha1_sum[20] = { 0 };
+	char buf[128];
+
+	for (unsigned i = 0; i < cnt_files; i++)
+	{
+		snprintf (buf, sizeof(buf), "/usr/share/%s/%03u/file-%07u", name, i / 1000, i);
+		sha1_sum[0] = i;
+
+		files->add_file (FileRecord (FILE_TYPE_REGULAR, 0, 0, 0644, 1024, sha1_sum, buf));
+	}
+
+	return files;
+}
+
+
+template<typename F>
+double measure (F f, unsigned repetitions)
+{
+	auto t1 = chrono::steady_clock::now();
+
+	for (unsigned i = 0; i < repetitions; i++)
+		f();
+
+	auto t2 = chrono::steady_clock::now();
+	return chrono::duration<double, milli>(t2 - t1).count() / repetitions;
+}
+
+
+shared_ptr<PackageMetaData> create_package (const string& name)
+{
+	auto mdata = make_shared<PackageMetaData> (name, Architecture::amd64,
+			VersionNumber("1.0"), VersionNumber("1.0"),
+			INSTALLATION_REASON_MANUAL, PKG_STATE_PREINST_BEGIN);
+
+	mdata->interested_triggers.emplace();
+	mdata->activated_triggers.emplace();
+
+	return mdata;
+}
+
+
+int main (int argc, char** argv)
+{
+	unsigned cnt_files = 100000;
+	unsigned repetitions = 5;
+	unsigned cnt_other_files = 0;
+
+	if (argc > 4)
+	{
+		fprintf (stderr, "Usage: %s [<count of files> [<repetitions> "
+				"[<count of other packages' files>]]]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 1)
+		cnt_files = atoi (argv[1]);
+
+	if (argc > 2)
+		repetitions = atoi (argv[2]);
+
+	if (argc > 3)
+		cnt_other_files = atoi (argv[3]);
+
+	char tmpl[] = "/tmp/tpm2-bench-XXXXXX";
+	if (!mkdtemp (tmpl))
+	{
+		perror ("mkdtemp");
+		return 1;
+	}
+
+	fs::path dir(tmpl);
+
+	try
+	{
+		auto files = create_file_list ("bench", cnt_files);
+
+		printf ("Package with %u files next to %u files of other packages, %u repetitions\n",
+				cnt_files, cnt_other_files, repetitions);
+
+		auto params = make_shared<Parameters>();
+		params->target = dir;
+
+		PackageDB pkgdb(params);
+
+		/* Other packages with 1000 files each */
+		pkgdb.begin();
+
+		for (unsigned i = 0; i < cnt_other_files; i += 1000)
+		{
+			auto name = "other-" + to_string (i / 1000);
+			auto other = create_package (name);
+
+			pkgdb.update_or_create_package (other);
+			pkgdb.set_files (other, create_file_list (name.c_str(), MIN(1000U, cnt_other_files - i)));
+		}
+
+		pkgdb.commit();
+
+		auto mdata = create_package ("bench");
+		pkgdb.update_or_create_package (mdata);
+
+		/* The first repetition creates the tuples, the others replace them */
+		auto t_set = measure ([&]() {
+			pkgdb.begin();
+			pkgdb.set_files (mdata, files);
+			pkgdb.commit();
+		}, repetitions);
+
+		printf ("  set_files: %8.2f ms\n", t_set);
+
+		auto t_get = measure ([&]() {
+			if (pkgdb.get_files (mdata).size() != cnt_files)
+				abort();
+		}, repetitions);
+
+		printf ("  get_files: %8.2f ms\n", t_get);
+	}
+	catch (exception& e)
+	{
+		fprintf (stderr, "%s\n", e.what());
+		fs::remove_all (dir);
+		return 1;
+	}
+
+	fs::remove_all (dir);
+	return 0;
+}
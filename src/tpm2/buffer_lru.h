@@ -0,0 +1,119 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * This module contains the accounting of buffers that cached packages hold
+ * against a budget. */
+
+#ifndef __BUFFER_LRU_H
+#define __BUFFER_LRU_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+
+
+/* Tracks the buffers of cached objects of type P, which must provide
+ * size_t get_buffer_size() and void clear_buffers(). If the buffers of all
+ * objects exceed the budget, those of the least recently used objects are
+ * cleared.
+ *
+ * The entries are owned by the user and must not move while they are tracked.
+ * Buffers may be charged from any thread, but objects are only evicted when
+ * one is touched or the budget is changed, because clearing the buffers of an
+ * object that another thread uses would not be safe. */
+template<typename P>
+class BufferLRU
+{
+public:
+	struct Entry
+	{
+		std::shared_ptr<P> pkg;
+		size_t buffer_size = 0;
+		bool in_lru = false;
+		typename std::list<Entry*>::iterator lru_pos;
+	};
+
+private:
+	std::mutex m;
+
+	/* Entries that hold buffers, most recently used first */
+	std::list<Entry*> lru;
+	size_t buffer_size = 0;
+	size_t budget;
+
+	void update (Entry& e)
+	{
+		buffer_size -= e.buffer_size;
+		e.buffer_size = e.pkg->get_buffer_size();
+		buffer_size += e.buffer_size;
+	}
+
+	void make_most_recent (Entry& e)
+	{
+		if (e.in_lru)
+			lru.erase (e.lru_pos);
+
+		lru.push_front (&e);
+		e.lru_pos = lru.begin();
+		e.in_lru = true;
+	}
+
+	/* Clear the buffers of the least recently used entries until they fit
+	 * into the budget, except for the @param keep most recent ones. */
+	void evict (size_t keep)
+	{
+		while (buffer_size > budget && lru.size() > keep)
+		{
+			auto victim = lru.back();
+			lru.pop_back();
+
+			victim->pkg->clear_buffers();
+			victim->in_lru = false;
+
+			buffer_size -= victim->buffer_size;
+			victim->buffer_size = 0;
+		}
+	}
+
+public:
+	BufferLRU (size_t budget)
+		: budget(budget)
+	{
+	}
+
+	/* Account the buffers of @param e, which is handed out, and make it the
+	 * most recently used entry. Then evict others to meet the budget. */
+	void touch (Entry& e)
+	{
+		std::unique_lock<std::mutex> lk(m);
+
+		update (e);
+		make_most_recent (e);
+		evict (1);
+	}
+
+	/* Account the buffers of @param e after they have been loaded. */
+	void charge (Entry& e)
+	{
+		std::unique_lock<std::mutex> lk(m);
+
+		update (e);
+		make_most_recent (e);
+	}
+
+	/* In bytes; clears buffers immediately if they exceed the new budget. */
+	void set_budget (size_t new_budget)
+	{
+		std::unique_lock<std::mutex> lk(m);
+
+		budget = new_budget;
+		evict (0);
+	}
+
+	size_t get_buffer_size ()
+	{
+		std::unique_lock<std::mutex> lk(m);
+		return buffer_size;
+	}
+};
+
+#endif /* __BUFFER_LRU_H */
@@ -76,6 +76,63 @@ bool InstalledPackageVersion::installed_automatically() const
 }
 
 
+/* Resolve the versions of all packages that the solver may consider up front,
+ * in batches. Starting with the selected and installed packages, this follows
+ * the dependencies of the newest version of each package, which the solver
+ * tries first. Descriptions of other versions are only parsed if the solver
+ * asks for them, and packages that only they depend on are resolved on
+ * demand. */
+static void prefetch_dependency_closure (
+		shared_ptr<PackageProvider> pprov,
+		const map<pair<string, int>, shared_ptr<InstalledPackageVersion>>& installed_map,
+		const vector<selected_package_t> &selected_packages)
+{
+	set<pair<string, int>> seen;
+	vector<pair<string, int>> level;
+
+	auto add = [&](const pair<string, int>& id) {
+		if (seen.insert (id).second)
+			level.push_back (id);
+	};
+
+	auto add_dependencies = [&](PackageVersion& pv) {
+		for (auto& [id, formula] : pv.get_dependencies())
+			add (id);
+
+		for (auto& [id, formula] : pv.get_pre_dependencies())
+			add (id);
+	};
+
+	for (auto& [id, formula] : selected_packages)
+		add (id);
+
+	for (auto& [id, ipv] : installed_map)
+	{
+		add (id);
+		add_dependencies (*ipv);
+	}
+
+	while (!level.empty())
+	{
+		auto current = move (level);
+		level.clear();
+
+		pprov->prefetch (current);
+
+		for (auto& [name, arch] : current)
+		{
+			auto& versions = pprov->list_package_versions (name, arch);
+			if (versions.empty())
+				continue;
+
+			auto pp = pprov->get_package (name, arch, versions.back());
+			if (pp)
+				add_dependencies (*pp);
+		}
+	}
+}
+
+
 ComputeInstallationGraphResult compute_installation_graph(
 		shared_ptr<Parameters> params,
 		vector<shared_ptr<PackageMetaData>> installed_packages,
@@ -93,16 +150,25 @@ ComputeInstallationGraphResult compute_installation_graph(
 					make_shared<InstalledPackageVersion>(mdata, pkgdb)));
 	}
 
+	/* Resolve the candidates in batches instead of one query per callback */
+	prefetch_dependency_closure (pprov, installed_map, selected_packages);
+
 	/* Callbacks to interface with the solver */
 	auto list_package_versions = [pprov, &installed_map](const string& name, int arch) {
-		auto s = pprov->list_package_versions(name, arch);
+		auto vs = pprov->list_package_versions(name, arch);
 
 		/* Add installed version number */
 		auto installed = installed_map.find({name, arch});
 		if (installed != installed_map.end())
-			s.insert(installed->second->get_binary_version());
+		{
+			auto v = installed->second->get_binary_version();
+			auto pos = lower_bound(vs.begin(), vs.end(), v);
+
+			if (pos == vs.end() || *pos != v)
+				vs.insert(pos, v);
+		}
 
-		return move(vector<VersionNumber>(move_iterator(s.begin()), move_iterator(s.end())));
+		return vs;
 	};
 
 	auto get_package_version = [pprov, &installed_map]
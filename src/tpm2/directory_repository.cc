@@ -247,6 +247,32 @@ optional<pair<string, shared_ptr<RepoIndex>>> DirectoryRepository::get_package (
 }
 
 
+map<string, vector<RepositoryPackage>> DirectoryRepository::get_packages (
+		const vector<string>& names, const int architecture)
+{
+	map<string, vector<RepositoryPackage>> packages;
+
+	auto index = read_index (architecture);
+	if (!index)
+		return packages;
+
+	auto arch_location = location / Architecture::to_string (architecture);
+
+	for (auto& name : names)
+	{
+		auto i = index->find (name);
+		if (i == index->end())
+			continue;
+
+		auto& versions = packages[name];
+		for (const auto& [v, filename, repo_index] : i->second)
+			versions.push_back ({v, arch_location / filename, repo_index});
+	}
+
+	return packages;
+}
+
+
 bool DirectoryRepository::digest_checking_required()
 {
 	return require_signing;
@@ -47,6 +47,9 @@ public:
 	std::optional<std::pair<std::string, std::shared_ptr<RepoIndex>>> get_package (
 			const std::string& name, const int architecture, const VersionNumber& version) override;
 
+	std::map<std::string, std::vector<RepositoryPackage>> get_packages (
+			const std::vector<std::string>& names, const int architecture) override;
+
 	bool digest_checking_required() override;
 };
 
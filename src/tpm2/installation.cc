@@ -9,13 +9,18 @@
 #include <iostream>
 #include <map>
 #include <optional>
+#include <set>
 #include <sstream>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
 #include "installation.h"
 #include "utility.h"
 #include "depres.h"
 #include "package_db.h"
 #include "safe_console_input.h"
 #include "package_provider.h"
+#include "package_prefetcher.h"
 #include "message_digest.h"
 
 extern "C"
@@ -155,6 +160,112 @@ bool print_installation_graph(shared_ptr<Parameters> params)
 }
 
 
+/* Upcoming packages are prepared by a few threads, but not too far ahead,
+ * because their archives are staged on disk. */
+static const unsigned PREFETCH_THREADS = 4;
+static const unsigned PREFETCH_WINDOW = 8;
+
+
+static shared_ptr<ProvidedPackage> get_provided_package (depres::IGNode* ig_node)
+{
+	auto pp = dynamic_pointer_cast<ProvidedPackage>(ig_node->chosen_version);
+	if (!pp)
+	{
+		/* Must be an InstalledPackageVersion */
+		pp = dynamic_pointer_cast<depres::InstalledPackageVersion>(ig_node->chosen_version)
+			->provided_package;
+	}
+
+	return pp;
+}
+
+
+/* If the package is in a state in which its archive still needs to be unpacked
+ * */
+static bool will_unpack (shared_ptr<PackageMetaData> mdata)
+{
+	return
+		mdata->state == PKG_STATE_WANTED ||
+		mdata->state == PKG_STATE_PREINST_BEGIN ||
+		mdata->state == PKG_STATE_UNPACK_BEGIN ||
+		mdata->state == PKG_STATE_PREINST_CHANGE ||
+		mdata->state == PKG_STATE_UNPACK_CHANGE;
+}
+
+
+/* Next to the package database, on the same filesystem as the target in most
+ * cases. */
+static string get_staging_directory (shared_ptr<Parameters> params,
+		shared_ptr<PackageMetaData> mdata)
+{
+	return simplify_path (params->target + "/var/lib/tpm/staging-" +
+			mdata->name + "_" + Architecture::to_string (mdata->architecture));
+}
+
+
+/* Staged files are renamed into place, which only works within a filesystem.
+ * Hence a package is only staged if the top-level directories that receive its
+ * files are on the staging directory's filesystem; otherwise it would be
+ * extracted a second time when renaming fails. Devices are cached in
+ * @param devices by path. Errors are left to the installer, which reports them
+ * when it reads the package. */
+static bool can_stage (shared_ptr<Parameters> params, shared_ptr<ProvidedPackage> pp,
+		map<string, dev_t>& devices)
+{
+	auto get_device = [&](const string& path, const string& fallback) {
+		auto i = devices.find (path);
+		if (i != devices.end())
+			return i->second;
+
+		/* Missing directories will be created on the parent's filesystem */
+		struct stat st;
+		if (stat (path.c_str(), &st) < 0 && stat (fallback.c_str(), &st) < 0)
+			throw system_error (error_code (errno, generic_category()),
+					"Failed to stat " + fallback);
+
+		devices.emplace (path, st.st_dev);
+		return st.st_dev;
+	};
+
+	try
+	{
+		auto root = simplify_path (params->target + "/");
+		auto staging = get_device (simplify_path (params->target + "/var/lib/tpm"), root);
+
+		for (auto& file : *pp->get_file_list())
+		{
+			if (file.type == FILE_TYPE_DIRECTORY)
+				continue;
+
+			/* Paths are absolute, like "/usr/bin/foo" */
+			auto pos = file.path.find ('/', 1);
+			auto top = pos == string_view::npos ? root :
+				simplify_path (params->target + "/" + string (file.path.substr (0, pos)));
+
+			if (get_device (top, root) != staging)
+				return false;
+		}
+	}
+	catch (exception&)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+
+/* Writing files is mostly waiting for the kernel, hence use a few threads even
+ * on small machines. */
+static unsigned get_unpack_writers (shared_ptr<Parameters> params)
+{
+	if (params->unpack_threads > 0)
+		return params->unpack_threads;
+
+	return MIN(MAX(thread::hardware_concurrency(), 2U), 8U);
+}
+
+
 bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 {
 	print_target(params);
@@ -616,6 +727,48 @@ bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 	/* Low-level unpack the new packages and run their preinst scripts */
 	printf ("Unpacking packages.\n");
 
+	/* Prepare the packages to unpack ahead of the serialized loop below */
+	vector<PackagePrefetcher::Job> prefetch_jobs;
+	map<ProvidedPackage*, size_t> prefetch_indices;
+
+	set<ProvidedPackage*> staged_packages;
+	map<string, dev_t> devices;
+
+	for (auto op : unpack_order)
+	{
+		if (op.operation == depres::pkg_operation::INSTALL_NEW ||
+				op.operation == depres::pkg_operation::CHANGE_INSTALL ||
+				op.operation == depres::pkg_operation::REPLACE_INSTALL)
+		{
+			auto mdata = dynamic_pointer_cast<InstallationPackageVersion>(
+					op.ig_node->chosen_version)->get_mdata();
+
+			auto pp = get_provided_package (op.ig_node);
+
+			if (pp && will_unpack (mdata) &&
+					prefetch_indices.find (pp.get()) == prefetch_indices.end())
+			{
+				/* Packages that are not staged are verified before they are
+				 * read and extracted directly. */
+				string dir;
+
+				if (can_stage (params, pp, devices))
+				{
+					dir = get_staging_directory (params, mdata);
+					fs::remove_all (dir);
+
+					staged_packages.insert (pp.get());
+				}
+
+				prefetch_indices.emplace (pp.get(), prefetch_jobs.size());
+				prefetch_jobs.push_back ({pp, dir});
+			}
+		}
+	}
+
+	PackagePrefetcher prefetcher(move (prefetch_jobs), PREFETCH_THREADS,
+			PREFETCH_WINDOW, get_unpack_writers (params));
+
 	for (auto op : unpack_order)
 	{
 		if (
@@ -631,13 +784,7 @@ bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 				ig_node->chosen_version);
 
 		shared_ptr<PackageMetaData> mdata = installation_package_version->get_mdata();
-		shared_ptr<ProvidedPackage> pp = dynamic_pointer_cast<ProvidedPackage>(ig_node->chosen_version);
-		if (!pp)
-		{
-			/* Must be an InstalledPackageVersion */
-			pp = dynamic_pointer_cast<depres::InstalledPackageVersion>(ig_node->chosen_version)
-				->provided_package;
-		}
+		shared_ptr<ProvidedPackage> pp = get_provided_package (ig_node);
 
 		bool change = op.operation != depres::pkg_operation::INSTALL_NEW;
 
@@ -668,16 +815,15 @@ bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 		}
 
 		/* Perform ll operations of the installation procedure */
-		if (
-				mdata->state == PKG_STATE_WANTED ||
-				mdata->state == PKG_STATE_PREINST_BEGIN ||
-				mdata->state == PKG_STATE_UNPACK_BEGIN ||
-				mdata->state == PKG_STATE_PREINST_CHANGE ||
-				mdata->state == PKG_STATE_UNPACK_CHANGE)
+		if (will_unpack (mdata))
 		{
 			printf ("ll unpacking package %s@%s\n", mdata->name.c_str(),
 					Architecture::to_string (mdata->architecture).c_str());
 
+			auto prefetch_index = prefetch_indices.find (pp.get());
+			if (prefetch_index != prefetch_indices.end())
+				prefetcher.wait (prefetch_index->second);
+
 			/* Set installation reason before storing a package in the db (this
 			 * does not change the reason, only sets it if it has not been set -
 			 * changing would have been performed before. */
@@ -696,6 +842,14 @@ bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 				return false;
 			}
 
+			/* Extract and verify the archive before anything of the package
+			 * is used. */
+			if (staged_packages.find (pp.get()) != staged_packages.end() &&
+					!ll_stage_archive (params, mdata, pp))
+			{
+				return false;
+			}
+
 			/* ll preinst */
 			if ((change && mdata->state == PKG_STATE_WANTED) ||
 					(mdata->state == PKG_STATE_PREINST_CHANGE))
@@ -912,6 +1066,39 @@ bool install_packages(shared_ptr<Parameters> params, bool upgrade)
 }
 
 
+bool ll_stage_archive (
+		shared_ptr<Parameters> params,
+		shared_ptr<PackageMetaData> mdata,
+		shared_ptr<ProvidedPackage> pp)
+{
+	/* The archive may have been staged by the prefetcher already */
+	if (pp->is_staged())
+		return true;
+
+	try
+	{
+		printf_verbose_flush (params, "  Extracting the package's archive ...");
+
+		auto dir = get_staging_directory (params, mdata);
+
+		/* Left over from an interrupted installation */
+		fs::remove_all (dir);
+
+		pp->stage_archive (dir, get_unpack_writers (params));
+
+		printf_verbose (params, COLOR_GREEN " OK" COLOR_NORMAL "\n");
+	}
+	catch (exception& e)
+	{
+		printf (COLOR_RED " failed" COLOR_NORMAL "\n");
+		printf ("%s\n", e.what());
+		return false;
+	}
+
+	return true;
+}
+
+
 bool ll_run_preinst (
 		shared_ptr<Parameters> params,
 		PackageDB& pkgdb,
@@ -940,18 +1127,19 @@ bool ll_run_preinst (
 
 			for (const auto& file : *files)
 			{
+				const string path(file.path);
 				stringstream ss;
 
 				/* Augment file trie if one is specified and skip the files from old
 				 * packages if change semantics are requested. */
 				if (current_trie)
 				{
-					auto h = current_trie->find_directory (file.path);
+					auto h = current_trie->find_directory (path);
 
 					if (!h)
 					{
-						current_trie->insert_directory (file.path);
-						h = current_trie->find_directory (file.path);
+						current_trie->insert_directory (path);
+						h = current_trie->find_directory (path);
 					}
 
 					if (find (h->data.begin(), h->data.end(), mdata.get()) == h->data.end())
@@ -969,7 +1157,7 @@ bool ll_run_preinst (
 				{
 					/* Skip config files , since the config file logic will handle
 					 * them later. */
-					if (binary_search(config_files->begin(), config_files->end(), file.path))
+					if (binary_search(config_files->begin(), config_files->end(), path))
 						continue;
 
 					if (first)
@@ -979,7 +1167,7 @@ bool ll_run_preinst (
 					}
 
 					printf ("File \"%s\" differs from the one in the package: %s",
-							file.path.c_str(), ss.str().c_str());
+							path.c_str(), ss.str().c_str());
 
 					if (!params->adopt_all)
 					{
@@ -990,7 +1178,7 @@ bool ll_run_preinst (
 							throw gp_exception ("User aborted.");
 					}
 
-					printf ("Adopting \"%s\", which differs.\n", file.path.c_str());
+					printf ("Adopting \"%s\", which differs.\n", path.c_str());
 				}
 			}
 
@@ -1097,7 +1285,7 @@ bool ll_unpack (
 
 		if (pp->has_archive())
 		{
-			vector<string> excluded_paths;
+			unordered_set<string> excluded_paths;
 
 			/* Check if config files have to be excluded. Skip the check if the
 			 * package has no config files, because most packages probably don't
@@ -1154,7 +1342,7 @@ bool ll_unpack (
 										printf ("    Has not changed in the package(s), "
 												"keeping installed version.\n");
 
-										excluded_paths.push_back(cfile);
+										excluded_paths.insert(cfile);
 									}
 									else
 									{
@@ -1162,7 +1350,7 @@ bool ll_unpack (
 										{
 											printf ("    Overwrite it with the packaged version? ");
 											if (safe_query_user_input("yN") == 'n')
-												excluded_paths.push_back(cfile);
+												excluded_paths.insert(cfile);
 										}
 										else
 										{
@@ -1200,7 +1388,7 @@ bool ll_unpack (
 							{
 								printf ("    Overwrite it with the packaged version? ");
 								if (safe_query_user_input("yn") == 'n')
-									excluded_paths.push_back(cfile);
+									excluded_paths.insert(cfile);
 							}
 							else
 							{
@@ -1211,7 +1399,8 @@ bool ll_unpack (
 				}
 			}
 
-			pp->unpack_archive_to_directory (params->target, &excluded_paths);
+			pp->unpack_archive_to_directory (params->target, &excluded_paths,
+					get_unpack_writers (params), params->sync);
 		}
 
 		mdata->state = change ? PKG_STATE_WAIT_OLD_REMOVED : PKG_STATE_CONFIGURE_BEGIN;
@@ -26,6 +26,15 @@ bool install_packages(std::shared_ptr<Parameters> params, bool upgrade);
 
 bool set_installation_reason (char reason, std::shared_ptr<Parameters> params);
 
+/* Extract the package's archive to a staging directory below the target's
+ * package database. For packages from a repository, this verifies the
+ * transport form's digest in the same pass, hence it must come before anything
+ * else of the package is read. The files are moved into place by ll_unpack. */
+bool ll_stage_archive (
+		std::shared_ptr<Parameters> params,
+		std::shared_ptr<PackageMetaData> mdata,
+		std::shared_ptr<ProvidedPackage> pp);
+
 /* This function does not only run the package's preinst script, but also test
  * if its files are already present in the system and adopt them if required.
  * And it adds the package to the package database. If moreover @param
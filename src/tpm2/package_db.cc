@@ -1,6 +1,7 @@
 #include "package_db.h"
 #include <algorithm>
 #include <filesystem>
+#include <unordered_map>
 #include <vector>
 
 #include <cstdio>
@@ -8,6 +9,16 @@
 using namespace std;
 
 
+/* Number of files that set_files inserts with one statement. Each takes three
+ * parameters, which stays well below SQLite's limit of 999 parameters of older
+ * versions. */
+static const size_t FILES_PER_INSERT = 64;
+
+/* The id of the package given by the parameters 1 to 3 (name, architecture and
+ * version), to be used in SQL statements. */
+#define PKG_ID "(select id from packages where name = ?1 and architecture = ?2 and version = ?3)"
+
+
 PackageDB::PackageDB(shared_ptr<Parameters> params)
 	: params(params)
 {
@@ -61,6 +72,7 @@ PackageDB::PackageDB(shared_ptr<Parameters> params)
 	}
 	catch (...)
 	{
+		finalize_statements();
 		sqlite3_close_v2(pDb);
 		throw;
 	}
@@ -71,44 +83,55 @@ PackageDB::~PackageDB()
 {
 	if (pDb)
 	{
+		finalize_statements();
 		sqlite3_close_v2(pDb);
 	}
 }
 
 
-void PackageDB::begin()
+int PackageDB::prepare_cached (const char* sql, sqlite3_stmt** ppStmt)
 {
-	sqlite3_stmt *pStmt = nullptr;
+	auto i = statements.find (sql);
+	if (i != statements.end())
+	{
+		*ppStmt = i->second;
+		return SQLITE_OK;
+	}
+
+	auto err = sqlite3_prepare_v2 (pDb, sql, -1, ppStmt, nullptr);
+	if (err != SQLITE_OK)
+		return err;
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb, "begin;", -1, &pStmt, nullptr);
-		if (err != SQLITE_OK)
-			throw sqlitedb_exception (err, pDb);
-
-		err = sqlite3_step (pStmt);
-		if (err != SQLITE_DONE)
-			throw sqlitedb_exception (err, pDb);
+		statements.emplace (sql, *ppStmt);
 	}
 	catch (...)
 	{
-		if (pStmt)
-			sqlite3_finalize(pStmt);
-
+		sqlite3_finalize (*ppStmt);
+		*ppStmt = nullptr;
 		throw;
 	}
 
-	sqlite3_finalize(pStmt);
+	return SQLITE_OK;
 }
 
 
-void PackageDB::rollback()
+void PackageDB::release_cached (sqlite3_stmt* pStmt)
+{
+	/* Errors of the last step have been handled already */
+	sqlite3_reset (pStmt);
+	sqlite3_clear_bindings (pStmt);
+}
+
+
+void PackageDB::execute_cached (const char* sql)
 {
 	sqlite3_stmt *pStmt = nullptr;
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb, "rollback;", -1, &pStmt, nullptr);
+		int err = prepare_cached (sql, &pStmt);
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
 
@@ -119,38 +142,39 @@ void PackageDB::rollback()
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize(pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
 
-	sqlite3_finalize(pStmt);
+	release_cached (pStmt);
 }
 
 
-void PackageDB::commit()
+void PackageDB::finalize_statements ()
 {
-	sqlite3_stmt *pStmt = nullptr;
+	for (auto& [sql, pStmt] : statements)
+		sqlite3_finalize (pStmt);
 
-	try
-	{
-		int err = sqlite3_prepare_v2 (pDb, "commit;", -1, &pStmt, nullptr);
-		if (err != SQLITE_OK)
-			throw sqlitedb_exception (err, pDb);
+	statements.clear();
+}
 
-		err = sqlite3_step (pStmt);
-		if (err != SQLITE_DONE)
-			throw sqlitedb_exception (err, pDb);
-	}
-	catch (...)
-	{
-		if (pStmt)
-			sqlite3_finalize(pStmt);
 
-		throw;
-	}
+void PackageDB::begin()
+{
+	execute_cached ("begin;");
+}
+
 
-	sqlite3_finalize(pStmt);
+void PackageDB::rollback()
+{
+	execute_cached ("rollback;");
+}
+
+
+void PackageDB::commit()
+{
+	execute_cached ("commit;");
 }
 
 
@@ -237,6 +261,19 @@ void PackageDB::ensure_schema()
 
 			sqlite3_finalize (pStmt);
 			pStmt = nullptr;
+
+			if (v == VersionNumber("1.2"))
+			{
+				migrate_schema_1_2 ();
+				v = VersionNumber("2.0");
+			}
+
+			if (v == VersionNumber("2.0"))
+				migrate_schema_2_0 ();
+			else if (v != VersionNumber("2.1"))
+				throw PackageDBException ("Unsupported PackageDB version: " + v.to_string());
+
+			commit();
 		}
 		catch (...)
 		{
@@ -246,15 +283,6 @@ void PackageDB::ensure_schema()
 			rollback();
 			throw;
 		}
-
-		/* Nothing left to do. */
-		commit();
-
-		if (v != VersionNumber("1.2"))
-		{
-			throw PackageDBException (
-					"Unsupported PackageDB version: " + v.to_string());
-		}
 	}
 	else
 	{
@@ -277,154 +305,239 @@ void PackageDB::ensure_schema()
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
+			create_schema ();
+
+			/* Set schema version */
 			err = sqlite3_exec (pDb,
-					"create table packages ("
-						"name varchar,"
-						"architecture integer,"
-						"version varchar,"
-						"source_version varchar not null,"
-						"state integer not null,"
-						"installation_reason integer not null,"
-						"primary key (name, architecture, version));",
+					"insert into schema_version (version) values ('2.0');",
 					nullptr, nullptr, nullptr);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_exec (pDb,
-					"create table files ("
-						"path varchar,"
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"type integer not null,"
-						"digest blob not null,"
-						"primary key (path, pkg_name, pkg_architecture, pkg_version),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
+			migrate_schema_2_0 ();
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+			commit();
+		}
+		catch (...)
+		{
+			rollback();
+			throw;
+		}
+	}
+}
 
-			err = sqlite3_exec (pDb,
-					"create table config_files ("
-						"path varchar,"
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"primary key (path, pkg_name, pkg_architecture, pkg_version),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+void PackageDB::create_schema()
+{
+	/* Packages are referred to by their id in all other relations, and file
+	 * paths are stored once in paths. */
+	const char* statements[] = {
+		"create table packages ("
+			"id integer primary key,"
+			"name varchar not null,"
+			"architecture integer not null,"
+			"version varchar not null,"
+			"source_version varchar not null,"
+			"state integer not null,"
+			"installation_reason integer not null,"
+			"unique (name, architecture, version));",
+
+		"create table paths ("
+			"id integer primary key,"
+			"path varchar not null unique);",
+
+		"create table files ("
+			"path_id integer,"
+			"pkg_id integer,"
+			"type integer not null,"
+			"digest blob not null,"
+			"primary key (path_id, pkg_id),"
+			"foreign key (path_id) references paths (id),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		"create table config_files ("
+			"path_id integer,"
+			"pkg_id integer,"
+			"primary key (path_id, pkg_id),"
+			"foreign key (path_id) references paths (id),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		"create table pre_dependencies ("
+			"pkg_id integer,"
+			"name varchar,"
+			"architecture integer,"
+			"constraints varchar not null,"
+			"primary key (pkg_id, name, architecture),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		"create table dependencies ("
+			"pkg_id integer,"
+			"name varchar,"
+			"architecture integer,"
+			"constraints varchar not null,"
+			"primary key (pkg_id, name, architecture),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		/* Triggers */
+		"create table triggers_activate ("
+			"pkg_id integer,"
+			"trigger varchar,"
+			"primary key (pkg_id, trigger),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		"create table triggers_interest ("
+			"pkg_id integer,"
+			"trigger varchar,"
+			"primary key (pkg_id, trigger),"
+			"foreign key (pkg_id) references packages (id) on delete cascade) "
+			"without rowid;",
+
+		"create index triggers_interest_index "
+		"on triggers_interest ("
+			"trigger);",
+
+		"create table if not exists triggers_activated ("
+			"trigger varchar,"
+			"primary key (trigger));"
+	};
 
+	for (auto sql : statements)
+	{
+		int err = sqlite3_exec (pDb, sql, nullptr, nullptr, nullptr);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+	}
+}
 
-			err = sqlite3_exec (pDb,
-					"create table pre_dependencies ("
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"name varchar,"
-						"architecture integer,"
-						"constraints varchar not null,"
-						"primary key (pkg_name, pkg_architecture, pkg_version, name, architecture),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+void PackageDB::migrate_schema_2_0()
+{
+	/* The primary keys of files and config_files start with the path, hence
+	 * finding a package's files required a scan of the entire relation. The
+	 * index on files includes type and digest such that get_files needs not
+	 * look up the tuples themselves; the path id is part of both indexes as
+	 * primary key column anyway. */
+	const char* statements[] = {
+		"create index files_pkg_index "
+		"on files ("
+			"pkg_id, type, digest);",
+
+		"create index config_files_pkg_index "
+		"on config_files ("
+			"pkg_id);",
+
+		"update schema_version set version = '2.1';"
+	};
 
+	for (auto sql : statements)
+	{
+		int err = sqlite3_exec (pDb, sql, nullptr, nullptr, nullptr);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+	}
+}
 
-			err = sqlite3_exec (pDb,
-					"create table dependencies ("
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"name varchar,"
-						"architecture integer,"
-						"constraints varchar not null,"
-						"primary key (pkg_name, pkg_architecture, pkg_version, name, architecture),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+void PackageDB::migrate_schema_1_2()
+{
+	/* Schema 1.2 referred to packages by name, architecture and version in
+	 * every relation and stored full paths with each file. Move the old
+	 * relations out of the way, create the new ones and copy the tuples over.
+	 * triggers_activated did not change. */
+	const char* tables[] = {
+		"packages",
+		"files",
+		"config_files",
+		"pre_dependencies",
+		"dependencies",
+		"triggers_activate",
+		"triggers_interest"
+	};
 
+	int err = sqlite3_exec (pDb, "drop index triggers_interest_index;",
+			nullptr, nullptr, nullptr);
 
-			/* Triggers */
-			err = sqlite3_exec (pDb,
-					"create table triggers_activate ("
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"trigger varchar,"
-						"primary key (pkg_name, pkg_architecture, pkg_version, trigger),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
+	if (err != SQLITE_OK)
+		throw sqlitedb_exception (err, pDb);
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+	for (auto t : tables)
+	{
+		err = sqlite3_exec (pDb,
+				(string("alter table ") + t + " rename to " + t + "_1_2;").c_str(),
+				nullptr, nullptr, nullptr);
 
-			err = sqlite3_exec (pDb,
-					"create table triggers_interest ("
-						"pkg_name varchar,"
-						"pkg_architecture integer,"
-						"pkg_version varchar,"
-						"trigger varchar,"
-						"primary key (pkg_name, pkg_architecture, pkg_version, trigger),"
-						"foreign key (pkg_name, pkg_architecture, pkg_version) "
-							"references packages (name, architecture, version) "
-							"on update cascade on delete cascade);",
-					nullptr, nullptr, nullptr);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+	}
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+	create_schema ();
 
-			err = sqlite3_exec (pDb,
-					"create index triggers_interest_index "
-					"on triggers_interest ("
-						"trigger);",
-					nullptr, nullptr, nullptr);
+#define OLD_PKG_JOIN(t) \
+	"join packages p on p.name = " t ".pkg_name and " \
+		"p.architecture = " t ".pkg_architecture and p.version = " t ".pkg_version "
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+	const char* statements[] = {
+		"insert into packages "
+			"(name, architecture, version, source_version, state, installation_reason) "
+		"select name, architecture, version, source_version, state, installation_reason "
+		"from packages_1_2;",
 
-			err = sqlite3_exec (pDb,
-					"create table triggers_activated ("
-						"trigger varchar,"
-						"primary key (trigger));",
-					nullptr, nullptr, nullptr);
+		"insert into paths (path) "
+		"select path from files_1_2 union select path from config_files_1_2;",
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+		"insert into files (path_id, pkg_id, type, digest) "
+		"select pa.id, p.id, f.type, f.digest from files_1_2 f "
+		OLD_PKG_JOIN("f")
+		"join paths pa on pa.path = f.path;",
 
+		"insert into config_files (path_id, pkg_id) "
+		"select pa.id, p.id from config_files_1_2 c "
+		OLD_PKG_JOIN("c")
+		"join paths pa on pa.path = c.path;",
 
-			/* Set schema version */
-			err = sqlite3_exec (pDb,
-					"insert into schema_version (version) values ('1.2');",
-					nullptr, nullptr, nullptr);
+		"insert into pre_dependencies (pkg_id, name, architecture, constraints) "
+		"select p.id, d.name, d.architecture, d.constraints from pre_dependencies_1_2 d "
+		OLD_PKG_JOIN("d") ";",
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+		"insert into dependencies (pkg_id, name, architecture, constraints) "
+		"select p.id, d.name, d.architecture, d.constraints from dependencies_1_2 d "
+		OLD_PKG_JOIN("d") ";",
 
-			commit();
-		}
-		catch (...)
-		{
-			rollback();
-			throw;
-		}
+		"insert into triggers_activate (pkg_id, trigger) "
+		"select p.id, t.trigger from triggers_activate_1_2 t "
+		OLD_PKG_JOIN("t") ";",
+
+		"insert into triggers_interest (pkg_id, trigger) "
+		"select p.id, t.trigger from triggers_interest_1_2 t "
+		OLD_PKG_JOIN("t") ";",
+
+		"update schema_version set version = '2.0';"
+	};
+
+#undef OLD_PKG_JOIN
+
+	for (auto sql : statements)
+	{
+		err = sqlite3_exec (pDb, sql, nullptr, nullptr, nullptr);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+	}
+
+	/* Children first, though foreign keys are not enforced */
+	for (auto i = rbegin(tables); i != rend(tables); i++)
+	{
+		err = sqlite3_exec (pDb,
+				(string("drop table ") + *i + "_1_2;").c_str(),
+				nullptr, nullptr, nullptr);
+
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
 	}
 }
 
@@ -435,36 +548,51 @@ vector<shared_ptr<PackageMetaData>> PackageDB::get_packages_in_state(const int s
 
 	vector<shared_ptr<PackageMetaData>> pkgs;
 
-	try
-	{
-		int err;
-		
-		if (state == ALL_PKG_STATES)
+	/* The packages are read first, and then the pre-dependencies and
+	 * dependencies of all of them with one query each (instead of two per
+	 * package). The savepoint makes the queries see the same state of the
+	 * database. */
+	unordered_map<sqlite3_int64, PackageMetaData*> pkgs_by_id;
+	bool all_states = state == ALL_PKG_STATES;
+
+	const char *dependency_statements[2][2] = {
 		{
-			err = sqlite3_prepare_v2 (pDb,
-					"select name, architecture, version, source_version, installation_reason, state "
-					"from packages;",
-					-1, &pStmt, nullptr);
+			"select pkg_id, name, architecture, constraints "
+			"from pre_dependencies;",
+
+			"select d.pkg_id, d.name, d.architecture, d.constraints "
+			"from pre_dependencies d "
+			"join packages p on p.id = d.pkg_id "
+			"where p.state = ?1;"
+		},
+		{
+			"select pkg_id, name, architecture, constraints "
+			"from dependencies;",
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+			"select d.pkg_id, d.name, d.architecture, d.constraints "
+			"from dependencies d "
+			"join packages p on p.id = d.pkg_id "
+			"where p.state = ?1;"
 		}
-		else
-		{
-			err = sqlite3_prepare_v2 (pDb,
-					"select name, architecture, version, source_version, installation_reason, state "
-					"from packages where state=?;",
-					-1, &pStmt, nullptr);
+	};
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+	execute_cached ("savepoint get_packages;");
 
+	try
+	{
+		int err = prepare_cached (all_states ?
+				"select id, name, architecture, version, source_version, installation_reason, state "
+				"from packages;" :
+				"select id, name, architecture, version, source_version, installation_reason, state "
+				"from packages where state = ?1;",
+				&pStmt);
 
-			err = sqlite3_bind_int (
-					pStmt,
-					1,
-					state);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
 
+		if (!all_states)
+		{
+			err = sqlite3_bind_int (pStmt, 1, state);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 		}
@@ -484,226 +612,96 @@ vector<shared_ptr<PackageMetaData>> PackageDB::get_packages_in_state(const int s
 			}
 			else
 			{
-				if (sqlite3_column_count (pStmt) != 6)
+				if (sqlite3_column_count (pStmt) != 7)
 					throw PackageDBException ("Invalid column count in get_packages_in_state");
 
-				string name = (const char*) sqlite3_column_text (pStmt, 0);
-				int architecture = sqlite3_column_int (pStmt, 1);
-				VersionNumber v((const char*) sqlite3_column_text (pStmt, 2));
-				VersionNumber sv((const char*) sqlite3_column_text (pStmt, 3));
-				char reason = (char) sqlite3_column_int (pStmt, 4);
-				int state = sqlite3_column_int (pStmt, 5);
-
 				auto pkg = make_shared<PackageMetaData> (
-						name, architecture, v, sv, reason, state);
-
-
-				/* Get the pre-dependencies of this package */
-				sqlite3_stmt *pStmt2 = nullptr;
-				auto vs = v.to_string();
-
-
-				try
-				{
-					err = sqlite3_prepare_v2 (pDb,
-							"select name, architecture, constraints "
-							"from pre_dependencies "
-							"where pkg_name = ? and "
-								"pkg_architecture = ? "
-								"and pkg_version = ?;",
-							-1,
-							&pStmt2,
-							nullptr);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_text (
-							pStmt2,
-							1,
-							name.c_str(),
-							name.size(),
-							SQLITE_STATIC);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_int (
-							pStmt2,
-							2,
-							architecture);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_text (
-							pStmt2,
-							3,
-							vs.c_str(),
-							vs.size(),
-							SQLITE_STATIC);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					for (;;)
-					{
-						err = sqlite3_step (pStmt2);
-
-						if (err == SQLITE_DONE)
-						{
-							break;
-						}
-						else if (err != SQLITE_ROW)
-						{
-							throw sqlitedb_exception (err, pDb);
-						}
-						else
-						{
-							if (sqlite3_column_count (pStmt2) != 3)
-								throw PackageDBException ("Invalid column "
-										"count while selecting pre-dependencies");
+						(const char*) sqlite3_column_text (pStmt, 1),
+						sqlite3_column_int (pStmt, 2),
+						VersionNumber((const char*) sqlite3_column_text (pStmt, 3)),
+						VersionNumber((const char*) sqlite3_column_text (pStmt, 4)),
+						(char) sqlite3_column_int (pStmt, 5),
+						sqlite3_column_int (pStmt, 6));
+
+				pkgs_by_id.emplace (sqlite3_column_int64 (pStmt, 0), pkg.get());
+				pkgs.push_back (pkg);
+			}
+		}
 
+		release_cached (pStmt);
+		pStmt = nullptr;
 
-							auto constraints = PackageConstraints::Formula::from_string (
-									(const char*) sqlite3_column_text (pStmt2, 2));
 
-							if (!constraints)
-								throw PackageDBException ("Invalid constraint string \"" +
-										string ((const char*) sqlite3_column_text (pStmt2, 2)));
+		/* Get the pre-dependencies and dependencies of the packages */
+		for (unsigned char i = 0; i < 2; i++)
+		{
+			err = prepare_cached (dependency_statements[i][all_states ? 0 : 1], &pStmt);
+			if (err != SQLITE_OK)
+				throw sqlitedb_exception (err, pDb);
 
+			if (!all_states)
+			{
+				err = sqlite3_bind_int (pStmt, 1, state);
+				if (err != SQLITE_OK)
+					throw sqlitedb_exception (err, pDb);
+			}
 
-							pkg->add_pre_dependency (Dependency (
-									(const char*) sqlite3_column_text (pStmt2, 0),
-									sqlite3_column_int (pStmt2, 1),
-									constraints));
-						}
-					}
+			for (;;)
+			{
+				err = sqlite3_step (pStmt);
 
-					sqlite3_finalize (pStmt2);
-					pStmt2 = nullptr;
-				}
-				catch (...)
+				if (err == SQLITE_DONE)
 				{
-					if (pStmt2)
-						sqlite3_finalize (pStmt2);
-
-					throw;
+					break;
 				}
-
-
-				/* Get the dependencies of this package */
-				try
+				else if (err != SQLITE_ROW)
 				{
-					err = sqlite3_prepare_v2 (pDb,
-							"select name, architecture, constraints "
-							"from dependencies "
-							"where pkg_name = ? and "
-								"pkg_architecture = ? "
-								"and pkg_version = ?;",
-							-1,
-							&pStmt2,
-							nullptr);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_text (
-							pStmt2,
-							1,
-							name.c_str(),
-							name.size(),
-							SQLITE_STATIC);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_int (
-							pStmt2,
-							2,
-							architecture);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					err = sqlite3_bind_text (
-							pStmt2,
-							3,
-							vs.c_str(),
-							vs.size(),
-							SQLITE_STATIC);
-
-					if (err != SQLITE_OK)
-						throw sqlitedb_exception (err, pDb);
-
-
-					for (;;)
-					{
-						err = sqlite3_step (pStmt2);
-
-						if (err == SQLITE_DONE)
-						{
-							break;
-						}
-						else if (err != SQLITE_ROW)
-						{
-							throw sqlitedb_exception (err, pDb);
-						}
-						else
-						{
-							if (sqlite3_column_count (pStmt2) != 3)
-								throw PackageDBException ("Invalid column "
-										"count while selecting dependencies");
-
-
-							auto constraints = PackageConstraints::Formula::from_string (
-									(const char*) sqlite3_column_text (pStmt2, 2));
-
-							if (!constraints)
-								throw PackageDBException ("Invalid constraint string \"" +
-										string((const char*) sqlite3_column_text (pStmt2, 2)));
-
-
-							pkg->add_dependency (Dependency (
-									(const char*) sqlite3_column_text (pStmt2, 0),
-									sqlite3_column_int (pStmt2, 1),
-									constraints));
-						}
-					}
-
-					sqlite3_finalize (pStmt2);
-					pStmt2 = nullptr;
+					throw sqlitedb_exception (err, pDb);
 				}
-				catch (...)
+				else
 				{
-					if (pStmt2)
-						sqlite3_finalize (pStmt2);
-
-					throw;
+					if (sqlite3_column_count (pStmt) != 4)
+						throw PackageDBException ("Invalid column "
+								"count while selecting dependencies");
+
+					auto ipkg = pkgs_by_id.find (sqlite3_column_int64 (pStmt, 0));
+					if (ipkg == pkgs_by_id.end())
+						continue;
+
+					auto constraints = PackageConstraints::Formula::from_string (
+							(const char*) sqlite3_column_text (pStmt, 3));
+
+					if (!constraints)
+						throw PackageDBException ("Invalid constraint string \"" +
+								string((const char*) sqlite3_column_text (pStmt, 3)));
+
+					Dependency dep (
+							(const char*) sqlite3_column_text (pStmt, 1),
+							sqlite3_column_int (pStmt, 2),
+							constraints);
+
+					if (i == 0)
+						ipkg->second->add_pre_dependency (dep);
+					else
+						ipkg->second->add_dependency (dep);
 				}
-
-				/* Add the package to the list to return */
-				pkgs.push_back (pkg);
 			}
-		}
 
-		sqlite3_finalize (pStmt);
+			release_cached (pStmt);
+			pStmt = nullptr;
+		}
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
+		execute_cached ("rollback to get_packages;");
+		execute_cached ("release get_packages;");
 		throw;
 	}
 
+	execute_cached ("release get_packages;");
 	return pkgs;
 }
 
@@ -718,11 +716,11 @@ shared_ptr<PackageMetaData> PackageDB::get_reduced_package (
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"select name, architecture, version, source_version, installation_reason, state "
 				"from packages "
 				"where name = ?1 and architecture = ?2 and version = ?3;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -758,13 +756,13 @@ shared_ptr<PackageMetaData> PackageDB::get_reduced_package (
 			throw sqlitedb_exception (err, pDb);
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -780,10 +778,10 @@ bool PackageDB::update_or_create_package (shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb,
+		int err = prepare_cached (
 				"select count(*) from packages p "
 				"where p.name = ?1 and p.architecture = ?2 and p.version = ?3;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -809,17 +807,17 @@ bool PackageDB::update_or_create_package (shared_ptr<PackageMetaData> mdata)
 
 		int cnt = sqlite3_column_int (pStmt, 0);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		if (cnt == 0)
 		{
-			err = sqlite3_prepare_v2 (pDb,
+			err = prepare_cached (
 					"insert into packages "
 					"(name, architecture, version , source_version, state, installation_reason) "
 					"values (?1, ?2, ?3, ?4, ?5, ?6);",
-					-1, &pStmt, nullptr);
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
@@ -852,18 +850,18 @@ bool PackageDB::update_or_create_package (shared_ptr<PackageMetaData> mdata)
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 
 			created = true;
 		}
 		else
 		{
-			err = sqlite3_prepare_v2 (pDb,
+			err = prepare_cached (
 					"update packages "
 					"set source_version = ?4, state = ?5, installation_reason = ?6 "
 					"where name = ?1 and architecture = ?2 and version = ?3;",
-					-1, &pStmt, nullptr);
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
@@ -896,7 +894,7 @@ bool PackageDB::update_or_create_package (shared_ptr<PackageMetaData> mdata)
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 
 			created = false;
@@ -905,7 +903,7 @@ bool PackageDB::update_or_create_package (shared_ptr<PackageMetaData> mdata)
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -924,10 +922,10 @@ void PackageDB::update_state (shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"update packages set state = ?4 "
 				"where name = ?1 and architecture = ?2 and version = ?3;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -952,13 +950,13 @@ void PackageDB::update_state (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -972,10 +970,10 @@ void PackageDB::update_installation_reason (shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"update packages set installation_reason = ?4 "
 				"where name = ?1 and architecture = ?2 and version = ?3;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1000,13 +998,13 @@ void PackageDB::update_installation_reason (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1020,27 +1018,27 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 
 	const char *delete_statements[2] = {
 		"delete from pre_dependencies "
-		"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
+		"where pkg_id = " PKG_ID ";",
 		"delete from dependencies "
-		"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;"
+		"where pkg_id = " PKG_ID ";"
 	};
 
 	const char *insert_statements[2] = {
 		"insert into pre_dependencies "
-		"(pkg_name, pkg_architecture, pkg_version, name, architecture, constraints) "
-		"values (?1, ?2, ?3, ?4, ?5, ?6);",
+		"(pkg_id, name, architecture, constraints) "
+		"values (" PKG_ID ", ?4, ?5, ?6);",
 		"insert into dependencies "
-		"(pkg_name, pkg_architecture, pkg_version, name, architecture, constraints) "
-		"values (?1, ?2, ?3, ?4, ?5, ?6);"
+		"(pkg_id, name, architecture, constraints) "
+		"values (" PKG_ID ", ?4, ?5, ?6);"
 	};
 
 	try
 	{
 		for (unsigned char i = 0; i < 2; i++)
 		{
-			auto err = sqlite3_prepare_v2 (pDb,
+			auto err = prepare_cached (
 					delete_statements[i],
-					-1, &pStmt, nullptr);
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
@@ -1061,7 +1059,7 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 
 
@@ -1070,9 +1068,9 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 			{
 				const auto& dep = *j;
 
-				err = sqlite3_prepare_v2 (pDb,
+				err = prepare_cached (
 						insert_statements[i],
-						-1, &pStmt, nullptr);
+						&pStmt);
 
 				if (err != SQLITE_OK)
 					throw sqlitedb_exception (err, pDb);
@@ -1103,7 +1101,7 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 				const string& constraints = dep.version_formula ? dep.version_formula->to_string() : string();
 
 				/* Transient because I'm not sure if the string has to survive
-				 * until sqlite3_finalize. */
+				 * until the statement is reset. */
 				err = sqlite3_bind_text (pStmt, 6, constraints.c_str(), constraints.size(), SQLITE_TRANSIENT);
 				if (err != SQLITE_OK)
 					throw sqlitedb_exception (err, pDb);
@@ -1112,7 +1110,7 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 				if (err != SQLITE_DONE)
 					throw sqlitedb_exception (err, pDb);
 
-				sqlite3_finalize (pStmt);
+				release_cached (pStmt);
 				pStmt = nullptr;
 			}
 		}
@@ -1120,7 +1118,7 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1130,14 +1128,54 @@ void PackageDB::set_dependencies (shared_ptr<PackageMetaData> mdata)
 void PackageDB::set_files (shared_ptr<PackageMetaData> mdata, shared_ptr<FileList> files)
 {
 	sqlite3_stmt *pStmt = nullptr;
+	sqlite3_stmt *pPaths = nullptr;
 	const string& version_string = mdata->version.to_string();
 
+	/* Replace the files as a whole even outside of a transaction, which is also
+	 * much faster than committing each tuple on its own. */
+	execute_cached ("savepoint set_files;");
+
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		/* Delete the paths that only the files being replaced refer to, such
+		 * that paths does not keep ones that no package has anymore. Paths
+		 * that are in the new list, too, are added again below. */
+		auto err = prepare_cached (
+				"delete from paths where id in ("
+					"select path_id from files where pkg_id = " PKG_ID ") "
+				"and not exists (select 1 from files f "
+					"where f.path_id = paths.id and f.pkg_id != " PKG_ID ") "
+				"and not exists (select 1 from config_files c "
+					"where c.path_id = paths.id);",
+				&pStmt);
+
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 1, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_int (pStmt, 2, mdata->architecture);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 3, version_string.c_str(), version_string.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_step (pStmt);
+		if (err != SQLITE_DONE)
+			throw sqlitedb_exception (err, pDb);
+
+		release_cached (pStmt);
+		pStmt = nullptr;
+
+
+		err = prepare_cached (
 				"delete from files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1158,62 +1196,140 @@ void PackageDB::set_files (shared_ptr<PackageMetaData> mdata, shared_ptr<FileLis
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
-		for (const auto& file : *files)
+		/* Insert FILES_PER_INSERT files per statement while possible, and the
+		 * rest one by one. The package columns are bound once per statement,
+		 * which is only reset between rows such that they stay bound. Paths
+		 * that are not known yet are added before the files that refer to
+		 * them. */
+		static const string batch_insert = insert_files_statement (FILES_PER_INSERT);
+		static const string single_insert = insert_files_statement (1);
+		static const string batch_insert_paths = insert_paths_statement (FILES_PER_INSERT);
+		static const string single_insert_paths = insert_paths_statement (1);
+
+		auto file = files->begin();
+		auto remaining = files->size();
+
+		for (auto rows : { FILES_PER_INSERT, (size_t) 1 })
 		{
-			err = sqlite3_prepare_v2 (pDb,
-					"insert into files "
-					"(path, pkg_name, pkg_architecture, pkg_version, type, digest) "
-					"values (?1, ?2, ?3, ?4, ?5, ?6);",
-					-1, &pStmt, nullptr);
+			if (remaining < rows)
+				continue;
 
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+			err = prepare_cached (rows > 1 ? batch_insert.c_str() : single_insert.c_str(),
+					&pStmt);
 
-			/* Again, not sure if the path would have to survive into the
-			 * potential catch block. */
-			err = sqlite3_bind_text (pStmt, 1, file.path.c_str(), file.path.size(), SQLITE_TRANSIENT);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_text (pStmt, 2, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
-			if (err != SQLITE_OK)
-				throw sqlitedb_exception (err, pDb);
+			err = prepare_cached (rows > 1 ? batch_insert_paths.c_str() : single_insert_paths.c_str(),
+					&pPaths);
 
-			err = sqlite3_bind_int (pStmt, 3, mdata->architecture);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_text (pStmt, 4, version_string.c_str(), version_string.size(), SQLITE_STATIC);
+			err = sqlite3_bind_text (pStmt, 1, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_int (pStmt, 5, file.type);
+			err = sqlite3_bind_int (pStmt, 2, mdata->architecture);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_blob (pStmt, 6, file.sha1_sum, 20, SQLITE_TRANSIENT);
+			err = sqlite3_bind_text (pStmt, 3, version_string.c_str(), version_string.size(), SQLITE_STATIC);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_step (pStmt);
-			if (err != SQLITE_DONE)
-				throw sqlitedb_exception (err, pDb);
+			for (; remaining >= rows; remaining -= rows)
+			{
+				for (size_t k = 0; k < rows; k++, file++)
+				{
+					/* The file list outlives the statements' execution */
+					err = sqlite3_bind_text (pPaths, 1 + k,
+							file->path.data(), file->path.size(), SQLITE_STATIC);
 
-			sqlite3_finalize (pStmt);
+					if (err != SQLITE_OK)
+						throw sqlitedb_exception (err, pDb);
+
+					err = sqlite3_bind_text (pStmt, 4 + 3*k,
+							file->path.data(), file->path.size(), SQLITE_STATIC);
+
+					if (err != SQLITE_OK)
+						throw sqlitedb_exception (err, pDb);
+
+					err = sqlite3_bind_int (pStmt, 5 + 3*k, file->type);
+					if (err != SQLITE_OK)
+						throw sqlitedb_exception (err, pDb);
+
+					err = sqlite3_bind_blob (pStmt, 6 + 3*k, file->sha1_sum, 20, SQLITE_STATIC);
+					if (err != SQLITE_OK)
+						throw sqlitedb_exception (err, pDb);
+				}
+
+				err = sqlite3_step (pPaths);
+				if (err != SQLITE_DONE)
+					throw sqlitedb_exception (err, pDb);
+
+				sqlite3_reset (pPaths);
+
+				err = sqlite3_step (pStmt);
+				if (err != SQLITE_DONE)
+					throw sqlitedb_exception (err, pDb);
+
+				sqlite3_reset (pStmt);
+			}
+
+			release_cached (pPaths);
+			release_cached (pStmt);
+			pPaths = nullptr;
 			pStmt = nullptr;
 		}
 	}
 	catch (...)
 	{
+		if (pPaths)
+			release_cached (pPaths);
+
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
+		execute_cached ("rollback to set_files;");
+		execute_cached ("release set_files;");
 		throw;
 	}
+
+	execute_cached ("release set_files;");
+}
+
+
+string PackageDB::insert_paths_statement (size_t rows)
+{
+	string sql = "insert into paths (path) values ";
+
+	for (size_t k = 0; k < rows; k++)
+		sql += string(k > 0 ? ", " : "") + "(?" + to_string(k + 1) + ")";
+
+	return sql + " on conflict do nothing;";
+}
+
+
+string PackageDB::insert_files_statement (size_t rows)
+{
+	string sql = "insert into files "
+		"(path_id, pkg_id, type, digest) values ";
+
+	for (size_t k = 0; k < rows; k++)
+	{
+		auto p = 4 + 3*k;
+
+		sql += string(k > 0 ? ", " : "") +
+			"((select id from paths where path = ?" + to_string(p) + "), " PKG_ID ", " +
+			"?" + to_string(p + 1) + ", ?" + to_string(p + 2) + ")";
+	}
+
+	return sql + ";";
 }
 
 
@@ -1226,10 +1342,11 @@ list<PackageDBFileEntry> PackageDB::get_files (shared_ptr<PackageMetaData> mdata
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
-				"select path, type, digest from files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+		auto err = prepare_cached (
+				"select p.path, f.type, f.digest from files f "
+				"join paths p on p.id = f.path_id "
+				"where f.pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1280,13 +1397,13 @@ list<PackageDBFileEntry> PackageDB::get_files (shared_ptr<PackageMetaData> mdata
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1305,10 +1422,11 @@ optional<PackageDBFileEntry> PackageDB::get_file (const PackageMetaData* mdata,
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"select type, digest from files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3 and path = ?4;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID " and "
+					"path_id = (select id from paths where path = ?4);",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1365,13 +1483,13 @@ optional<PackageDBFileEntry> PackageDB::get_file (const PackageMetaData* mdata,
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1385,12 +1503,47 @@ void PackageDB::set_config_files (shared_ptr<PackageMetaData> mdata, shared_ptr<
 	sqlite3_stmt *pStmt = nullptr;
 	const string& version_string = mdata->version.to_string();
 
+	execute_cached ("savepoint set_config_files;");
+
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		/* Likewise for the config files being replaced */
+		auto err = prepare_cached (
+				"delete from paths where id in ("
+					"select path_id from config_files where pkg_id = " PKG_ID ") "
+				"and not exists (select 1 from config_files c "
+					"where c.path_id = paths.id and c.pkg_id != " PKG_ID ") "
+				"and not exists (select 1 from files f "
+					"where f.path_id = paths.id);",
+				&pStmt);
+
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 1, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_int (pStmt, 2, mdata->architecture);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 3, version_string.c_str(), version_string.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_step (pStmt);
+		if (err != SQLITE_DONE)
+			throw sqlitedb_exception (err, pDb);
+
+		release_cached (pStmt);
+		pStmt = nullptr;
+
+
+		err = prepare_cached (
 				"delete from config_files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1411,36 +1564,53 @@ void PackageDB::set_config_files (shared_ptr<PackageMetaData> mdata, shared_ptr<
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		for (const auto& file : *files)
 		{
-			err = sqlite3_prepare_v2 (pDb,
+			err = prepare_cached (
+					"insert into paths (path) values (?1) on conflict do nothing;",
+					&pStmt);
+
+			if (err != SQLITE_OK)
+				throw sqlitedb_exception (err, pDb);
+
+			err = sqlite3_bind_text (pStmt, 1, file.c_str(), file.size(), SQLITE_STATIC);
+			if (err != SQLITE_OK)
+				throw sqlitedb_exception (err, pDb);
+
+			err = sqlite3_step (pStmt);
+			if (err != SQLITE_DONE)
+				throw sqlitedb_exception (err, pDb);
+
+			release_cached (pStmt);
+			pStmt = nullptr;
+
+
+			err = prepare_cached (
 					"insert into config_files "
-					"(path, pkg_name, pkg_architecture, pkg_version) "
-					"values (?1, ?2, ?3, ?4);",
-					-1, &pStmt, nullptr);
+					"(path_id, pkg_id) "
+					"values ((select id from paths where path = ?4), " PKG_ID ");",
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			/* Again, not sure if the path would have to survive into the
-			 * potential catch block. */
-			err = sqlite3_bind_text (pStmt, 1, file.c_str(), file.size(), SQLITE_TRANSIENT);
+			err = sqlite3_bind_text (pStmt, 1, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_text (pStmt, 2, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
+			err = sqlite3_bind_int (pStmt, 2, mdata->architecture);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_int (pStmt, 3, mdata->architecture);
+			err = sqlite3_bind_text (pStmt, 3, version_string.c_str(), version_string.size(), SQLITE_STATIC);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
-			err = sqlite3_bind_text (pStmt, 4, version_string.c_str(), version_string.size(), SQLITE_STATIC);
+			err = sqlite3_bind_text (pStmt, 4, file.c_str(), file.size(), SQLITE_STATIC);
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
 
@@ -1448,17 +1618,21 @@ void PackageDB::set_config_files (shared_ptr<PackageMetaData> mdata, shared_ptr<
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 		}
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
+		execute_cached ("rollback to set_config_files;");
+		execute_cached ("release set_config_files;");
 		throw;
 	}
+
+	execute_cached ("release set_config_files;");
 }
 
 
@@ -1471,10 +1645,11 @@ vector<string> PackageDB::get_config_files(shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
-				"select path from files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+		auto err = prepare_cached (
+				"select p.path from files f "
+				"join paths p on p.id = f.path_id "
+				"where f.pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1513,13 +1688,13 @@ vector<string> PackageDB::get_config_files(shared_ptr<PackageMetaData> mdata)
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1536,9 +1711,11 @@ vector<PackageDBFileEntry> PackageDB::get_all_files_plain ()
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
-				"select path, type, digest from files order by path;",
-				-1, &pStmt, nullptr);
+		auto err = prepare_cached (
+				"select p.path, f.type, f.digest from files f "
+				"join paths p on p.id = f.path_id "
+				"order by p.path;",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1577,13 +1754,13 @@ vector<PackageDBFileEntry> PackageDB::get_all_files_plain ()
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1605,10 +1782,10 @@ void PackageDB::set_interested_triggers (shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"delete from triggers_interest "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1629,17 +1806,17 @@ void PackageDB::set_interested_triggers (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		for (const auto& trigger : *mdata->interested_triggers)
 		{
-			err = sqlite3_prepare_v2 (pDb,
+			err = prepare_cached (
 					"insert into triggers_interest "
-					"(pkg_name, pkg_architecture, pkg_version, trigger) "
-					"values (?1, ?2, ?3, ?4);",
-					-1, &pStmt, nullptr);
+					"(pkg_id, trigger) "
+					"values (" PKG_ID ", ?4);",
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
@@ -1664,14 +1841,14 @@ void PackageDB::set_interested_triggers (shared_ptr<PackageMetaData> mdata)
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 		}
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1691,10 +1868,10 @@ void PackageDB::set_activating_triggers (shared_ptr<PackageMetaData> mdata)
 
 	try
 	{
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"delete from triggers_activate "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1715,17 +1892,17 @@ void PackageDB::set_activating_triggers (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		for (const auto& trigger : *mdata->activated_triggers)
 		{
-			err = sqlite3_prepare_v2 (pDb,
+			err = prepare_cached (
 					"insert into triggers_activate "
-					"(pkg_name, pkg_architecture, pkg_version, trigger) "
-					"values (?1, ?2, ?3, ?4);",
-					-1, &pStmt, nullptr);
+					"(pkg_id, trigger) "
+					"values (" PKG_ID ", ?4);",
+					&pStmt);
 
 			if (err != SQLITE_OK)
 				throw sqlitedb_exception (err, pDb);
@@ -1750,14 +1927,14 @@ void PackageDB::set_activating_triggers (shared_ptr<PackageMetaData> mdata)
 			if (err != SQLITE_DONE)
 				throw sqlitedb_exception (err, pDb);
 
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 			pStmt = nullptr;
 		}
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -1769,13 +1946,51 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 	sqlite3_stmt *pStmt = nullptr;
 	const string& version_string = mdata->version.to_string();
 
+	/* Foreign keys are not enforced, hence the dependent tuples are deleted
+	 * explicitly, and either all or none of them. */
+	execute_cached ("savepoint delete_package;");
+
 	try
 	{
+		/* Delete the paths that only this package refers to */
+		auto err = prepare_cached (
+				"delete from paths where id in ("
+					"select path_id from files where pkg_id = " PKG_ID " union "
+					"select path_id from config_files where pkg_id = " PKG_ID ") "
+				"and not exists (select 1 from files f "
+					"where f.path_id = paths.id and f.pkg_id != " PKG_ID ") "
+				"and not exists (select 1 from config_files c "
+					"where c.path_id = paths.id and c.pkg_id != " PKG_ID ");",
+				&pStmt);
+
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 1, mdata->name.c_str(), mdata->name.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_int (pStmt, 2, mdata->architecture);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_bind_text (pStmt, 3, version_string.c_str(), version_string.size(), SQLITE_STATIC);
+		if (err != SQLITE_OK)
+			throw sqlitedb_exception (err, pDb);
+
+		err = sqlite3_step (pStmt);
+		if (err != SQLITE_DONE)
+			throw sqlitedb_exception (err, pDb);
+
+		release_cached (pStmt);
+		pStmt = nullptr;
+
+
 		/* Delete files */
-		auto err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1796,15 +2011,15 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		/* Delete config files */
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from config_files "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1825,15 +2040,15 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		/* Delete dependencies */
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from dependencies "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1854,15 +2069,15 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		/* Delete pre-dependencies */
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from pre_dependencies "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1883,15 +2098,15 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		/* Delete refrences to triggers */
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from triggers_activate "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1912,13 +2127,13 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from triggers_interest "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1939,15 +2154,15 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 
 
 		/* Finally delete the package's main tuple. */
-		err = sqlite3_prepare_v2 (pDb,
+		err = prepare_cached (
 				"delete from packages "
 				"where name = ?1 and architecture = ?2 and version = ?3;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -1968,16 +2183,20 @@ void PackageDB::delete_package (shared_ptr<PackageMetaData> mdata)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
+		execute_cached ("rollback to delete_package;");
+		execute_cached ("release delete_package;");
 		throw;
 	}
+
+	execute_cached ("release delete_package;");
 }
 
 
@@ -1996,10 +2215,10 @@ void PackageDB::ensure_activating_triggers_read (shared_ptr<PackageMetaData> mda
 	{
 		mdata->activated_triggers.emplace();
 
-		auto err = sqlite3_prepare_v2 (pDb,
+		auto err = prepare_cached (
 				"select trigger from triggers_activate "
-				"where pkg_name = ?1 and pkg_architecture = ?2 and pkg_version = ?3;",
-				-1, &pStmt, nullptr);
+				"where pkg_id = " PKG_ID ";",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -2038,13 +2257,13 @@ void PackageDB::ensure_activating_triggers_read (shared_ptr<PackageMetaData> mda
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		/* Transactionality */
 		mdata->activated_triggers = nullopt;
@@ -2060,11 +2279,11 @@ void PackageDB::activate_trigger(const string& trigger)
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb,
+		int err = prepare_cached (
 				"insert into triggers_activated "
 				"(trigger) values (?1) "
 				"on conflict do nothing;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -2077,13 +2296,13 @@ void PackageDB::activate_trigger(const string& trigger)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -2097,9 +2316,9 @@ vector<string> PackageDB::get_activated_triggers ()
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb,
+		int err = prepare_cached (
 				"select trigger from triggers_activated;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -2125,13 +2344,13 @@ vector<string> PackageDB::get_activated_triggers ()
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -2148,11 +2367,12 @@ vector<tuple<string, int, VersionNumber>> PackageDB::find_packages_interested_in
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb,
-				"select pkg_name, pkg_architecture, pkg_version "
-				"from triggers_interest "
-				"where trigger = ?1;",
-				-1, &pStmt, nullptr);
+		int err = prepare_cached (
+				"select p.name, p.architecture, p.version "
+				"from triggers_interest t "
+				"join packages p on p.id = t.pkg_id "
+				"where t.trigger = ?1;",
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -2186,13 +2406,13 @@ vector<tuple<string, int, VersionNumber>> PackageDB::find_packages_interested_in
 			}
 		}
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -2207,10 +2427,10 @@ void PackageDB::clear_trigger (const string& trigger)
 
 	try
 	{
-		int err = sqlite3_prepare_v2 (pDb,
+		int err = prepare_cached (
 				"delete from triggers_activated "
 				"where trigger = ?1;",
-				-1, &pStmt, nullptr);
+				&pStmt);
 
 		if (err != SQLITE_OK)
 			throw sqlitedb_exception (err, pDb);
@@ -2223,13 +2443,13 @@ void PackageDB::clear_trigger (const string& trigger)
 		if (err != SQLITE_DONE)
 			throw sqlitedb_exception (err, pDb);
 
-		sqlite3_finalize (pStmt);
+		release_cached (pStmt);
 		pStmt = nullptr;
 	}
 	catch (...)
 	{
 		if (pStmt)
-			sqlite3_finalize (pStmt);
+			release_cached (pStmt);
 
 		throw;
 	}
@@ -9,6 +9,7 @@
 
 #include <exception>
 #include <list>
+#include <map>
 #include <vector>
 #include <memory>
 #include <string>
@@ -41,6 +42,30 @@ private:
 
 	sqlite3 *pDb = nullptr;
 
+	/* Prepared statements by SQL text. They are kept for the lifetime of the
+	 * connection such that each statement is compiled only once. */
+	std::map<std::string, sqlite3_stmt*, std::less<>> statements;
+
+	/* Like sqlite3_prepare_v2, but the statement is taken from the cache or
+	 * added to it. It must be handed back with release_cached instead of being
+	 * finalized, and may not be obtained again before that. */
+	int prepare_cached (const char* sql, sqlite3_stmt** ppStmt);
+
+	/* Reset the statement and clear its bindings */
+	void release_cached (sqlite3_stmt* pStmt);
+
+	/* Execute a statement without parameters and result */
+	void execute_cached (const char* sql);
+
+	void finalize_statements ();
+
+	/* An insert statement for rows of files with the package columns as
+	 * parameters 1 to 3, followed by path, type and digest of each row. */
+	static std::string insert_files_statement (size_t rows);
+
+	/* An insert statement for rows of paths, which ignores known ones */
+	static std::string insert_paths_statement (size_t rows);
+
 	/* Internals for settings triggers */
 	void set_interested_triggers (std::shared_ptr<PackageMetaData> mdata);
 	void set_activating_triggers (std::shared_ptr<PackageMetaData> mdata);
@@ -86,7 +111,8 @@ public:
 	void set_dependencies (std::shared_ptr<PackageMetaData> mdata);
 
 	/* Neither parameter may be nullptr. The latter can, however, be an empty
-	 * list. */
+	 * list. The files are replaced within a savepoint, hence either all or none
+	 * are stored. */
 	void set_files (std::shared_ptr<PackageMetaData> mdata, std::shared_ptr<FileList> files);
 	std::list<PackageDBFileEntry> get_files (std::shared_ptr<PackageMetaData> mdata);
 
@@ -94,7 +120,8 @@ public:
 			const std::string& path);
 
 	/* Neither parameter may be nullptr. The latter cann, howerver, be an empty
-	 * vector. The retrieved file list is sorted by ascending pathname (with
+	 * vector. Like set_files, the files are replaced within a savepoint. The
+	 * retrieved file list is sorted by ascending pathname (with
 	 * std::string::less). */
 	void set_config_files (std::shared_ptr<PackageMetaData> mdata,
 			std::shared_ptr<std::vector<std::string>> files);
@@ -120,8 +147,8 @@ public:
 	void clear_trigger (const std::string& trigger);
 
 
-	/* Delete a package version and all associated tuples. Does a lot, so it's
-	 * better to call this from within a transaction. */
+	/* Delete a package version and all associated tuples within a savepoint.
+	 * Does a lot, so it's better to call this from within a transaction. */
 	void delete_package (std::shared_ptr<PackageMetaData> mdata);
 
 
@@ -131,6 +158,15 @@ public:
 
 private:
 	void ensure_schema();
+
+	/* Create the relations of schema 2.0. Later versions are reached by
+	 * migrating from it, also for new databases. */
+	void create_schema();
+
+	/* Convert a database of schema 1.2 or 2.0 to the next version; must be
+	 * called within a transaction. */
+	void migrate_schema_1_2();
+	void migrate_schema_2_0();
 };
 
 
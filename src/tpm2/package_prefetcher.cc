@@ -0,0 +1,99 @@
+#include <system_error>
+#include "package_prefetcher.h"
+#include "common_utilities.h"
+
+using namespace std;
+
+
+PackagePrefetcher::PackagePrefetcher (vector<Job>&& jobs, unsigned n_threads,
+		unsigned window, unsigned writers)
+	:
+		jobs(move(jobs)), done(this->jobs.size(), false),
+		window(window), writers(writers)
+{
+	n_threads = MIN(n_threads, (unsigned) this->jobs.size());
+
+	try
+	{
+		for (unsigned i = 0; i < n_threads; i++)
+			threads.emplace_back (&PackagePrefetcher::run, this);
+	}
+	catch (system_error&)
+	{
+		/* Continue with the threads that could be created, or serially */
+	}
+}
+
+
+PackagePrefetcher::~PackagePrefetcher ()
+{
+	{
+		unique_lock<mutex> lk(m);
+		stop = true;
+	}
+
+	cv.notify_all();
+
+	for (auto& t : threads)
+		t.join();
+}
+
+
+void PackagePrefetcher::run ()
+{
+	unique_lock<mutex> lk(m);
+
+	for (;;)
+	{
+		cv.wait (lk, [this]() {
+			return stop || next_job >= jobs.size() ||
+				next_job < waited_for + window;
+		});
+
+		if (stop || next_job >= jobs.size())
+			return;
+
+		auto i = next_job++;
+		lk.unlock();
+
+		/* Errors are left to the installer */
+		try
+		{
+			auto& job = jobs[i];
+
+			if (!job.staging_dir.empty())
+				job.pp->stage_archive (job.staging_dir, writers);
+
+			job.pp->get_file_list();
+			job.pp->get_config_files();
+			job.pp->get_preinst();
+			job.pp->get_configure();
+			job.pp->get_unconfigure();
+			job.pp->get_postrm();
+		}
+		catch (exception&)
+		{
+		}
+
+		lk.lock();
+		done[i] = true;
+		cv.notify_all();
+	}
+}
+
+
+void PackagePrefetcher::wait (size_t i)
+{
+	if (threads.empty())
+		return;
+
+	unique_lock<mutex> lk(m);
+
+	if (i > waited_for)
+	{
+		waited_for = i;
+		cv.notify_all();
+	}
+
+	cv.wait (lk, [this, i]() { return done[i]; });
+}
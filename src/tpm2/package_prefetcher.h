@@ -0,0 +1,66 @@
+/** This file is part of the TSClient LEGACY Package Manager
+ *
+ * This module prepares packages for installation ahead of time. */
+
+#ifndef __PACKAGE_PREFETCHER_H
+#define __PACKAGE_PREFETCHER_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "package_provider.h"
+
+
+/* While the installer works through packages in order, a pool of threads
+ * prepares the upcoming ones: their archives are staged, which verifies the
+ * transport forms' digests, and their file lists, config files and maintainer
+ * scripts are loaded. Only a window of packages ahead of the one that the
+ * installer waits for is prepared, which bounds the space that staged archives
+ * take.
+ *
+ * A package that could not be prepared is left as it is, such that the
+ * installer reports the error when it does the work itself. */
+class PackagePrefetcher
+{
+public:
+	/* If staging_dir is empty, the archive is not staged. */
+	struct Job
+	{
+		std::shared_ptr<ProvidedPackage> pp;
+		std::string staging_dir;
+	};
+
+private:
+	std::vector<Job> jobs;
+	std::vector<bool> done;
+
+	unsigned window;
+	unsigned writers;
+
+	std::vector<std::thread> threads;
+
+	std::mutex m;
+	std::condition_variable cv;
+	size_t next_job = 0;
+	size_t waited_for = 0;
+	bool stop = false;
+
+	void run ();
+
+public:
+	/* @param writers is passed to ProvidedPackage::stage_archive. */
+	PackagePrefetcher (std::vector<Job>&& jobs, unsigned threads,
+			unsigned window, unsigned writers);
+
+	/* Waits for the jobs that are running */
+	~PackagePrefetcher ();
+
+	/* Wait until the package with index @param i in jobs has been prepared.
+	 * */
+	void wait (size_t i);
+};
+
+#endif /* __PACKAGE_PREFETCHER_H */
@@ -1,25 +1,130 @@
 #include <algorithm>
 #include <cerrno>
 #include <cstring>
+#include <filesystem>
 #include <system_error>
 #include <optional>
 #include "package_provider.h"
 #include "directory_repository.h"
 #include "common_utilities.h"
 #include "crypto_tools.h"
+#include "tar_extractor.h"
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 }
 
 using namespace std;
+namespace fs = std::filesystem;
 namespace tf = TransportForm;
 
 
+/* Computes the SHA256 digest of a transport form from the raw data that its
+ * SectionedReadStream reads. Parts of the file that the stream skips are read
+ * separately, such that the digest covers the entire file in order. */
+class StreamDigestCheck : public tf::SectionedReadStream::RawDataObserver
+{
+private:
+	int fd;
+	uint64_t file_size;
+	uint64_t hashed = 0;
+
+	unsigned char digest[32];
+	SHA256Context ctx;
+
+	void hash_file (uint64_t end);
+
+public:
+	StreamDigestCheck (const string& filename, const string& hex_digest);
+	~StreamDigestCheck ();
+
+	void observe (uint64_t offset, const char *data, size_t size) override;
+
+	/* Hash the rest of the file.
+	 * @returns true if the digest matches */
+	bool finish ();
+};
+
+
+StreamDigestCheck::StreamDigestCheck (const string& filename, const string& hex_digest)
+{
+	sha256_digest_from_hex (hex_digest, digest);
+
+	fd = open (filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw system_error (error_code (errno, generic_category()));
+
+	struct stat st;
+	if (fstat (fd, &st) < 0)
+	{
+		int err = errno;
+		close (fd);
+		throw system_error (error_code (err, generic_category()));
+	}
+
+	file_size = st.st_size;
+}
+
+StreamDigestCheck::~StreamDigestCheck ()
+{
+	close (fd);
+}
+
+void StreamDigestCheck::hash_file (uint64_t end)
+{
+	char buf[65536];
+
+	while (hashed < end)
+	{
+		ssize_t ret = pread (fd, buf, MIN((uint64_t) sizeof(buf), end - hashed), hashed);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			throw system_error (error_code (errno, generic_category()));
+		}
+
+		if (ret == 0)
+			throw system_error (error_code (ENODATA, generic_category()));
+
+		ctx.update (buf, ret);
+		hashed += ret;
+	}
+}
+
+void StreamDigestCheck::observe (uint64_t offset, const char *data, size_t size)
+{
+	/* Data that is read again after seeking backwards */
+	if (offset + size <= hashed)
+		return;
+
+	if (offset > hashed)
+		hash_file (offset);
+
+	auto skip = hashed - offset;
+	ctx.update (data + skip, size - skip);
+	hashed = offset + size;
+}
+
+bool StreamDigestCheck::finish ()
+{
+	hash_file (file_size);
+	return ctx.verify (digest);
+}
+
+
+static gp_exception digest_mismatch (const PackageMetaData& mdata)
+{
+	return gp_exception("SHA256 sum missmatch of package '" +
+			mdata.name + "@" + Architecture::to_string(mdata.architecture) +
+			":" + mdata.version.to_string() + "'");
+}
+
+
 ProvidedPackage::ProvidedPackage (
 		shared_ptr<PackageMetaData> mdata,
 		const tf::TableOfContents* toc,
@@ -50,6 +155,53 @@ ProvidedPackage::ProvidedPackage (
 }
 
 
+ProvidedPackage::~ProvidedPackage()
+{
+	discard_staged_archive();
+}
+
+
+bool ProvidedPackage::FileIdentity::operator==(const FileIdentity& o) const
+{
+	return dev == o.dev && ino == o.ino && size == o.size &&
+		ctime.tv_sec == o.ctime.tv_sec && ctime.tv_nsec == o.ctime.tv_nsec;
+}
+
+
+optional<ProvidedPackage::FileIdentity> ProvidedPackage::identify_file (
+		const string& filename)
+{
+	struct stat st;
+	if (stat (filename.c_str(), &st) < 0)
+		return nullopt;
+
+	return FileIdentity{st.st_dev, st.st_ino, st.st_size, st.st_ctim};
+}
+
+
+void ProvidedPackage::buffers_loaded()
+{
+	if (buffer_observer)
+		buffer_observer();
+}
+
+
+void ProvidedPackage::set_buffer_observer (function<void()> observer)
+{
+	buffer_observer = observer;
+}
+
+
+string ProvidedPackage::get_expected_digest()
+{
+	auto digest = index->get_digest(mdata->name, mdata->architecture, mdata->version);
+	if (!digest)
+		throw gp_exception("Digest for transport form is not in index given to ProvidedPackage");
+
+	return *digest;
+}
+
+
 void ProvidedPackage::ensure_read_stream()
 {
 	if (rs)
@@ -68,35 +220,38 @@ void ProvidedPackage::ensure_read_stream()
 
 	if (index)
 	{
-		/* Integrity check transport form */
-		auto digest = index->get_digest(mdata->name, mdata->architecture, mdata->version);
-		if (!digest)
-			throw gp_exception("Digest for transport form is not in index given to ProvidedPackage");
-
+		/* Integrity check transport form, unless it has been verified before
+		 * and did not change since. The identity is taken first, such that a
+		 * modification during hashing is detected next time. */
 		auto filename = tmp_rs->get_filename();
-		int fd = open(filename.c_str(), O_RDONLY);
-		if (fd < 0)
-			throw system_error(error_code(errno, generic_category()));
+		auto identity = identify_file (filename);
 
-		try
+		if (!identity || !verified_file || !(*identity == *verified_file))
 		{
-			if (!verify_sha256_fd(fd, *digest))
+			auto digest = get_expected_digest();
+
+			int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw system_error(error_code(errno, generic_category()));
+
+			try
 			{
-				throw gp_exception("SHA256 sum missmatch of package '" +
-						mdata->name + "@" + Architecture::to_string(mdata->architecture) +
-						":" + mdata->version.to_string() + "'");
+				if (!verify_sha256_fd(fd, digest))
+					throw digest_mismatch(*mdata);
 			}
-		}
-		catch(...)
-		{
+			catch(...)
+			{
+				close(fd);
+				throw;
+			}
+
 			close(fd);
-			throw;
+			verified_file = identity;
 		}
-
-		close(fd);
 	}
 
 	rs = tmp_rs;
+	buffers_loaded();
 }
 
 
@@ -146,10 +301,11 @@ const vector<string> &ProvidedPackage::get_files()
 		for (auto& file : *get_file_list())
 		{
 			if (file.type != FILE_TYPE_DIRECTORY)
-				file_paths.push_back(file.path);
+				file_paths.emplace_back(file.path);
 		}
 
 		file_paths_populated = true;
+		buffers_loaded();
 	}
 
 	return file_paths;
@@ -162,10 +318,11 @@ const vector<string> &ProvidedPackage::get_directories()
 		for (auto& file : *get_file_list())
 		{
 			if (file.type == FILE_TYPE_DIRECTORY)
-				directory_paths.push_back(file.path);
+				directory_paths.emplace_back(file.path);
 		}
 
 		directory_paths_populated = true;
+		buffers_loaded();
 	}
 
 	return directory_paths;
@@ -205,10 +362,12 @@ shared_ptr<FileList> ProvidedPackage::get_file_list()
 				}
 			}
 		}
-	}
 
-	if (!files)
-		files = make_shared<FileList>();
+		if (!files)
+			files = make_shared<FileList>();
+
+		buffers_loaded();
+	}
 
 	return files;
 }
@@ -256,6 +415,7 @@ shared_ptr<ManagedBuffer<char>> ProvidedPackage::get_preinst()
 
 				preinst = make_shared<ManagedBuffer<char>>(sec.size);
 				rs->read (preinst->buf, sec.size);
+				buffers_loaded();
 				break;
 			}
 		}
@@ -280,6 +440,7 @@ shared_ptr<ManagedBuffer<char>> ProvidedPackage::get_configure()
 
 				configure = make_shared<ManagedBuffer<char>>(sec.size);
 				rs->read (configure->buf, sec.size);
+				buffers_loaded();
 				break;
 			}
 		}
@@ -305,6 +466,7 @@ shared_ptr<ManagedBuffer<char>> ProvidedPackage::get_unconfigure()
 
 				unconfigure = make_shared<ManagedBuffer<char>>(sec.size);
 				rs->read (unconfigure->buf, sec.size);
+				buffers_loaded();
 				break;
 			}
 		}
@@ -329,6 +491,7 @@ shared_ptr<ManagedBuffer<char>> ProvidedPackage::get_postrm()
 
 				postrm = make_shared<ManagedBuffer<char>>(sec.size);
 				rs->read (postrm->buf, sec.size);
+				buffers_loaded();
 				break;
 			}
 		}
@@ -352,175 +515,224 @@ bool ProvidedPackage::has_archive ()
 }
 
 
-void ProvidedPackage::clear_buffers()
-{
-	rs = nullptr;
-	files = nullptr;
-	preinst = nullptr;
-	configure = nullptr;
-	unconfigure = nullptr;
-	postrm = nullptr;
-}
+/* An open read stream holds a decoder, whose state can be large */
+static const size_t READ_STREAM_BUFFER_SIZE = 1024 * 1024;
 
-
-void ProvidedPackage::unpack_archive_to_directory(const string& dst, vector<string>* excluded_paths)
+static size_t paths_memory_usage (const vector<string>& paths)
 {
-	size_t archive_size = 0;
+	size_t size = paths.capacity() * sizeof(string);
 
-	for (auto& sec : ensure_toc().sections)
+	/* Short paths are stored in the strings themselves */
+	for (auto& p : paths)
 	{
-		if (sec.type == tf::SEC_TYPE_ARCHIVE)
-		{
-			/* Seek to start of archive */
-			ensure_read_stream();
+		if (p.capacity() >= sizeof(string))
+			size += p.capacity() + 1;
+	}
 
-			if (rs->tell() != sec.start)
-				rs->seek (sec.start);
+	return size;
+}
 
-			archive_size = sec.size;
-			break;
-		}
-	}
+size_t ProvidedPackage::get_buffer_size() const
+{
+	size_t size = 0;
 
-	if (!archive_size)
-		return;
+	if (rs)
+		size += READ_STREAM_BUFFER_SIZE;
 
+	/* File lists from an index count as well, because the reference held
+	 * here keeps them alive even if the index's cache drops them. */
+	if (files)
+		size += files->memory_usage();
 
-	/* Construct a temporary file containing paths to exclude. */
-	optional<TemporaryFile> exclude_file;
-	if (excluded_paths && !excluded_paths->empty())
+	/* The paths copied by get_files and get_directories */
+	size += paths_memory_usage (file_paths);
+	size += paths_memory_usage (directory_paths);
+
+	for (auto& b : { preinst, configure, unconfigure, postrm })
 	{
-		exclude_file.emplace ("tpm2-excl");
+		if (b)
+			size += b->size;
+	}
 
-		for (auto& f : *excluded_paths)
-			exclude_file->append_string ("." + f + "\n");
+	return size;
+}
 
-		exclude_file->close();
-	}
 
+/* Reopening the read stream afterwards does not verify the transport form
+ * again if the file did not change, see verified_file. */
+void ProvidedPackage::clear_buffers()
+{
+	rs = nullptr;
+	files = nullptr;
 
-	/* Start Tar as subprocess */
-	int pipefds[2];
-	int ret = pipe (pipefds);
-	if (ret < 0)
-	{
-		fprintf (stderr, "Failed to create pipe.\n");
-		throw system_error (error_code (errno, generic_category()));
-	}
+	vector<string>().swap (file_paths);
+	vector<string>().swap (directory_paths);
+	file_paths_populated = false;
+	directory_paths_populated = false;
 
-	pid_t pid = fork ();
-	if (pid < 0)
-	{
-		close (pipefds[0]);
-		close (pipefds[1]);
+	preinst = nullptr;
+	configure = nullptr;
+	unconfigure = nullptr;
+	postrm = nullptr;
+}
 
-		fprintf (stderr, "Failed to fork.\n");
-		throw system_error (error_code (errno, generic_category()));
-	}
 
-	if (pid == 0)
+void ProvidedPackage::stage_archive (const string& dir, unsigned writers)
+{
+	discard_staged_archive();
+
+	/* If the transport form has not been opened yet, verify it while its
+	 * archive is read. Version 1 transport forms are compressed as a whole
+	 * and verified separately. */
+	shared_ptr<tf::ReadStream> tmp_rs = rs;
+	tf::SectionedReadStream* srs = nullptr;
+	unique_ptr<StreamDigestCheck> check;
+	optional<FileIdentity> identity;
+
+	if (!tmp_rs && index && get_read_stream)
 	{
-		/* This is an implicite copy, hence disable deleting the file on
-		 * destruction (usually the destructor won't be run anyway). */
-		if (exclude_file)
-			exclude_file->set_unowned();
+		tmp_rs = get_read_stream();
+		srs = dynamic_cast<tf::SectionedReadStream*>(tmp_rs.get());
 
-		/* In the child */
-		ret = dup2 (pipefds[0], STDIN_FILENO);
-		if (ret < 0)
+		if (srs)
 		{
-			fprintf (stderr, "Failed to replace stdin: %s.\n", strerror (errno));
-			exit (1);
-		}
-
-		close (pipefds[0]);
-		close (pipefds[1]);
+			identity = identify_file (tmp_rs->get_filename());
 
+			check = make_unique<StreamDigestCheck>(tmp_rs->get_filename(),
+					get_expected_digest());
 
-		/* Exclude files */
-		if (exclude_file)
-		{
-			execlp ("tar", "tar", "-xC", dst.c_str(),
-					"-X", exclude_file->path().c_str(), nullptr);
+			srs->set_raw_observer (check.get());
 		}
 		else
 		{
-			execlp ("tar", "tar", "-xC", dst.c_str(), nullptr);
+			tmp_rs = nullptr;
 		}
-
-		fprintf (stderr, "Failed to exec tar: %s.\n", strerror (errno));
-		exit (1);
 	}
 
+	if (!tmp_rs)
+	{
+		ensure_read_stream();
+		tmp_rs = rs;
+	}
 
-	/* Communicate */
-	close (pipefds[0]);
-	int write_end = pipefds[1];
-
-	size_t cnt_total = 0;
-	size_t to_read;
-	ssize_t cnt_written;
-	size_t pos;
-	char buf[8192];
+	if (mkdir (dir.c_str(), 0700) < 0)
+		throw system_error(error_code(errno, generic_category()), "Failed to create " + dir);
 
 	try
 	{
-		for (;;)
+		/* The TOC is only used by others after the digest matched */
+		optional<tf::TableOfContents> tmp_toc = toc;
+		if (!tmp_toc)
 		{
-			to_read = MIN (8192, archive_size - cnt_total);
-			rs->read (buf, to_read);
+			tmp_rs->seek(0);
+			tmp_toc = tf::TableOfContents::read_from_binary(*tmp_rs);
+		}
 
-			for (pos = 0; pos < to_read; pos++)
+		for (auto& sec : tmp_toc->sections)
+		{
+			if (sec.type == tf::SEC_TYPE_ARCHIVE && sec.size > 0)
 			{
-				cnt_written = write (write_end, buf + pos, to_read - pos);
-
-				if (cnt_written <= 0)
-				{
-					fprintf (stderr, "Failed to write to pipe\n");
-					throw system_error (error_code (errno, generic_category()));
-				}
-
-				pos += cnt_written;
+				tmp_rs->seek (sec.start);
+				staged_members = stage_tar_archive (*tmp_rs, sec.size, dir, writers);
+				break;
 			}
+		}
 
-			cnt_total += to_read;
+		if (check)
+		{
+			srs->set_raw_observer (nullptr);
 
-			if (cnt_total >= archive_size)
-			{
-				/* Safety guard */
-				if (cnt_total > archive_size)
-					throw gp_exception ("This must not have happened.");
+			if (!check->finish())
+				throw digest_mismatch(*mdata);
 
-				break;
-			}
+			verified_file = identity;
+			rs = tmp_rs;
+			toc = tmp_toc;
+			buffers_loaded();
 		}
+
+		/* Links could redirect files out of the staging directory, hence
+		 * they are only created once the archive is known to be genuine. */
+		link_staged_archive (dir, staged_members);
 	}
 	catch (...)
 	{
-		close (write_end);
+		if (srs)
+			srs->set_raw_observer (nullptr);
+
+		staged_members.clear();
+
+		error_code ec;
+		fs::remove_all (dir, ec);
 		throw;
 	}
 
-	close (write_end);
+	staging_dir = dir;
+}
+
+
+bool ProvidedPackage::is_staged() const
+{
+	return !staging_dir.empty();
+}
+
 
+void ProvidedPackage::discard_staged_archive()
+{
+	if (staging_dir.empty())
+		return;
+
+	error_code ec;
+	fs::remove_all (staging_dir, ec);
+
+	staging_dir.clear();
+	staged_members.clear();
+}
 
-	/* Wait for Tar */
-	int wstatus;
 
-	if (waitpid (pid, &wstatus, 0) < 0)
+void ProvidedPackage::unpack_archive_to_directory(const string& dst,
+		const unordered_set<string>* excluded_paths, unsigned writers, bool sync)
+{
+	if (!staging_dir.empty())
 	{
-		fprintf (stderr, "Failed to wait for Tar to finish\n");
-		throw system_error (error_code (errno, generic_category()));
+		bool committed = commit_staged_archive (staging_dir, staged_members, dst,
+				excluded_paths, sync);
+
+		discard_staged_archive();
+
+		/* Otherwise extract the verified archive again across filesystems.
+		 * The installer does not stage packages whose top-level directories
+		 * are on another filesystem, hence this is rare. */
+		if (committed)
+			return;
+	}
+
+	uint64_t archive_size = 0;
+
+	for (auto& sec : ensure_toc().sections)
+	{
+		if (sec.type == tf::SEC_TYPE_ARCHIVE)
+		{
+			/* Seek to start of archive */
+			ensure_read_stream();
+
+			if (rs->tell() != sec.start)
+				rs->seek (sec.start);
+
+			archive_size = sec.size;
+			break;
+		}
 	}
 
-	int exit_code = WEXITSTATUS (wstatus);
-	if (exit_code != 0)
-		throw invalid_argument ("Tar returned abnormally: " + to_string (exit_code));
+	if (!archive_size)
+		return;
+
+	extract_tar_archive (*rs, archive_size, dst, excluded_paths, writers, sync);
 }
 
 
 PackageProvider::PackageProvider (shared_ptr<Parameters> params)
-	: params(params)
+	: params(params), buffers(DEFAULT_BUFFER_BUDGET)
 {
 	/* Create repositories */
 	for (auto& repo : params->repos)
@@ -545,14 +757,75 @@ shared_ptr<PackageProvider> PackageProvider::create (shared_ptr<Parameters> para
 }
 
 
-set<VersionNumber> PackageProvider::list_package_versions (const string& name, const int architecture)
+PackageProvider::~PackageProvider ()
+{
+	for (auto& [key, e] : cache)
+		e.pkg->set_buffer_observer (nullptr);
+}
+
+
+static string package_key (const string& name, const int architecture)
+{
+	return name + "@" + Architecture::to_string (architecture);
+}
+
+
+void PackageProvider::prefetch (const vector<pair<string, int>>& packages)
 {
-	set<VersionNumber> vs;
+	map<int, vector<string>> missing;
+
+	for (auto& [name, arch] : packages)
+	{
+		if (resolved.find (package_key (name, arch)) == resolved.end())
+			missing[arch].push_back (name);
+	}
 
-	for (auto &r : repositories)
-		vs.merge (r->list_package_versions (name, architecture));
+	for (auto& [arch, names] : missing)
+	{
+		/* Packages that no repository has are resolved, too */
+		for (auto& name : names)
+			resolved.emplace (package_key (name, arch), ResolvedPackage());
+
+		for (auto& r : repositories)
+		{
+			for (auto& [name, versions] : r->get_packages (names, arch))
+			{
+				auto& rp = resolved[package_key (name, arch)];
+
+				for (auto& p : versions)
+				{
+					auto v = p.version;
+					rp.sources.emplace (v, make_pair (move (p), r.get()));
+				}
+			}
+		}
 
-	return vs;
+		for (auto& name : names)
+		{
+			auto& rp = resolved[package_key (name, arch)];
+			for (auto& [v, source] : rp.sources)
+				rp.versions.push_back (v);
+		}
+	}
+}
+
+
+const PackageProvider::ResolvedPackage& PackageProvider::resolve (
+		const string& name, const int architecture)
+{
+	auto i = resolved.find (package_key (name, architecture));
+	if (i != resolved.end())
+		return i->second;
+
+	prefetch ({ make_pair (name, architecture) });
+	return resolved.find (package_key (name, architecture))->second;
+}
+
+
+const vector<VersionNumber>& PackageProvider::list_package_versions (
+		const string& name, const int architecture)
+{
+	return resolve (name, architecture).versions;
 }
 
 
@@ -569,56 +842,83 @@ public:
 
 	shared_ptr<tf::ReadStream> operator()()
 	{
-		return make_shared<tf::GZReadStream>(filename);
+		return tf::open_read_stream (filename);
 	}
 };
 
+shared_ptr<ProvidedPackage> PackageProvider::create_package (const string& name,
+		const int architecture, const VersionNumber& version)
+{
+	auto& rp = resolve (name, architecture);
+
+	auto i = rp.sources.find (version);
+	if (i == rp.sources.end())
+		return nullptr;
+
+	auto& [p, r] = i->second;
+	ReadStreamFactory rsf(p.path);
+
+	/* A read stream can only be opened if it does not have to be digest
+	 * checked */
+	if (!p.index && !r->digest_checking_required())
+	{
+		auto rs = rsf();
+		auto rtf = tf::read_transport_form (*rs);
+
+		return make_shared<ProvidedPackage>(
+				rtf.mdata,
+				&rtf.toc, rs,
+				rsf,
+				nullptr,
+				true);
+	}
+	else if (p.index)
+	{
+		auto mdata = p.index->get_mdata(name, architecture, version);
+		if (!mdata)
+			throw gp_exception("Package not in index returned by repository");
+
+		return make_shared<ProvidedPackage>(
+				mdata,
+				nullptr, nullptr,
+				rsf,
+				p.index,
+				false);
+	}
+	else
+	{
+		throw gp_exception("Transport form '" + p.path +
+				"' requires digest checking but is not part of an index.");
+	}
+}
+
+
 shared_ptr<ProvidedPackage> PackageProvider::get_package (const string& name,
 		const int architecture, const VersionNumber& version)
 {
-	for (auto &r : repositories)
+	auto key = package_key (name, architecture) + ":" + version.to_string();
+
+	auto i = cache.find (key);
+	if (i == cache.end())
 	{
-		auto ret = r->get_package (name, architecture, version);
+		auto pkg = create_package (name, architecture, version);
+		if (!pkg)
+			return nullptr;
 
-		if (ret)
-		{
-			auto [filename, index] = *ret;
-			ReadStreamFactory rsf(filename);
+		i = cache.emplace (key, CacheEntry()).first;
+		i->second.pkg = pkg;
 
-			/* A read stream can only be opened if it does not have to be digest
-			 * checked */
-			if (!index && !r->digest_checking_required())
-			{
-				auto rs = rsf();
-				auto rtf = tf::read_transport_form (*rs);
-
-				return make_shared<ProvidedPackage>(
-						rtf.mdata,
-						&rtf.toc, rs,
-						rsf,
-						nullptr,
-						true);
-			}
-			else if (index)
-			{
-				auto mdata = index->get_mdata(name, architecture, version);
-				if (!mdata)
-					throw gp_exception("Package not in index returned by repository");
-
-				return make_shared<ProvidedPackage>(
-						mdata,
-						nullptr, nullptr,
-						rsf,
-						index,
-						false);
-			}
-			else
-			{
-				throw gp_exception("Transport form '" + filename +
-						"' requires digest checking but is not part of an index.");
-			}
-		}
+		/* Entries of an unordered_map do not move */
+		auto e = &i->second;
+		pkg->set_buffer_observer ([this, e]() { buffers.charge (*e); });
 	}
 
-	return nullptr;
+	/* Keeps the buffers of the package that is handed out */
+	buffers.touch (i->second);
+	return i->second.pkg;
+}
+
+void PackageProvider::set_buffer_budget (size_t budget)
+{
+	buffers.set_budget (budget);
 }
@@ -6,10 +6,13 @@
 #define __PACKAGE_PROVIDER_H
 
 #include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include "parameters.h"
@@ -22,6 +25,13 @@
 #include "package_version.h"
 #include "installation_package_version.h"
 #include "repo_index.h"
+#include "tar_extractor.h"
+#include "buffer_lru.h"
+
+extern "C" {
+#include <sys/types.h>
+#include <time.h>
+}
 
 
 /** Trust model: ProvidedPackage checks a digest contained in an authenticated
@@ -74,6 +84,33 @@ private:
 	std::shared_ptr<ManagedBuffer<char>> unconfigure;
 	std::shared_ptr<ManagedBuffer<char>> postrm;
 
+	/* An archive that has been extracted by stage_archive */
+	std::string staging_dir;
+	std::vector<StagedMember> staged_members;
+
+	/* The transport form as it was when its digest matched. If it is still
+	 * the same file when the read stream is reopened after clear_buffers, it
+	 * is not hashed again. The ctime cannot be set by users, hence it changes
+	 * if the file is modified. */
+	struct FileIdentity
+	{
+		dev_t dev;
+		ino_t ino;
+		off_t size;
+		struct timespec ctime;
+
+		bool operator==(const FileIdentity& o) const;
+	};
+
+	std::optional<FileIdentity> verified_file;
+
+	static std::optional<FileIdentity> identify_file (const std::string& filename);
+
+	/* Called after buffers have been loaded */
+	std::function<void()> buffer_observer;
+	void buffers_loaded();
+
+	std::string get_expected_digest();
 	void ensure_read_stream();
 	TransportForm::TableOfContents& ensure_toc();
 
@@ -93,6 +130,8 @@ public:
 			std::shared_ptr<RepoIndex> index,
 			bool disable_repo_digest_check);
 
+	~ProvidedPackage();
+
 	/* PackageVersion interface */
 	bool is_installed() const override;
 
@@ -102,8 +141,9 @@ public:
 	std::vector<std::pair<std::pair<std::string, int>, std::shared_ptr<const PackageConstraints::Formula>>>
 		get_pre_dependencies() override;
 
-	/* Because FileList is a set, these vectors are sorted in ascending order.
-	 * */
+	/* Because FileList is sorted, these vectors are sorted in ascending order.
+	 * They count as buffers, hence the references are valid only until
+	 * clear_buffers is called. */
 	const std::vector<std::string> &get_files() override;
 	const std::vector<std::string> &get_directories() override;
 
@@ -119,7 +159,7 @@ public:
 	 * list is simply empty. Files are sorted ascendingly by path. It's best to
 	 * first access get_file_list because the file index comes before the config
 	 * files in the transport form and hence avoids a potentially expensive seek
-	 * in a compressed archive. */
+	 * in a compressed archive (of version 1). */
 	std::shared_ptr<std::vector<std::string>> get_config_files();
 
 	/* These do only return something other than nullptr if the corresponding
@@ -133,19 +173,75 @@ public:
 
 	void clear_buffers();
 
-	/* Take care: This calls exec and does NOT close fds before! */
+	/* Approximate number of bytes held by the buffers that clear_buffers
+	 * releases */
+	size_t get_buffer_size() const;
+
+	/* @param observer is called after buffers have been loaded, possibly on
+	 * any thread that uses the package. */
+	void set_buffer_observer (std::function<void()> observer);
+
+	/* Extract the archive to the directory @param dir, which must not exist
+	 * yet, before anything else of the package is read. The files become
+	 * visible only when the archive is unpacked later.
+	 *
+	 * If the read stream has not been opened yet, the transport form's digest
+	 * is verified while the archive is extracted. This avoids reading the
+	 * file once more for verification. Until the digest has been verified,
+	 * no symlinks or hardlinks are created, such that nothing is written
+	 * outside of dir. If the digest does not match, dir is removed and
+	 * gp_exception is raised. */
+	void stage_archive (const std::string& dir, unsigned writers = 1);
+
+	bool is_staged() const;
+
+	/* Remove a staged archive that will not be unpacked */
+	void discard_staged_archive();
+
+	/* Extract the archive in-process, or move it from the staging directory
+	 * if it has been staged. Paths in excluded_paths (like "/etc/foo") are not
+	 * extracted. See extract_tar_archive for writers and sync. */
 	void unpack_archive_to_directory(
 			const std::string& dst,
-			std::vector<std::string>* excluded_paths);
+			const std::unordered_set<std::string>* excluded_paths,
+			unsigned writers = 1, bool sync = false);
 };
 
 
 class PackageProvider
 {
+public:
+	static const size_t DEFAULT_BUFFER_BUDGET = 128 * 1024 * 1024;
+
 private:
 	std::shared_ptr<Parameters> params;
 	std::vector<std::shared_ptr<Repository>> repositories;
 
+	/* The versions of a package in all repositories, resolved once. Each
+	 * version comes from the first repository that has it. */
+	struct ResolvedPackage
+	{
+		std::vector<VersionNumber> versions;
+		std::map<VersionNumber, std::pair<RepositoryPackage, Repository*>> sources;
+	};
+
+	std::unordered_map<std::string, ResolvedPackage> resolved;
+
+	const ResolvedPackage& resolve (const std::string& name, const int architecture);
+
+	/* Packages are cached for the provider's lifetime, such that repeated
+	 * lookups (e.g. by the solver) return the same instance with its buffers.
+	 * If the buffers of all packages exceed the budget, those of the least
+	 * recently used packages are cleared when a package is handed out. Buffers
+	 * are accounted when they are loaded. */
+	using CacheEntry = BufferLRU<ProvidedPackage>::Entry;
+
+	std::unordered_map<std::string, CacheEntry> cache;
+	BufferLRU<ProvidedPackage> buffers;
+
+	std::shared_ptr<ProvidedPackage> create_package (
+			const std::string& name, const int architecture, const VersionNumber& version);
+
 	/* Constructor */
 	PackageProvider (std::shared_ptr<Parameters> params);
 
@@ -153,10 +249,25 @@ public:
 	/* Creator */
 	static std::shared_ptr<PackageProvider> create (std::shared_ptr<Parameters> params);
 
-	std::set<VersionNumber> list_package_versions (const std::string& name, const int architecture);
+	/* Packages handed out may outlive the provider */
+	~PackageProvider ();
 
+	/* Resolve the versions of many packages with one query per repository and
+	 * architecture, such that later lookups of them are answered from memory.
+	 * */
+	void prefetch (const std::vector<std::pair<std::string, int>>& packages);
+
+	/* The versions are sorted in ascending order. */
+	const std::vector<VersionNumber>& list_package_versions (
+			const std::string& name, const int architecture);
+
+	/* Returns the same instance for each package on every call, or nullptr
+	 * if no repository has the package. */
 	std::shared_ptr<ProvidedPackage> get_package (
 			const std::string& name, const int architecture, const VersionNumber& version);
+
+	/* In bytes; clears buffers immediately if they exceed the new budget. */
+	void set_buffer_budget (size_t budget);
 };
 
 
@@ -125,6 +125,21 @@ bool read_config_file (shared_ptr<Parameters> params)
 				return false;
 			}
 		}
+		else if (strcmp (n, "unpack_threads") == 0)
+		{
+			unsigned value;
+
+			if (ce->QueryUnsignedText (&value) != XML_SUCCESS || value == 0 || value > 256)
+			{
+				fprintf (stderr,
+						"Invalid number of unpack threads in config file on line %d.\n",
+						ce->GetLineNum());
+
+				return false;
+			}
+
+			params->unpack_threads = value;
+		}
 		else if (strcmp (n, "repo") == 0)
 		{
 			const char *tmp = ce->Attribute ("type");
@@ -77,6 +77,13 @@ struct Parameters
 	/* Verbose output */
 	bool verbose = false;
 
+	/* Number of threads that write files while unpacking packages; 0 chooses
+	 * a number based on the CPU count. Can be set in the config file. */
+	unsigned unpack_threads = 0;
+
+	/* Sync the filesystem after unpacking each package */
+	bool sync = false;
+
 	/* Depres2 debug log */
 	bool depres2_debug_log = false;
 
@@ -84,6 +91,9 @@ struct Parameters
 	std::string create_index_repo;
 	std::string create_index_name = "index";
 
+	/* Create indexes in the old text format (version 1) for older clients */
+	bool create_index_v1 = false;
+
 	/* Key file name behind --sign */
 	std::string sign;
 
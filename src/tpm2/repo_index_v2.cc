@@ -0,0 +1,164 @@
+#include <map>
+#include "repo_index_v2.h"
+#include "common_utilities.h"
+
+using namespace std;
+
+
+namespace RepoIndexV2
+{
+
+/* Builds the string table; each distinct string is stored once. */
+class StringTable
+{
+protected:
+	string table;
+	map<string, uint32_t> offsets;
+
+public:
+	/* Append a reference to s to rec */
+	void put (string& rec, const string& s)
+	{
+		auto i = offsets.find(s);
+		if (i == offsets.end())
+		{
+			if (table.size() + s.size() > UINT32_MAX)
+				throw gp_exception("The index's string table is too large");
+
+			i = offsets.emplace(s, table.size()).first;
+			table += s;
+		}
+
+		put_u32(rec, i->second);
+		put_u32(rec, s.size());
+	}
+
+	const string& get_table() const
+	{
+		return table;
+	}
+};
+
+
+string build_package_list (int arch, const vector<PackageVersion>& pkgs,
+		const string& file_index_name)
+{
+	StringTable strings;
+	string packages, versions, dependencies, triggers;
+	uint32_t n_packages = 0, n_dependencies = 0, n_triggers = 0;
+
+	for (size_t i = 0; i < pkgs.size(); i++)
+	{
+		auto& mdata = *pkgs[i].mdata;
+
+		if (mdata.architecture != arch)
+		{
+			throw gp_exception("Package '" + mdata.name +
+					"' is for a different architecture");
+		}
+
+		if (i == 0 || pkgs[i - 1].mdata->name != mdata.name)
+		{
+			size_t cnt_versions = 1;
+			while (i + cnt_versions < pkgs.size() &&
+					pkgs[i + cnt_versions].mdata->name == mdata.name)
+			{
+				cnt_versions++;
+			}
+
+			strings.put(packages, mdata.name);
+			put_u32(packages, i);
+			put_u32(packages, cnt_versions);
+			n_packages++;
+		}
+		else if (pkgs[i - 1].mdata->version == mdata.version)
+		{
+			throw gp_exception("Package version '" + mdata.name + ":" +
+					mdata.version.to_string() + "' is present multiple times");
+		}
+
+		strings.put(versions, mdata.version.to_string());
+		strings.put(versions, mdata.source_version.to_string());
+		versions.append((const char*) pkgs[i].digest, sizeof(pkgs[i].digest));
+		put_u64(versions, pkgs[i].file_list_offset);
+		put_u64(versions, pkgs[i].file_list_size);
+
+		put_u32(versions, n_dependencies);
+		put_u32(versions, mdata.pre_dependencies.dependencies.size());
+		put_u32(versions, mdata.dependencies.dependencies.size());
+
+		for (auto dl : { &mdata.pre_dependencies, &mdata.dependencies })
+		{
+			for (auto& dep : dl->dependencies)
+			{
+				strings.put(dependencies, dep.get_name());
+				put_u32(dependencies, dep.get_architecture());
+				strings.put(dependencies, dep.version_formula ?
+						dep.version_formula->to_string() : string());
+
+				n_dependencies++;
+			}
+		}
+
+		if (!mdata.interested_triggers || !mdata.activated_triggers)
+		{
+			throw gp_exception("Package '" + mdata.name +
+					"' has no trigger lists");
+		}
+
+		put_u32(versions, n_triggers);
+		put_u32(versions, mdata.interested_triggers->size());
+		put_u32(versions, mdata.activated_triggers->size());
+
+		for (auto tl : { &*mdata.interested_triggers, &*mdata.activated_triggers })
+		{
+			for (auto& trg : *tl)
+			{
+				strings.put(triggers, trg);
+				n_triggers++;
+			}
+		}
+
+		versions.append((const char*) pkgs[i].file_list_digest,
+				sizeof(pkgs[i].file_list_digest));
+	}
+
+	/* Header */
+	string file_index_name_ref;
+	strings.put(file_index_name_ref, file_index_name);
+
+	string list(MAGIC, sizeof(MAGIC) - 1);
+	list.resize(MAGIC_SIZE, '\0');
+
+	uint64_t pos = HEADER_SIZE;
+
+	put_u32(list, arch);
+	put_u32(list, n_packages);
+	put_u32(list, pkgs.size());
+	put_u32(list, n_dependencies);
+	put_u32(list, n_triggers);
+	put_u32(list, 0);
+
+	for (auto t : { &packages, &versions, &dependencies, &triggers })
+	{
+		put_u64(list, pos);
+		pos += t->size();
+	}
+
+	put_u64(list, pos);
+	put_u64(list, strings.get_table().size());
+	list += file_index_name_ref;
+
+	if (list.size() != HEADER_SIZE)
+		throw gp_exception("Invalid index header size");
+
+	list += packages;
+	list += versions;
+	list += dependencies;
+	list += triggers;
+	list += strings.get_table();
+
+	return list;
+}
+
+}
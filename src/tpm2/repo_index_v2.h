@@ -0,0 +1,133 @@
+/** Layout of version 2 of directory repository indexes
+ *
+ * The package list of a version 2 index is a binary file that is used in place
+ * through a memory mapping. It starts with a fixed header, followed by tables
+ * of fixed size records and a string table. All integers are little endian;
+ * strings are referenced by their offset in the string table (u32) followed by
+ * their length (u32). An optional signature follows the data like in version
+ * 1. */
+#ifndef __REPO_INDEX_V2_H
+#define __REPO_INDEX_V2_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "package_meta_data.h"
+
+extern "C" {
+#include <endian.h>
+}
+
+namespace RepoIndexV2
+{
+	/* The first line is the same for all versions, padded with zeros to 24
+	 * bytes. */
+	const char MAGIC[] = "tpm_repo_index 2.0\n";
+	const size_t MAGIC_SIZE = 24;
+
+	/* Header:
+	 *     0  magic
+	 *    24  architecture: u32
+	 *    28  number of packages: u32
+	 *    32  number of versions: u32
+	 *    36  number of dependencies: u32
+	 *    40  number of triggers: u32
+	 *    44  reserved, 0: u32
+	 *    48  offset of the package table: u64
+	 *    56  offset of the version table: u64
+	 *    64  offset of the dependency table: u64
+	 *    72  offset of the trigger table: u64
+	 *    80  offset of the string table: u64
+	 *    88  size of the string table: u64
+	 *    96  file name of the file index: string */
+	const size_t HEADER_SIZE = 104;
+
+	/* Package record, ordered by name (bytewise):
+	 *     0  name: string
+	 *     8  index of the first version: u32
+	 *    12  number of versions: u32 */
+	const size_t PACKAGE_SIZE = 16;
+
+	/* Version record; the versions of a package are adjacent and ascending:
+	 *     0  version: string
+	 *     8  source version: string
+	 *    16  SHA256 digest of the transport form: 32 bytes
+	 *    48  offset of the file list in the file index: u64
+	 *    56  size of the file list: u64
+	 *    64  index of the first dependency: u32
+	 *    68  number of pre-dependencies: u32
+	 *    72  number of dependencies, which follow the pre-dependencies: u32
+	 *    76  index of the first trigger: u32
+	 *    80  number of interested triggers: u32
+	 *    84  number of activated triggers, which follow the others: u32
+	 *    88  SHA256 digest of the file list: 32 bytes
+	 *
+	 * The file index is the concatenation of all file lists. Each file list
+	 * is verified on its own when it is read, hence the index can be opened
+	 * without reading the entire file index. */
+	const size_t VERSION_SIZE = 120;
+
+	/* Dependency record:
+	 *     0  name: string
+	 *     8  architecture: u32
+	 *    12  version formula as of Formula::to_string, empty if none: string */
+	const size_t DEPENDENCY_SIZE = 20;
+
+	/* Trigger record:
+	 *     0  name: string */
+	const size_t TRIGGER_SIZE = 8;
+
+
+	/* A package version to store in an index */
+	struct PackageVersion
+	{
+		std::shared_ptr<PackageMetaData> mdata;
+		unsigned char digest[32];
+
+		uint64_t file_list_offset = 0;
+		uint64_t file_list_size = 0;
+		unsigned char file_list_digest[32];
+	};
+
+	/* Build the package list of a version 2 index (without signature) for
+	 * the package versions @param versions, which must be ordered by name and
+	 * version and have architecture @param arch.
+	 *
+	 * @raises gp_exception if a package version is present multiple times or
+	 *         the index would be too large. */
+	std::string build_package_list (int arch,
+			const std::vector<PackageVersion>& versions,
+			const std::string& file_index_name);
+
+
+	inline uint32_t get_u32 (const char* p)
+	{
+		uint32_t v;
+		memcpy (&v, p, sizeof(v));
+		return le32toh (v);
+	}
+
+	inline uint64_t get_u64 (const char* p)
+	{
+		uint64_t v;
+		memcpy (&v, p, sizeof(v));
+		return le64toh (v);
+	}
+
+	inline void put_u32 (std::string& s, uint32_t v)
+	{
+		v = htole32 (v);
+		s.append ((const char*) &v, sizeof(v));
+	}
+
+	inline void put_u64 (std::string& s, uint64_t v)
+	{
+		v = htole64 (v);
+		s.append ((const char*) &v, sizeof(v));
+	}
+}
+
+#endif /* __REPO_INDEX_V2_H */
@@ -6,9 +6,11 @@
 #include <filesystem>
 #include <vector>
 #include "common_utilities.h"
+#include "crypto_tools.h"
 #include "utility.h"
 #include "transport_form.h"
 #include "managed_buffer.h"
+#include "repo_index_v2.h"
 #include "repo_tools.h"
 
 extern "C"
@@ -54,7 +56,120 @@ void write_string (int fd, const string& buf, const char* error_msg = nullptr)
 }
 
 
-void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
+/* Create a new file index in directory p with a unique name, which is stored
+ * in findex_name.
+ * @returns a file descriptor of the file index */
+int create_file_index (const fs::path& p, string& findex_name)
+{
+	char buf[100];
+
+	struct timespec tnow;
+	struct tm tm;
+	if (clock_gettime (CLOCK_REALTIME, &tnow) < 0)
+		throw system_error(error_code(errno, generic_category()));
+
+	strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmtime_r(&tnow.tv_sec, &tm));
+	snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+			"%06d.files", (int) tnow.tv_nsec / 1000);
+
+	findex_name = buf;
+	fs::path findex_path = p / findex_name;
+	int findex = open (findex_path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+	if (findex < 0)
+	{
+		fprintf (stderr, "Could not create '%s'.\n", findex_path.c_str());
+		throw system_error(error_code(errno, generic_category()));
+	}
+
+	return findex;
+}
+
+
+/* Append a signature of the package list's content to it */
+void sign_package_list (shared_ptr<Parameters> params, int plist,
+		RSA* signing_key, const string& signing_key_name)
+{
+	char buf[1024];
+
+	printf_verbose(params, "  Signing package list...\n");
+
+	EVP_PKEY* pkey = nullptr;
+	EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
+	if (!md_ctx)
+		throw bad_alloc();
+
+	try
+	{
+		pkey = EVP_PKEY_new();
+		if (!pkey)
+			throw bad_alloc();
+
+		if (EVP_PKEY_set1_RSA(pkey, signing_key) <= 0)
+			throw gp_exception("EVP_PKEY_set1_RSA failed");
+
+		if (EVP_DigestSignInit(md_ctx, nullptr, EVP_sha256(), nullptr, pkey) <= 0)
+			throw gp_exception("EVP_DigestSignInit failed");
+
+		/* Process package list */
+		if (lseek(plist, 0, SEEK_SET) < 0)
+			throw system_error(error_code(errno, generic_category()));
+
+		for (;;)
+		{
+			auto ret = read(plist, buf, sizeof(buf));
+			if (ret < 0)
+				throw system_error(error_code(errno, generic_category()));
+
+			if (ret == 0)
+			{
+				if (errno == EINTR)
+					continue;
+				else
+					break;
+			}
+
+			if (EVP_DigestSignUpdate(md_ctx, buf, ret) <= 0)
+				throw gp_exception("EVP_DigestSignUpdate failed");
+		}
+
+		size_t siglen;
+		if (EVP_DigestSignFinal(md_ctx, nullptr, &siglen) <= 0)
+			throw gp_exception("EVP_DigestSignFinal failed");
+
+		ManagedBuffer<unsigned char> sig(siglen);
+		if (EVP_DigestSignFinal(md_ctx, sig.buf, &siglen) <= 0)
+			throw gp_exception("EVP_DigestSignFinal failed");
+
+		/* Append signature */
+		write_string(plist, "\nRSA Signature with key: " + signing_key_name + "\n");
+		for (size_t i = 0; i < siglen;)
+		{
+			auto to_write = min((size_t) 36, siglen - i);
+
+			for (unsigned j = 0; j < to_write; j++)
+				snprintf(buf + j*2, 10, "%02x", (unsigned int) sig.buf[i++]);
+
+			buf[to_write * 2] = '\n';
+			buf[to_write * 2 + 1] = '\0';
+			write_string(plist, buf);
+		}
+
+		EVP_PKEY_free(pkey);
+		EVP_MD_CTX_free(md_ctx);
+	}
+	catch(...)
+	{
+		if (pkey)
+			EVP_PKEY_free(pkey);
+
+		EVP_MD_CTX_free(md_ctx);
+		throw;
+	}
+}
+
+
+void create_index_arch_v1 (shared_ptr<Parameters> params, const fs::path& p,
 		const string& name, RSA* signing_key = nullptr, const string& signing_key_name = string())
 {
 	char buf[max(10240, EVP_MAX_MD_SIZE)];
@@ -74,24 +189,8 @@ void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
 		}
 
 		/* Create file index with a unique name */
-		struct timespec tnow;
-		struct tm tm;
-		if (clock_gettime (CLOCK_REALTIME, &tnow) < 0)
-			throw system_error(error_code(errno, generic_category()));
-
-		strftime(buf, sizeof(buf), "%Y%m%d%H%M%S", gmtime_r(&tnow.tv_sec, &tm));
-		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
-				"%06d.files", (int) tnow.tv_nsec / 1000);
-
-		string findex_name(buf);
-		fs::path findex_path = p / findex_name;
-		findex = open (findex_path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
-
-		if (findex < 0)
-		{
-			fprintf (stderr, "Could not create '%s'.\n", findex_path.c_str());
-			throw system_error(error_code(errno, generic_category()));
-		}
+		string findex_name;
+		findex = create_file_index (p, findex_name);
 
 		/* Write package list header */
 		printf_verbose (params, "  Writing package list header...\n");
@@ -122,7 +221,7 @@ void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
 
 			/* Read package meta data */
 			{
-				auto rs = make_shared<tf::GZReadStream>(entry.path());
+				auto rs = tf::open_read_stream (entry.path());
 				auto rtf = tf::read_transport_form (*rs);
 
 				pkgs.push_back(rtf.mdata);
@@ -274,7 +373,7 @@ void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
 					pkg->version.to_string() + "_" +
 					Architecture::to_string(pkg->architecture) + ".tpm2");
 
-			auto rs = make_shared<tf::GZReadStream>(tfp);
+			auto rs = tf::open_read_stream (tfp);
 			auto rtf = tf::read_transport_form (*rs);
 
 			tf::TOCSection* ind_sec = nullptr;
@@ -300,12 +399,10 @@ void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
 				rs->seek(ind_sec->start);
 
 				/* Copy file index from the transport form */
-				ssize_t total_written = 0;
+				uint64_t total_written = 0;
 				while (total_written < ind_sec->size)
 				{
-					int to_process = ind_sec->size - total_written;
-					if (to_process > (int) sizeof(buf))
-						to_process = sizeof(buf);
+					int to_process = MIN (ind_sec->size - total_written, (uint64_t) sizeof(buf));
 
 					rs->read(buf, to_process);
 
@@ -411,83 +508,163 @@ void create_index_arch (shared_ptr<Parameters> params, const fs::path& p,
 
 		/* Optionally sign the package list */
 		if (signing_key)
+			sign_package_list (params, plist, signing_key, signing_key_name);
+
+
+		close (plist);
+		close (findex);
+		plist = -1;
+		findex = -1;
+
+		/* Swap the new package list in */
+		printf_verbose(params, "  moving the new index into place.\n");
+		if (rename (plist_path.c_str(), (p / (name + ".index")).c_str()) < 0)
+			throw system_error(error_code(errno, generic_category()));
+	}
+	catch(...)
+	{
+		if (plist >= 0)
+			close (plist);
+
+		if (findex >= 0)
+			close (findex);
+
+		throw;
+	}
+}
+
+
+void create_index_arch_v2 (shared_ptr<Parameters> params, const fs::path& p,
+		const string& name, RSA* signing_key = nullptr, const string& signing_key_name = string())
+{
+	namespace v2 = RepoIndexV2;
+
+	char buf[10240];
+	int plist = -1;
+	int findex = -1;
+
+	try
+	{
+		int arch = Architecture::from_string(p.filename().c_str());
+
+		/* Create package list file */
+		fs::path plist_path = p / (name + ".index.new");
+		plist = open (plist_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+
+		if (plist < 0)
 		{
-			printf_verbose(params, "  Signing package list...\n");
+			fprintf (stderr, "Could not create '%s'.\n", plist_path.c_str());
+			throw system_error(error_code(errno, generic_category()));
+		}
 
-			EVP_PKEY* pkey = nullptr;
-			EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
-			if (!md_ctx)
-				throw bad_alloc();
+		/* Create file index with a unique name */
+		string findex_name;
+		findex = create_file_index (p, findex_name);
 
-			try
-			{
-				pkey = EVP_PKEY_new();
-				if (!pkey)
-					throw bad_alloc();
+		/* Read all packages and copy their file lists to the file index */
+		vector<v2::PackageVersion> pkgs;
+		uint64_t findex_size = 0;
 
-				if (EVP_PKEY_set1_RSA(pkey, signing_key) <= 0)
-					throw gp_exception("EVP_PKEY_set1_RSA failed");
+		for (auto& entry : fs::directory_iterator(p))
+		{
+			if (!entry.is_regular_file())
+				continue;
 
-				if (EVP_DigestSignInit(md_ctx, nullptr, EVP_sha256(), nullptr, pkey) <= 0)
-					throw gp_exception("EVP_DigestSignInit failed");
+			auto filename = entry.path().filename();
+			if (filename.extension() != ".tpm2")
+				continue;
 
-				/* Process package list */
-				if (lseek(plist, 0, SEEK_SET) < 0)
-					throw system_error(error_code(errno, generic_category()));
+			printf_verbose (params, "    Processing transport form %s...\n", filename.c_str());
 
-				for (;;)
+			v2::PackageVersion e;
+			SHA256Context file_list_ctx;
+
+			{
+				auto rs = tf::open_read_stream (entry.path());
+				auto rtf = tf::read_transport_form (*rs);
+
+				if (rtf.mdata->architecture != arch)
 				{
-					auto ret = read(plist, buf, sizeof(buf));
-					if (ret < 0)
-						throw system_error(error_code(errno, generic_category()));
+					throw gp_exception("'" + entry.path().string() +
+							"' is for a different architecture");
+				}
 
-					if (ret == 0)
+				e.mdata = rtf.mdata;
+
+				for (auto& sec : rtf.toc.sections)
+				{
+					if (sec.type != tf::SEC_TYPE_FILE_INDEX)
+						continue;
+
+					rs->seek(sec.start);
+
+					e.file_list_offset = findex_size;
+					e.file_list_size = sec.size;
+
+					for (uint64_t copied = 0; copied < sec.size;)
 					{
-						if (errno == EINTR)
-							continue;
-						else
-							break;
+						auto to_copy = MIN(sec.size - copied, (uint64_t) sizeof(buf));
+
+						rs->read(buf, to_copy);
+						write_string(findex, string(buf, to_copy));
+						file_list_ctx.update(buf, to_copy);
+						copied += to_copy;
 					}
 
-					if (EVP_DigestSignUpdate(md_ctx, buf, ret) <= 0)
-						throw gp_exception("EVP_DigestSignUpdate failed");
+					findex_size += sec.size;
+					break;
 				}
+			}
 
-				size_t siglen;
-				if (EVP_DigestSignFinal(md_ctx, nullptr, &siglen) <= 0)
-					throw gp_exception("EVP_DigestSignFinal failed");
+			file_list_ctx.finish(e.file_list_digest);
 
-				ManagedBuffer<unsigned char> sig(siglen);
-				if (EVP_DigestSignFinal(md_ctx, sig.buf, &siglen) <= 0)
-					throw gp_exception("EVP_DigestSignFinal failed");
+			/* SHA256 digest of the transport form */
+			int fd = open (entry.path().c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				throw system_error(error_code(errno, generic_category()));
+
+			try
+			{
+				SHA256Context ctx;
 
-				/* Append signature */
-				write_string(plist, "\nRSA Signature with key: " + signing_key_name + "\n");
-				for (size_t i = 0; i < siglen;)
+				for (;;)
 				{
-					auto to_write = min((size_t) 36, siglen - i);
+					auto ret = read (fd, buf, sizeof(buf));
+					if (ret < 0)
+						throw system_error(error_code(errno, generic_category()));
 
-					for (unsigned j = 0; j < to_write; j++)
-						snprintf(buf + j*2, 10, "%02x", (unsigned int) sig.buf[i++]);
+					if (ret == 0)
+						break;
 
-					buf[to_write * 2] = '\n';
-					buf[to_write * 2 + 1] = '\0';
-					write_string(plist, buf);
+					ctx.update(buf, ret);
 				}
 
-				EVP_PKEY_free(pkey);
-				EVP_MD_CTX_free(md_ctx);
+				ctx.finish(e.digest);
+				close (fd);
 			}
-			catch(...)
+			catch (...)
 			{
-				if (pkey)
-					EVP_PKEY_free(pkey);
-
-				EVP_MD_CTX_free(md_ctx);
+				close (fd);
 				throw;
 			}
+
+			pkgs.push_back(move(e));
 		}
 
+		sort (pkgs.begin(), pkgs.end(), [](auto& a, auto& b) {
+			if (a.mdata->name != b.mdata->name)
+				return a.mdata->name < b.mdata->name;
+
+			return a.mdata->version < b.mdata->version;
+		});
+
+		printf_verbose (params, "  Writing package list...\n");
+		write_string (plist, v2::build_package_list(arch, pkgs, findex_name));
+
+		/* Optionally sign the package list */
+		if (signing_key)
+			sign_package_list (params, plist, signing_key, signing_key_name);
+
 
 		close (plist);
 		close (findex);
@@ -579,8 +756,16 @@ bool create_index (shared_ptr<Parameters> params)
 
 			try
 			{
-				create_index_arch (params, p, params->create_index_name,
-						signing_key, signing_key_name);
+				if (params->create_index_v1)
+				{
+					create_index_arch_v1 (params, p, params->create_index_name,
+							signing_key, signing_key_name);
+				}
+				else
+				{
+					create_index_arch_v2 (params, p, params->create_index_name,
+							signing_key, signing_key_name);
+				}
 			}
 			catch (exception& e)
 			{
@@ -5,15 +5,27 @@
 #ifndef __REPOSITORY_H
 #define __REPOSITORY_H
 
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
 #include <optional>
 #include <utility>
+#include <vector>
 #include "version_number.h"
 #include "repo_index.h"
 
 
+/* A version of a package in a repository, with what get_package returns for
+ * it */
+struct RepositoryPackage
+{
+	VersionNumber version;
+	std::string path;
+	std::shared_ptr<RepoIndex> index;
+};
+
+
 class Repository
 {
 public:
@@ -27,6 +39,12 @@ public:
 	virtual std::optional<std::pair<std::string, std::shared_ptr<RepoIndex>>> get_package (
 			const std::string& name, const int architecture, const VersionNumber& version) = 0;
 
+	/** Resolve many packages of one architecture in one call.
+	 * @returns  For each of @param names that the repository has, all its
+	 * 		versions like get_package would return them. */
+	virtual std::map<std::string, std::vector<RepositoryPackage>> get_packages (
+			const std::vector<std::string>& names, const int architecture) = 0;
+
 	/** @returns  true if the repository requires that packages are
 	 * digest-checked against checksums provided in an index. Actually this
 	 * information could be encoded in returning an index or not (and only
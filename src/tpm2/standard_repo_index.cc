@@ -1,11 +1,14 @@
 #include <cstdio>
 #include <cerrno>
 #include <cstring>
-#include <regex>
+#include <fstream>
+#include <sstream>
+#include <string_view>
 #include "common_utilities.h"
 #include "standard_repo_index.h"
 #include "package_meta_data.h"
 #include "crypto_tools.h"
+#include "repo_index_v2.h"
 #include "transport_form.h"
 
 extern "C" {
@@ -24,6 +27,65 @@ namespace fs = std::filesystem;
 namespace tf = TransportForm;
 
 
+/* Upper bound for the total size of cached file lists */
+static const size_t FILE_LIST_CACHE_SIZE = 64 * 1024 * 1024;
+
+/* Authenticated indexes are cached in the binary format of version 2 below the
+ * target. A cache file ends with the key of the index it was created from,
+ * the key's size (u64) and CACHE_MAGIC. */
+static const char INDEX_CACHE_DIR[] = "/var/lib/tpm/index-cache";
+static const char CACHE_MAGIC[] = "tpm2 index cache 1\n";
+
+
+/* Find the text of the element <tag> among the leading elements of a package
+ * description (name, arch and version must precede the dependencies) without
+ * parsing it. Returns false if the text is not found or might need a real
+ * XML parser, e.g. because it contains entities. */
+static bool find_element_text (string_view xml, const string& tag, string& text)
+{
+	auto end = min(xml.find("<pre-dependencies"), xml.find("<dependencies"));
+	xml = xml.substr(0, end);
+
+	auto start = xml.find("<" + tag + ">");
+	if (start == string_view::npos)
+		return false;
+
+	start += tag.size() + 2;
+
+	auto stop = xml.find('<', start);
+	if (stop == string_view::npos || xml.compare(stop, tag.size() + 3, "</" + tag + ">") != 0)
+		return false;
+
+	text = xml.substr(start, stop - start);
+
+	return !text.empty() && text.find_first_of("&<> \t\r\n") == string::npos;
+}
+
+
+/* Split a package specification of the form <name>@<arch>:<version> like in
+ * the directory of a file index. Architecture and version must not contain
+ * '@' or ':', the name may contain both. */
+static bool split_package_specification (string_view spec,
+		string_view& name, string_view& arch, string_view& version)
+{
+	auto at = spec.rfind('@');
+	if (at == string_view::npos || at == 0)
+		return false;
+
+	auto colon = spec.find(':', at + 1);
+	if (colon == string_view::npos || colon == at + 1 || colon + 1 == spec.size() ||
+			spec.find(':', colon + 1) != string_view::npos)
+	{
+		return false;
+	}
+
+	name = spec.substr(0, at);
+	arch = spec.substr(at + 1, colon - at - 1);
+	version = spec.substr(colon + 1);
+	return true;
+}
+
+
 StandardRepoIndex::StandardRepoIndex(shared_ptr<Parameters> params,const fs::path& index_path)
 	: params(params), index_path(index_path)
 {
@@ -230,6 +292,7 @@ void StandardRepoIndex::read(const bool require_signature)
 	try
 	{
 		const char required_first_line[] = "tpm_repo_index 1.0\n";
+		static_assert(sizeof(required_first_line) == sizeof(RepoIndexV2::MAGIC));
 
 		/* Check index version */
 		ssize_t ret = fread(buf, 1, sizeof(required_first_line), f);
@@ -237,11 +300,23 @@ void StandardRepoIndex::read(const bool require_signature)
 			throw system_error(error_code(errno, generic_category()));
 
 		buf[sizeof(required_first_line) - 1] = '\0';
-		if (feof(f) || strcmp(buf, required_first_line) != 0)
-			throw UnsupportedIndexVersion("Unsupported version (!= 1.0)");
+		if (!feof(f) && strcmp(buf, RepoIndexV2::MAGIC) == 0)
+			binary_index = true;
+		else if (feof(f) || strcmp(buf, required_first_line) != 0)
+			throw UnsupportedIndexVersion("Unsupported version (neither 1.0 nor 2.0)");
 
 		/* Read signature, if present */
 		auto sig = read_signature(f);
+
+		/* An unchanged index has been authenticated and cached before */
+		auto cache_key = get_cache_key(f, sig);
+		if (cache_key && (sig || !require_signature) && read_cached_index(*cache_key))
+		{
+			fclose(f);
+			index_read = true;
+			return;
+		}
+
 		if (sig)
 		{
 			auto& [key_name, sig_bytes, sig_len, data_end] = *sig;
@@ -254,6 +329,37 @@ void StandardRepoIndex::read(const bool require_signature)
 					"' has no signature but a signature is required.");
 		}
 
+		if (binary_index)
+		{
+			uint64_t data_size;
+
+			if (sig)
+			{
+				data_size = get<3>(*sig);
+			}
+			else
+			{
+				struct stat st;
+				if (fstat(fileno(f), &st) < 0)
+					throw system_error(error_code(errno, generic_category()));
+
+				data_size = st.st_size;
+			}
+
+			read_binary_index(f, data_size);
+
+			if (cache_key)
+			{
+				index_map->seek(0);
+				write_cached_index(*cache_key,
+						string(index_map->read_view(data_size), data_size));
+			}
+
+			fclose(f);
+			index_read = true;
+			return;
+		}
+
 		/* Read package list */
 		if (fseek(f, 0, SEEK_SET) < 0)
 			throw system_error(error_code(errno, generic_category()));
@@ -326,39 +432,71 @@ void StandardRepoIndex::read(const bool require_signature)
 							"': invalid package digest length");
 				}
 
-				auto mdata = read_package_meta_data_from_xml(pkg_buf.buf, pkg_len);
 				string digest(line_buffer, ret - 1);
 
+				/* Only the identity of the package is extracted here, the
+				 * description is parsed on demand. Unusual descriptions are
+				 * parsed right away. */
+				string_view xml(pkg_buf.buf, pkg_len);
+				string pkg_name, pkg_arch_str, pkg_version_str;
+				int pkg_arch = Architecture::invalid;
+				optional<VersionNumber> pkg_version;
+				shared_ptr<PackageMetaData> mdata;
+
+				if (find_element_text(xml, "name", pkg_name) &&
+						find_element_text(xml, "arch", pkg_arch_str) &&
+						find_element_text(xml, "version", pkg_version_str))
+				{
+					try
+					{
+						pkg_arch = Architecture::from_string(pkg_arch_str);
+						pkg_version = VersionNumber(pkg_version_str);
+					}
+					catch (exception&)
+					{
+					}
+				}
+
+				if (pkg_arch == Architecture::invalid || !pkg_version)
+				{
+					mdata = read_package_meta_data_from_xml(pkg_buf.buf, pkg_len);
+					pkg_name = mdata->name;
+					pkg_arch = mdata->architecture;
+					pkg_version = mdata->version;
+				}
+
 				/* Insert package into index */
 				if (arch == Architecture::invalid)
 				{
-					arch = mdata->architecture;
+					arch = pkg_arch;
 				}
-				else if (arch != mdata->architecture)
+				else if (arch != pkg_arch)
 				{
 					throw gp_exception("Index '" + index_path.string() +
 							"' contains packages for different architectures.");
 				}
 
-				if (packages.find(mdata->name) == packages.end())
+				if (packages.find(pkg_name) == packages.end())
 				{
-					packages.insert(mdata->name);
-					package_versions.insert(make_pair(mdata->name, vector<VersionNumber>()));
+					packages.insert(pkg_name);
+					package_versions.insert(make_pair(pkg_name, vector<VersionNumber>()));
 				}
 
-				if (package_data.find(make_pair(mdata->name, mdata->version)) != package_data.end())
+				if (package_data.find(make_pair(pkg_name, *pkg_version)) != package_data.end())
 				{
 					throw gp_exception("Index '" + index_path.string() +
-							"' contains package version '" + mdata->name + ":" +
-							mdata->version.to_string() + "' multiple times.");
+							"' contains package version '" + pkg_name + ":" +
+							pkg_version->to_string() + "' multiple times.");
 				}
 
-				package_versions.find(mdata->name)->second.push_back(mdata->version);
+				package_versions.find(pkg_name)->second.push_back(*pkg_version);
 				package_data.insert(make_pair(
-						make_pair(mdata->name, mdata->version),
-						make_tuple(mdata, digest, 0, 0)
+						make_pair(pkg_name, *pkg_version),
+						make_tuple(mdata, digest, 0, 0, package_xml.size(), pkg_len)
 				));
 
+				package_xml.append(pkg_buf.buf, pkg_len);
+
 				pkg_len = 0;
 			}
 			else
@@ -408,6 +546,9 @@ void StandardRepoIndex::read(const bool require_signature)
 					"': file list checksum missmatch");
 		}
 
+		file_index_map = make_unique<tf::MmapReadStream>(fd_file_index,
+				(index_path.parent_path() / file_list_name).string());
+
 		/* Read file index's index */
 		if (lseek(fd_file_index, 0, SEEK_SET) < 0)
 			throw system_error(error_code(errno, generic_category()));
@@ -418,7 +559,7 @@ void StandardRepoIndex::read(const bool require_signature)
 		uint64_t last_addr = 0;
 		string last_pkg;
 
-		const regex re("(.+)@([^@:]+):([^@:]+)");
+		const auto arch_str = Architecture::to_string(arch);
 
 		while (!eoi)
 		{
@@ -477,22 +618,22 @@ void StandardRepoIndex::read(const bool require_signature)
 
 					if (last_addr > 0)
 					{
-						smatch m;
-						if (!regex_match (last_pkg, m, re))
+						string_view spec_name, spec_arch, spec_version;
+						if (!split_package_specification (last_pkg,
+									spec_name, spec_arch, spec_version))
 						{
 							throw gp_exception("Index '" + index_path.string() +
 									"': Invalid package specification '" + last_pkg +
 									"' in file index");
 						}
 
-						string pkg_name = m[1];
-						string pkg_arch_str = m[2];
-						auto pkg_version = VersionNumber(m[3]);
+						string pkg_name(spec_name);
+						auto pkg_version = VersionNumber(string(spec_version));
 
-						if (Architecture::to_string(arch) != pkg_arch_str)
+						if (arch_str != spec_arch)
 						{
 							throw gp_exception("Index '" + index_path.string() +
-									"': Invalid architecture '" + pkg_arch_str +
+									"': Invalid architecture '" + string(spec_arch) +
 									"' in file index");
 						}
 
@@ -535,15 +676,28 @@ void StandardRepoIndex::read(const bool require_signature)
 		/* Check that every package version was mentioned in the file index */
 		for (auto& [k, v] : package_data)
 		{
-			auto& [mdata, digest, addr, size] = v;
+			auto& [name, version] = k;
+			auto addr = get<2>(v);
 
 			if (addr == 0)
 			{
 				throw gp_exception("Index '" + index_path.string() +
-						"': Package version '" + mdata->name + ":" + mdata->version.to_string() +
+						"': Package version '" + name + ":" + version.to_string() +
 						"' in package list but not in file index");
 			}
 		}
+
+		if (cache_key && arch != Architecture::invalid)
+		{
+			try
+			{
+				write_cached_index(*cache_key, convert_to_binary_index(file_list_name));
+			}
+			catch (exception&)
+			{
+				/* The index is still usable, only it cannot be cached */
+			}
+		}
 	}
 	catch(...)
 	{
@@ -560,11 +714,495 @@ void StandardRepoIndex::read(const bool require_signature)
 }
 
 
+optional<string> StandardRepoIndex::get_cache_key (FILE* f,
+		const optional<tuple<string, ManagedBuffer<unsigned char>, unsigned, ssize_t>>& sig)
+{
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0)
+		return nullopt;
+
+	string key = fs::absolute(index_path).string();
+	key += '\0';
+
+	for (uint64_t v : {
+			(uint64_t) st.st_dev, (uint64_t) st.st_ino, (uint64_t) st.st_size,
+			(uint64_t) st.st_mtim.tv_sec, (uint64_t) st.st_mtim.tv_nsec,
+			(uint64_t) st.st_ctim.tv_sec, (uint64_t) st.st_ctim.tv_nsec })
+	{
+		RepoIndexV2::put_u64(key, v);
+	}
+
+	/* The signature along with the key it is verified with */
+	if (sig)
+	{
+		auto& [key_name, sig_bytes, sig_len, data_end] = *sig;
+
+		auto p = fs::path(params->target + TPM2_KEY_DIR) / (key_name + ".pub");
+		ifstream key_file(p, ios::binary);
+		stringstream key_content;
+		key_content << key_file.rdbuf();
+
+		if (!key_file)
+			return nullopt;
+
+		SHA256Context ctx;
+		ctx.update((const char*) sig_bytes.buf, sig_len);
+		ctx.update(key_content.str().data(), key_content.str().size());
+
+		unsigned char digest[32];
+		ctx.finish(digest);
+
+		key += key_name;
+		key += '\0';
+		key.append((const char*) digest, sizeof(digest));
+	}
+
+	return key;
+}
+
+fs::path StandardRepoIndex::get_cache_path ()
+{
+	auto p = fs::absolute(index_path).string();
+
+	SHA256Context ctx;
+	ctx.update(p.data(), p.size());
+
+	unsigned char digest[32];
+	ctx.finish(digest);
+
+	string name;
+	char conv[3];
+
+	for (int i = 0; i < 16; i++)
+	{
+		snprintf(conv, sizeof(conv), "%02x", (unsigned) digest[i]);
+		name += conv;
+	}
+
+	return fs::path(params->target + INDEX_CACHE_DIR) / (name + ".cache");
+}
+
+bool StandardRepoIndex::read_cached_index (const string& key)
+{
+	auto path = get_cache_path();
+
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	auto was_binary_index = binary_index;
+
+	try
+	{
+		struct stat st;
+		if (fstat(fileno(f), &st) < 0)
+			throw system_error(error_code(errno, generic_category()));
+
+		const size_t trailer_size = 8 + sizeof(CACHE_MAGIC) - 1;
+		if ((uint64_t) st.st_size < trailer_size + key.size())
+			throw gp_exception("Invalid index cache");
+
+		/* Compare the key */
+		string trailer(trailer_size + key.size(), '\0');
+		if (pread(fileno(f), trailer.data(), trailer.size(), st.st_size - trailer.size()) !=
+				(ssize_t) trailer.size())
+		{
+			throw gp_exception("Cannot read index cache");
+		}
+
+		if (trailer.compare(key.size() + 8, string::npos, CACHE_MAGIC) != 0 ||
+				RepoIndexV2::get_u64(trailer.data() + key.size()) != key.size() ||
+				trailer.compare(0, key.size(), key) != 0)
+		{
+			fclose(f);
+			return false;
+		}
+
+		read_binary_index(f, st.st_size - trailer.size());
+		binary_index = true;
+
+		fclose(f);
+		return true;
+	}
+	catch (exception&)
+	{
+		/* Fall back to the index itself */
+		fclose(f);
+
+		binary_index = was_binary_index;
+		arch = Architecture::invalid;
+		index_map.reset();
+		file_index_map.reset();
+		bin_file_list_verified.clear();
+
+		if (fd_file_index >= 0)
+		{
+			close(fd_file_index);
+			fd_file_index = -1;
+		}
+
+		return false;
+	}
+}
+
+void StandardRepoIndex::write_cached_index (const string& key, const string& list)
+{
+	auto path = get_cache_path();
+	string tmp_path;
+
+	/* The cache is an optimization only, hence errors are ignored */
+	try
+	{
+		fs::create_directories(path.parent_path());
+
+		ManagedBuffer<char> tmpl(path.string().size() + 8);
+		snprintf(tmpl.buf, tmpl.size, "%s.XXXXXX", path.c_str());
+
+		int fd = mkstemp(tmpl.buf);
+		if (fd < 0)
+			return;
+
+		tmp_path = tmpl.buf;
+
+		FILE* f = fdopen(fd, "wb");
+		if (!f)
+		{
+			close(fd);
+			throw system_error(error_code(errno, generic_category()));
+		}
+
+		string trailer = key;
+		RepoIndexV2::put_u64(trailer, key.size());
+		trailer += CACHE_MAGIC;
+
+		bool ok = fwrite(list.data(), 1, list.size(), f) == list.size() &&
+			fwrite(trailer.data(), 1, trailer.size(), f) == trailer.size();
+
+		if (fclose(f) != 0 || !ok)
+			throw system_error(error_code(errno ? errno : EIO, generic_category()));
+
+		if (rename(tmp_path.c_str(), path.c_str()) < 0)
+			throw system_error(error_code(errno, generic_category()));
+	}
+	catch (exception&)
+	{
+		if (!tmp_path.empty())
+			unlink(tmp_path.c_str());
+	}
+}
+
+string StandardRepoIndex::convert_to_binary_index (const string& file_list_name)
+{
+	vector<RepoIndexV2::PackageVersion> versions;
+	versions.reserve(package_data.size());
+
+	/* package_data is ordered by name and version already */
+	for (auto& [k, v] : package_data)
+	{
+		auto& [name, version] = k;
+		auto addr = get<2>(v);
+		auto size = get<3>(v);
+
+		RepoIndexV2::PackageVersion pv;
+		pv.mdata = get_mdata(name, arch, version);
+		sha256_digest_from_hex(get<1>(v), pv.digest);
+
+		pv.file_list_offset = addr;
+		pv.file_list_size = size;
+
+		SHA256Context ctx;
+
+		if (size > 0)
+		{
+			file_index_map->seek(addr);
+			ctx.update(file_index_map->read_view(size), size);
+		}
+
+		ctx.finish(pv.file_list_digest);
+		versions.push_back(move(pv));
+	}
+
+	return RepoIndexV2::build_package_list(arch, versions, file_list_name);
+}
+
+
+void StandardRepoIndex::read_binary_index (FILE* f, uint64_t data_size)
+{
+	namespace v2 = RepoIndexV2;
+
+	char buf[256];
+
+	if (data_size < v2::HEADER_SIZE)
+		throw gp_exception("Index '" + index_path.string() + "' is truncated");
+
+	index_map = make_unique<tf::MmapReadStream>(fileno(f), index_path.string());
+	index_map->seek(0);
+	auto data = index_map->read_view(data_size);
+
+	arch = v2::get_u32(data + 24);
+
+	try
+	{
+		Architecture::to_string(arch);
+	}
+	catch (InvalidArchitecture&)
+	{
+		throw gp_exception("Index '" + index_path.string() +
+				"' has an invalid architecture");
+	}
+
+	/* Locate the tables */
+	BinaryIndexTable* tables[] = {
+		&bin_packages, &bin_versions, &bin_dependencies, &bin_triggers };
+
+	const size_t record_sizes[] = {
+		v2::PACKAGE_SIZE, v2::VERSION_SIZE, v2::DEPENDENCY_SIZE, v2::TRIGGER_SIZE };
+
+	for (int i = 0; i < 4; i++)
+	{
+		auto count = v2::get_u32(data + 28 + 4 * i);
+		auto offset = v2::get_u64(data + 48 + 8 * i);
+
+		if (offset > data_size || (data_size - offset) / record_sizes[i] < count)
+		{
+			throw gp_exception("Index '" + index_path.string() +
+					"' has an invalid table");
+		}
+
+		*tables[i] = BinaryIndexTable{data + offset, count};
+	}
+
+	auto strings_offset = v2::get_u64(data + 80);
+	auto strings_size = v2::get_u64(data + 88);
+
+	if (strings_offset > data_size || strings_size > data_size - strings_offset)
+	{
+		throw gp_exception("Index '" + index_path.string() +
+				"' has an invalid string table");
+	}
+
+	bin_strings = string_view(data + strings_offset, strings_size);
+
+	/* Check the references between records, such that lookups can rely on
+	 * them */
+	string_view last_name;
+
+	for (uint32_t i = 0; i < bin_packages.count; i++)
+	{
+		auto rec = bin_packages.data + i * v2::PACKAGE_SIZE;
+		auto name = get_bin_string(rec);
+		auto first = v2::get_u32(rec + 8);
+		auto cnt = v2::get_u32(rec + 12);
+
+		if (name.empty() || (i > 0 && name <= last_name) ||
+				cnt == 0 || first > bin_versions.count || cnt > bin_versions.count - first)
+		{
+			throw gp_exception("Index '" + index_path.string() +
+					"': invalid package record " + to_string(i));
+		}
+
+		last_name = name;
+	}
+
+	for (uint32_t i = 0; i < bin_versions.count; i++)
+	{
+		auto rec = bin_versions.data + i * v2::VERSION_SIZE;
+
+		uint64_t first_dep = v2::get_u32(rec + 64);
+		uint64_t first_trg = v2::get_u32(rec + 76);
+
+		if (first_dep + v2::get_u32(rec + 68) + v2::get_u32(rec + 72) > bin_dependencies.count ||
+				first_trg + v2::get_u32(rec + 80) + v2::get_u32(rec + 84) > bin_triggers.count)
+		{
+			throw gp_exception("Index '" + index_path.string() +
+					"': invalid version record " + to_string(i));
+		}
+	}
+
+	/* Check digest of file index */
+	string file_list_name(get_bin_string(data + 96));
+	if (file_list_name.empty() || file_list_name.find('/') != string::npos)
+	{
+		throw gp_exception("Index '" + index_path.string() +
+				"' has an invalid header.");
+	}
+
+	/* The file lists are verified when they are read */
+	bin_file_list_verified.resize(bin_versions.count, false);
+
+	fd_file_index = open(
+			(index_path.parent_path() / file_list_name).c_str(),
+			O_RDONLY);
+
+	if (fd_file_index < 0)
+	{
+		throw gp_exception("Index '" + index_path.string() +
+				"': could not open file list '" + file_list_name + "': " +
+				strerror_r(errno, buf, sizeof(buf)));
+	}
+
+	file_index_map = make_unique<tf::MmapReadStream>(fd_file_index,
+			(index_path.parent_path() / file_list_name).string());
+
+	struct stat st;
+	if (fstat(fd_file_index, &st) < 0)
+		throw system_error(error_code(errno, generic_category()));
+
+	for (uint32_t i = 0; i < bin_versions.count; i++)
+	{
+		auto rec = bin_versions.data + i * v2::VERSION_SIZE;
+		auto addr = v2::get_u64(rec + 48);
+		auto size = v2::get_u64(rec + 56);
+
+		if (addr > (uint64_t) st.st_size || size > st.st_size - addr)
+		{
+			throw gp_exception("Index '" + index_path.string() +
+					"': invalid file list location in version record " + to_string(i));
+		}
+	}
+}
+
+string_view StandardRepoIndex::get_bin_string (const char* ref)
+{
+	uint64_t offset = RepoIndexV2::get_u32(ref);
+	uint64_t size = RepoIndexV2::get_u32(ref + 4);
+
+	if (offset + size > bin_strings.size())
+	{
+		throw gp_exception("Index '" + index_path.string() +
+				"': invalid string reference");
+	}
+
+	return bin_strings.substr(offset, size);
+}
+
+const char* StandardRepoIndex::find_bin_package (const string& pkg_name)
+{
+	uint32_t l = 0, r = bin_packages.count;
+
+	while (l < r)
+	{
+		auto m = l + (r - l) / 2;
+		auto rec = bin_packages.data + m * RepoIndexV2::PACKAGE_SIZE;
+		auto cmp = get_bin_string(rec).compare(pkg_name);
+
+		if (cmp == 0)
+			return rec;
+
+		if (cmp < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return nullptr;
+}
+
+const char* StandardRepoIndex::find_bin_version (const string& pkg_name,
+		const VersionNumber& pkg_version)
+{
+	namespace v2 = RepoIndexV2;
+
+	auto pkg = find_bin_package(pkg_name);
+	if (!pkg)
+		return nullptr;
+
+	uint32_t l = v2::get_u32(pkg + 8);
+	uint32_t r = l + v2::get_u32(pkg + 12);
+
+	while (l < r)
+	{
+		auto m = l + (r - l) / 2;
+		auto rec = bin_versions.data + m * v2::VERSION_SIZE;
+		VersionNumber v(string(get_bin_string(rec)));
+
+		if (v == pkg_version)
+			return rec;
+
+		if (v < pkg_version)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return nullptr;
+}
+
+shared_ptr<PackageMetaData> StandardRepoIndex::decode_bin_mdata (const char* rec,
+		const string& pkg_name, const VersionNumber& pkg_version)
+{
+	namespace v2 = RepoIndexV2;
+
+	auto mdata = make_shared<PackageMetaData>(pkg_name, arch, pkg_version,
+			VersionNumber(string(get_bin_string(rec + 8))),
+			INSTALLATION_REASON_INVALID, PKG_STATE_INVALID);
+
+	auto first_dep = v2::get_u32(rec + 64);
+	auto cnt_pre_deps = v2::get_u32(rec + 68);
+	auto cnt_deps = v2::get_u32(rec + 72);
+
+	for (uint32_t i = first_dep; i < first_dep + cnt_pre_deps + cnt_deps; i++)
+	{
+		auto dep = bin_dependencies.data + i * v2::DEPENDENCY_SIZE;
+		auto formula_str = get_bin_string(dep + 12);
+
+		shared_ptr<PackageConstraints::Formula> formula;
+		if (!formula_str.empty())
+		{
+			formula = PackageConstraints::Formula::from_string(string(formula_str));
+			if (!formula)
+			{
+				throw gp_exception("Index '" + index_path.string() +
+						"': invalid constraint string in package '" +
+						pkg_name + ":" + pkg_version.to_string() + "'");
+			}
+		}
+
+		Dependency d(string(get_bin_string(dep)), v2::get_u32(dep + 8), formula);
+
+		if (i < first_dep + cnt_pre_deps)
+			mdata->add_pre_dependency(d);
+		else
+			mdata->add_dependency(d);
+	}
+
+	auto first_trg = v2::get_u32(rec + 76);
+	auto cnt_interested = v2::get_u32(rec + 80);
+	auto cnt_activated = v2::get_u32(rec + 84);
+
+	mdata->interested_triggers.emplace();
+	mdata->activated_triggers.emplace();
+
+	for (uint32_t i = first_trg; i < first_trg + cnt_interested + cnt_activated; i++)
+	{
+		string trg(get_bin_string(bin_triggers.data + i * v2::TRIGGER_SIZE));
+
+		if (i < first_trg + cnt_interested)
+			mdata->interested_triggers->push_back(move(trg));
+		else
+			mdata->activated_triggers->push_back(move(trg));
+	}
+
+	return mdata;
+}
+
+
 std::vector<string> StandardRepoIndex::list_packages (const int pkg_arch)
 {
 	if (pkg_arch != arch)
 		return vector<string>();
 
+	if (binary_index)
+	{
+		vector<string> names;
+		names.reserve(bin_packages.count);
+
+		for (uint32_t i = 0; i < bin_packages.count; i++)
+			names.emplace_back(get_bin_string(bin_packages.data + i * RepoIndexV2::PACKAGE_SIZE));
+
+		return names;
+	}
+
 	return vector<string>(packages.cbegin(), packages.cend());
 }
 
@@ -573,6 +1211,26 @@ set<VersionNumber> StandardRepoIndex::list_package_versions (const string& pkg_n
 	if (pkg_arch != arch)
 		return set<VersionNumber>();
 
+	if (binary_index)
+	{
+		set<VersionNumber> versions;
+
+		auto pkg = find_bin_package(pkg_name);
+		if (pkg)
+		{
+			auto first = RepoIndexV2::get_u32(pkg + 8);
+			auto cnt = RepoIndexV2::get_u32(pkg + 12);
+
+			for (uint32_t i = first; i < first + cnt; i++)
+			{
+				versions.emplace_hint(versions.end(), string(get_bin_string(
+								bin_versions.data + i * RepoIndexV2::VERSION_SIZE)));
+			}
+		}
+
+		return versions;
+	}
+
 	auto i = package_versions.find(pkg_name);
 	if (i == package_versions.end())
 		return set<VersionNumber>();
@@ -586,11 +1244,45 @@ shared_ptr<PackageMetaData> StandardRepoIndex::get_mdata(
 	if (pkg_arch != arch)
 		return nullptr;
 
+	if (binary_index)
+	{
+		auto rec = find_bin_version(pkg_name, pkg_version);
+		if (!rec)
+			return nullptr;
+
+		lock_guard<mutex> lk(mdata_mutex);
+
+		auto& mdata = bin_mdata[rec];
+		if (!mdata)
+			mdata = decode_bin_mdata(rec, pkg_name, pkg_version);
+
+		return mdata;
+	}
+
 	auto i = package_data.find(make_pair(pkg_name, pkg_version));
 	if (i == package_data.end())
 		return nullptr;
 
-	return get<0>(i->second);
+	/* Packages may be requested by multiple threads */
+	lock_guard<mutex> lk(mdata_mutex);
+
+	auto& mdata = get<0>(i->second);
+	if (!mdata)
+	{
+		auto tmp = read_package_meta_data_from_xml(
+				package_xml.data() + get<4>(i->second), get<5>(i->second));
+
+		if (tmp->name != pkg_name || tmp->architecture != arch || tmp->version != pkg_version)
+		{
+			throw gp_exception("Index '" + index_path.string() +
+					"': description of package '" + pkg_name + ":" +
+					pkg_version.to_string() + "' does not match its entry");
+		}
+
+		mdata = tmp;
+	}
+
+	return mdata;
 }
 
 optional<string> StandardRepoIndex::get_digest(
@@ -599,6 +1291,24 @@ optional<string> StandardRepoIndex::get_digest(
 	if (pkg_arch != arch)
 		return nullopt;
 
+	if (binary_index)
+	{
+		auto rec = find_bin_version(pkg_name, pkg_version);
+		if (!rec)
+			return nullopt;
+
+		string digest;
+		char conv[3];
+
+		for (int i = 0; i < 32; i++)
+		{
+			snprintf(conv, sizeof(conv), "%02x", (unsigned) (unsigned char) rec[16 + i]);
+			digest += conv;
+		}
+
+		return digest;
+	}
+
 	auto i = package_data.find(make_pair(pkg_name, pkg_version));
 	if (i == package_data.end())
 		return nullopt;
@@ -612,15 +1322,86 @@ shared_ptr<FileList> StandardRepoIndex::get_file_list(
 	if (pkg_arch != arch)
 		return nullptr;
 
-	auto i = package_data.find(make_pair(pkg_name, pkg_version));
-	if (i == package_data.end())
-		return nullptr;
+	uint64_t addr, size;
+	const char* rec = nullptr;
+
+	if (binary_index)
+	{
+		rec = find_bin_version(pkg_name, pkg_version);
+		if (!rec)
+			return nullptr;
+
+		addr = RepoIndexV2::get_u64(rec + 48);
+		size = RepoIndexV2::get_u64(rec + 56);
+	}
+	else
+	{
+		auto i = package_data.find(make_pair(pkg_name, pkg_version));
+		if (i == package_data.end())
+			return nullptr;
+
+		addr = get<2>(i->second);
+		size = get<3>(i->second);
+	}
+
+	/* File lists may be read by multiple threads */
+	lock_guard<mutex> lk(file_index_mutex);
+
+	auto key = make_pair(pkg_name, pkg_version);
+	auto c = file_list_cache.find(key);
+	if (c != file_list_cache.end())
+	{
+		file_list_lru.splice(file_list_lru.begin(), file_list_lru, c->second.lru_pos);
+		return c->second.files;
+	}
+
+	/* File lists of version 2 indexes are verified on first use */
+	if (rec)
+	{
+		auto i = (rec - bin_versions.data) / RepoIndexV2::VERSION_SIZE;
+		if (!bin_file_list_verified[i])
+		{
+			SHA256Context ctx;
 
-	auto addr = get<2>(i->second);
-	auto size = get<3>(i->second);
+			if (size > 0)
+			{
+				file_index_map->seek(addr);
+				ctx.update(file_index_map->read_view(size), size);
+			}
+
+			if (!ctx.verify((const unsigned char*) rec + 88))
+			{
+				throw gp_exception("Index '" + index_path.string() +
+						"': file list of package '" + pkg_name + ":" +
+						pkg_version.to_string() + "' has a wrong checksum");
+			}
 
-	auto rs = tf::FDReadStream(fd_file_index, false);
-	rs.seek(addr);
+			bin_file_list_verified[i] = true;
+		}
+	}
+
+	file_index_map->seek(addr);
+	auto files = tf::read_file_list(*file_index_map, size);
+
+	/* Sort it now such that it is not modified while it is shared */
+	files->sort();
+
+	auto list_size = files->memory_usage();
+	if (list_size > FILE_LIST_CACHE_SIZE)
+		return files;
+
+	file_list_lru.push_front(key);
+	file_list_cache.emplace(key, CachedFileList{files, list_size, file_list_lru.begin()});
+	file_list_cache_size += list_size;
+
+	while (file_list_cache_size > FILE_LIST_CACHE_SIZE)
+	{
+		auto victim = file_list_cache.find(file_list_lru.back());
+		file_list_cache_size -= victim->second.size;
+
+		file_list_cache.erase(victim);
+		file_list_lru.pop_back();
+	}
 
-	return tf::read_file_list(rs, size);
+	return files;
 }
@@ -3,14 +3,18 @@
 #define __STANDARD_REPO_INDEX_H
 
 #include <filesystem>
+#include <list>
 #include <map>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <string_view>
 #include <tuple>
 #include <utility>
 #include "repo_index.h"
 #include "parameters.h"
 #include "architecture.h"
+#include "transport_form.h"
 
 extern "C" {
 #include <openssl/evp.h>
@@ -25,16 +29,94 @@ protected:
 
 	int fd_file_index = -1;
 
+	/* The file index mapped into memory such that file lists can be parsed
+	 * directly from it */
+	std::unique_ptr<TransportForm::MmapReadStream> file_index_map;
+	std::mutex file_index_mutex;
+
+	/* Parsed file lists are shared by all callers. The most recently used
+	 * ones are kept up to a total size. */
+	struct CachedFileList
+	{
+		std::shared_ptr<FileList> files;
+		size_t size;
+		std::list<std::pair<std::string, VersionNumber>>::iterator lru_pos;
+	};
+
+	std::map<std::pair<std::string, VersionNumber>, CachedFileList> file_list_cache;
+	std::list<std::pair<std::string, VersionNumber>> file_list_lru;
+	size_t file_list_cache_size = 0;
+
 	/* In-memory index */
 	int arch = Architecture::invalid;
 
 	std::set<std::string> packages;
 	std::map<std::string, std::vector<VersionNumber>> package_versions;
+	/* Package descriptions are parsed when they are first requested; until
+	 * then mdata is nullptr and only the range of the description in
+	 * package_xml is known. */
 	std::map<
 		std::pair<std::string, VersionNumber>,
-		std::tuple<std::shared_ptr<PackageMetaData>, std::string, uint64_t, uint64_t>
+		std::tuple<std::shared_ptr<PackageMetaData>, std::string, uint64_t, uint64_t, size_t, size_t>
 	> package_data;
 
+	std::string package_xml;
+	std::mutex mdata_mutex;
+
+	/* Version 2 indexes are not loaded into the structures above but used in
+	 * place; see repo_index_v2.h. */
+	std::unique_ptr<TransportForm::MmapReadStream> index_map;
+	bool binary_index = false;
+
+	struct BinaryIndexTable
+	{
+		const char* data;
+		uint32_t count;
+	};
+
+	BinaryIndexTable bin_packages{}, bin_versions{}, bin_dependencies{}, bin_triggers{};
+	std::string_view bin_strings;
+
+	/* Which file lists have been verified, by version record; guarded by
+	 * file_index_mutex */
+	std::vector<bool> bin_file_list_verified;
+
+	/* Package descriptions decoded from version records */
+	std::map<const char*, std::shared_ptr<PackageMetaData>> bin_mdata;
+
+	void read_binary_index (FILE* f, uint64_t data_size);
+
+	/* An index is cached in the binary format once it has been authenticated.
+	 * The cache is keyed by the index's path, inode, size, timestamps and its
+	 * signature along with the key used to verify it.
+	 *
+	 * @returns nullopt if the index cannot be cached */
+	std::optional<std::string> get_cache_key (FILE* f,
+			const std::optional<std::tuple<std::string, ManagedBuffer<unsigned char>, unsigned, ssize_t>>& sig);
+
+	std::filesystem::path get_cache_path ();
+
+	/* @returns true if a valid cached copy with the given key was read */
+	bool read_cached_index (const std::string& key);
+	void write_cached_index (const std::string& key, const std::string& list);
+
+	/* Build a binary package list from a version 1 index that has been read */
+	std::string convert_to_binary_index (const std::string& file_list_name);
+
+	/* @raises gp_exception if the reference is invalid. */
+	std::string_view get_bin_string (const char* ref);
+
+	/* @returns the package record or nullptr */
+	const char* find_bin_package (const std::string& pkg_name);
+
+	/* @returns the version record or nullptr if the index does not contain
+	 * the package version. */
+	const char* find_bin_version (const std::string& pkg_name,
+			const VersionNumber& pkg_version);
+
+	std::shared_ptr<PackageMetaData> decode_bin_mdata (const char* rec,
+			const std::string& pkg_name, const VersionNumber& pkg_version);
+
 	std::optional<std::tuple<std::string, ManagedBuffer<unsigned char>, unsigned, ssize_t>>
 		read_signature(FILE* f);
 
@@ -75,6 +157,7 @@ public:
 			const int pkg_arch,
 			const VersionNumber& pkg_version) override;
 
+	/* The returned list is shared and must not be modified. */
 	std::shared_ptr<FileList> get_file_list(
 			const std::string& pkg_name,
 			const int pkg_arch,
@@ -21,7 +21,7 @@ StoredMaintainerScripts::StoredMaintainerScripts (
 	}
 	else
 	{
-		toc.version = 1;
+		toc.version = 3;
 	}
 }
 
@@ -39,7 +39,7 @@ StoredMaintainerScripts::StoredMaintainerScripts (
 		unconfigure(unconfigure), postrm(postrm)
 {
 	/* Build toc */
-	toc.version = 1;
+	toc.version = 3;
 
 	if (preinst)
 		toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_PREINST, 0, preinst->size));
@@ -53,14 +53,11 @@ StoredMaintainerScripts::StoredMaintainerScripts (
 	if (postrm)
 		toc.sections.push_back (tf::TOCSection (tf::SEC_TYPE_POSTRM, 0, postrm->size));
 
-	/* Calculate section offsets */
-	uint32_t pos = toc.binary_size();
-
 	for (auto& s : toc.sections)
-	{
-		s.start = pos;
-		pos += s.size;
-	}
+		s.encoding = tf::SEC_ENCODING_GZIP;
+
+	/* Calculate section offsets */
+	toc.update_starts();
 }
 
 
@@ -83,7 +80,7 @@ fs::path StoredMaintainerScripts::get_path (
 void StoredMaintainerScripts::ensure_read_stream()
 {
 	if (!rs)
-		rs = make_unique<tf::GZReadStream> (get_path());
+		rs = tf::open_read_stream (get_path());
 }
 
 
@@ -215,57 +212,27 @@ void StoredMaintainerScripts::write () const
 	{
 		tf::Writer w(get_path());
 
-		/* Write toc */
-		{
-			ManagedBuffer<char> buf(toc.binary_size());
-			toc.to_binary (buf.buf);
-
-			auto r = w.write (buf.buf, buf.size);
-			if (r < 0)
-			{
-				fprintf (stderr, "Failed to write stored maintainer scripts\n");
-				throw system_error (error_code (-r, generic_category()));
-			}
-		}
+		/* The sections are in the same order as in the toc */
+		vector<const char*> data;
 
 		if (preinst)
-		{
-			auto r = w.write (preinst->buf, preinst->size);
-			if (r < 0)
-			{
-				fprintf (stderr, "Failed to write preinst to sms\n");
-				throw system_error (error_code (-r, generic_category()));
-			}
-		}
+			data.push_back (preinst->buf);
 
 		if (configure)
-		{
-			auto r = w.write (configure->buf, configure->size);
-			if (r < 0)
-			{
-				fprintf (stderr, "Failed to write configure to sms\n");
-				throw system_error (error_code (-r, generic_category()));
-			}
-		}
+			data.push_back (configure->buf);
 
 		if (unconfigure)
-		{
-			auto r = w.write (unconfigure->buf, unconfigure->size);
-			if (r < 0)
-			{
-				fprintf (stderr, "Failed to write unconfigure to sms\n");
-				throw system_error (error_code (-r, generic_category()));
-			}
-		}
+			data.push_back (unconfigure->buf);
 
 		if (postrm)
+			data.push_back (postrm->buf);
+
+		auto wtoc = toc;
+		auto r = tf::write_sections (w, wtoc, data);
+		if (r < 0)
 		{
-			auto r = w.write (postrm->buf, postrm->size);
-			if (r < 0)
-			{
-				fprintf (stderr, "Failed to write postrm to sms\n");
-				throw system_error (error_code (-r, generic_category()));
-			}
+			fprintf (stderr, "Failed to write stored maintainer scripts\n");
+			throw system_error (error_code (-r, generic_category()));
 		}
 	}
 }
@@ -0,0 +1,130 @@
+#define BOOST_TEST_MODULE test_buffer_lru
+
+#include <boost/test/included/unit_test.hpp>
+#include "buffer_lru.h"
+#include <vector>
+
+using namespace std;
+
+
+/* Holds buffers like a ProvidedPackage whose file list and scripts are loaded
+ * one after another. */
+struct FakePackage
+{
+	size_t size = 0;
+	unsigned cleared = 0;
+
+	size_t get_buffer_size () const
+	{
+		return size;
+	}
+
+	void clear_buffers ()
+	{
+		size = 0;
+		cleared++;
+	}
+};
+
+using LRU = BufferLRU<FakePackage>;
+
+
+static vector<LRU::Entry> make_entries (unsigned cnt)
+{
+	vector<LRU::Entry> entries(cnt);
+	for (auto& e : entries)
+		e.pkg = make_shared<FakePackage>();
+
+	return entries;
+}
+
+
+BOOST_AUTO_TEST_CASE (test_evict_least_recently_used)
+{
+	LRU lru(100);
+	auto entries = make_entries (4);
+
+	for (auto& e : entries)
+	{
+		e.pkg->size = 40;
+		lru.touch (e);
+	}
+
+	/* Only the two most recently used packages fit */
+	BOOST_TEST (entries[0].pkg->cleared == 1U);
+	BOOST_TEST (entries[1].pkg->cleared == 1U);
+	BOOST_TEST (entries[2].pkg->cleared == 0U);
+	BOOST_TEST (entries[3].pkg->cleared == 0U);
+	BOOST_TEST (lru.get_buffer_size() == 80U);
+
+	/* Touching moves a package to the front */
+	entries[2].pkg->size = 40;
+	lru.touch (entries[2]);
+	entries[0].pkg->size = 40;
+	lru.touch (entries[0]);
+
+	BOOST_TEST (entries[3].pkg->cleared == 1U);
+	BOOST_TEST (entries[2].pkg->cleared == 0U);
+	BOOST_TEST (lru.get_buffer_size() == 80U);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_charge_after_handing_out)
+{
+	LRU lru(100);
+	auto entries = make_entries (3);
+
+	/* Packages are handed out without buffers, which are loaded later */
+	for (auto& e : entries)
+	{
+		lru.touch (e);
+		e.pkg->size = 60;
+		lru.charge (e);
+	}
+
+	/* Buffers loaded after a package was handed out count when the next one
+	 * is handed out. Charging alone does not evict. */
+	BOOST_TEST (entries[0].pkg->cleared == 1U);
+	BOOST_TEST (entries[1].pkg->cleared == 0U);
+	BOOST_TEST (entries[2].pkg->cleared == 0U);
+	BOOST_TEST (lru.get_buffer_size() == 120U);
+
+	entries[2].pkg->size = 200;
+	lru.charge (entries[2]);
+	BOOST_TEST (lru.get_buffer_size() == 260U);
+
+	/* The package that is handed out keeps its buffers */
+	lru.touch (entries[2]);
+	BOOST_TEST (entries[1].pkg->cleared == 1U);
+	BOOST_TEST (entries[2].pkg->cleared == 0U);
+	BOOST_TEST (lru.get_buffer_size() == 200U);
+
+	lru.set_budget (50);
+	BOOST_TEST (entries[2].pkg->cleared == 1U);
+	BOOST_TEST (lru.get_buffer_size() == 0U);
+}
+
+
+BOOST_AUTO_TEST_CASE (test_charge_evicted_package)
+{
+	LRU lru(50);
+	auto entries = make_entries (2);
+
+	entries[0].pkg->size = 40;
+	lru.touch (entries[0]);
+	entries[1].pkg->size = 40;
+	lru.touch (entries[1]);
+
+	BOOST_TEST (entries[0].pkg->cleared == 1U);
+	BOOST_TEST (!entries[0].in_lru);
+
+	/* Reloading buffers of an evicted package tracks it again */
+	entries[0].pkg->size = 30;
+	lru.charge (entries[0]);
+	BOOST_TEST (entries[0].in_lru);
+	BOOST_TEST (lru.get_buffer_size() == 70U);
+
+	lru.touch (entries[0]);
+	BOOST_TEST (entries[1].pkg->cleared == 1U);
+	BOOST_TEST (lru.get_buffer_size() == 30U);
+}
@@ -39,7 +39,7 @@ void print_help()
 
 	printf(
 "\n"
-"This is version two, which is entirely written in C++. It uses GNU Tar, zlib,\n"
+"This is version two, which is entirely written in C++. It uses zlib, liblzma,\n"
 "TinyXML2 and SQLite3 as package database.\n\n"
 
 "Specifying packages: Each package description may look like name@arch>=s:version.\n"
@@ -71,6 +71,9 @@ void print_help()
 "                          be installed/changed and exist on the system already\n"
 "                          with different content.\n\n"
 
+"  --sync                  Sync the filesystem after a package's files have been\n"
+"                          unpacked\n\n"
+
 "  --assume-yes            Do not ask for confirmation if the operation shall\n"
 "                          be performed on the packages. However this does not\n"
 "                          disable the prompts for adopting files.\n\n"
@@ -133,6 +136,10 @@ void print_help()
 "  --sign <key>            Sign the index with the given RSA key (must be in PEM\n"
 "                          format).\n\n"
 
+"  --index-v1              Create the index in the text format of version 1,\n"
+"                          which older versions of tpm2 understand, instead of\n"
+"                          the binary format of version 2.\n\n"
+
 "  --help                  Display this list of options\n\n"
 
 "At least one operation must be specified.\n"
@@ -228,10 +235,18 @@ int _main(int argc, char** argv)
 			{
 				params->depres2_debug_log = true;
 			}
+			else if (option == "sync")
+			{
+				params->sync = true;
+			}
 			else if (option == "adopt-all")
 			{
 				params->adopt_all = true;
 			}
+			else if (option == "index-v1")
+			{
+				params->create_index_v1 = true;
+			}
 			else if (option == "assume-yes")
 			{
 				params->assume_yes = true;
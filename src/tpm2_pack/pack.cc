@@ -7,6 +7,7 @@
 #include <memory>
 #include <optional>
 #include <stack>
+#include <thread>
 #include <tinyxml2.h>
 #include <utility>
 #include "pack.h"
@@ -23,6 +24,7 @@ extern "C" {
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 }
 
 using namespace std;
@@ -32,7 +34,7 @@ namespace tf = TransportForm;
 namespace md = message_digest;
 
 
-bool pack (const string& _dir)
+bool pack (const string& _dir, uint8_t encoding, int level, unsigned threads)
 {
 	/* Convert _dir to an absolute path and check if the directory exists. */
 	fs::path dir = get_absolute_path (_dir);
@@ -156,6 +158,7 @@ bool pack (const string& _dir)
 
 	/* Serialize XML DOM */
 	tf::TransportForm tf;
+	tf.set_encoding (encoding, level);
 
 	unique_ptr<XMLDocument> doc = mdata->to_xml();
 
@@ -367,23 +370,21 @@ bool pack (const string& _dir)
 	DynamicBuffer<uint8_t> config_files;
 	size_t config_files_size = 0;
 
-	DynamicBuffer<uint8_t> archive;
-	size_t archive_size = 0;
+	/* The archive is streamed from tar while the transport form is written,
+	 * such that it never needs to fit into memory. */
+	pid_t tar_pid = -1;
+	int tar_fd = -1;
 
 	if (fs::is_directory (destdir_path))
 	{
 		if (!create_file_index (destdir_path, file_index, file_index_size))
 			return false;
 
-		if (!create_tar_archive (destdir_path, archive, archive_size))
-			return false;
-
-		if (archive_size > 0 && file_index_size > 0)
+		if (file_index_size > 0)
 		{
 			printf ("    Have archive\n");
 
 			tf.set_file_index ((const char*) file_index.buf, file_index_size);
-			tf.set_archive (archive.buf, archive_size);
 
 			/* Identify config files */
 			if (!create_config_files (destdir_path, config_files, config_files_size,
@@ -391,28 +392,61 @@ bool pack (const string& _dir)
 				return false;
 
 			tf.set_config_files ((const char*) config_files.buf, config_files_size);
+
+			if (!start_tar_archive (destdir_path, tar_pid, tar_fd))
+				return false;
+
+			tf.set_archive ([tar_fd](char *buf, size_t size) -> ssize_t {
+				for (;;)
+				{
+					auto r = read (tar_fd, buf, size);
+					if (r >= 0)
+						return r;
+
+					if (errno != EINTR)
+						return -errno;
+				}
+			});
 		}
 	}
 
 
 	/* Write the package to a transport form file. */
 	std::unique_ptr<tf::Writer> writer;
+	auto filename = tf::filename_from_mdata (*mdata);
 
 	try
 	{
-		writer = make_unique<tf::Writer> (tf::filename_from_mdata (*mdata));
+		writer = make_unique<tf::Writer> (filename);
 	}
 	catch (exception& e)
 	{
 		fprintf (stderr, "Failed to open transport form file: %s\n", e.what());
+
+		if (tar_pid >= 0)
+			finish_tar_archive (tar_pid, tar_fd);
+
 		return false;
 	}
 
+	if (threads == 0)
+		threads = thread::hardware_concurrency();
+
+	writer->set_threads (threads);
+
 
 	int ret = tf.write (*writer);
+	writer = nullptr;
+
+	/* Only now it is clear if tar succeeded */
+	bool tar_ok = tar_pid < 0 || finish_tar_archive (tar_pid, tar_fd);
+
 	if (ret < 0)
-	{
 		fprintf (stderr, "Failed to write to transport form: %s\n", strerror (-ret));
+
+	if (ret < 0 || !tar_ok)
+	{
+		unlink (filename.c_str());
 		return false;
 	}
 
@@ -768,7 +802,7 @@ bool create_config_files (const fs::path& dir, DynamicBuffer<uint8_t>& dst, size
 }
 
 
-bool create_tar_archive (const std::string& dir, DynamicBuffer<uint8_t>& dst, size_t& size)
+bool start_tar_archive (const std::string& dir, pid_t& pid, int& fd)
 {
 	int pipefds[2];
 
@@ -778,11 +812,13 @@ bool create_tar_archive (const std::string& dir, DynamicBuffer<uint8_t>& dst, si
 		return false;
 	}
 
-	pid_t pid  = fork ();
+	pid = fork ();
 
 	if (pid < 0)
 	{
 		fprintf (stderr, "Failed to fork: %s\n", strerror (errno));
+		close (pipefds[0]);
+		close (pipefds[1]);
 		return false;
 	}
 
@@ -802,31 +838,20 @@ bool create_tar_archive (const std::string& dir, DynamicBuffer<uint8_t>& dst, si
 
 
 	/* In the parent process */
-	int pread = pipefds[0];
+	fd = pipefds[0];
 	close (pipefds[1]);
 
-	size = 0;
-	for (;;)
-	{
-		dst.ensure_size (size + 20480);
-		ssize_t r = read (pread, dst.buf + size, 20480);
+	/* Do not leak the pipe to other children */
+	fcntl (fd, F_SETFD, FD_CLOEXEC);
 
-		if (r < 0)
-		{
-			fprintf (stderr, "Failed to read from pipe: %s\n", strerror (errno));
-			close (pread);
-			break;
-		}
-
-		if (r == 0)
-		{
-			close (pread);
-			break;
-		}
+	return true;
+}
 
-		size += r;
-	}
 
+bool finish_tar_archive (pid_t pid, int fd)
+{
+	/* If the archive was not read completely, tar receives SIGPIPE. */
+	close (fd);
 
 	/* Wait for child to exit */
 	int status;
@@ -837,6 +862,12 @@ bool create_tar_archive (const std::string& dir, DynamicBuffer<uint8_t>& dst, si
 		return false;
 	}
 
+	if (WIFSIGNALED (status))
+	{
+		fprintf (stderr, "Tar was terminated by signal %d.\n", WTERMSIG (status));
+		return false;
+	}
+
 	int exit_code = WEXITSTATUS (status);
 	if (exit_code != 0)
 	{
@@ -10,15 +10,30 @@
 #include <vector>
 #include <regex>
 #include "managed_buffer.h"
+#include "section_codecs.h"
 
-bool pack (const std::string& dir);
+extern "C" {
+#include <sys/types.h>
+}
+
+/* @param encoding  Codec with which the sections are compressed
+ * @param level     Compression level, -1 selects the codec's default
+ * @param threads   Number of compression threads, 0 means one per CPU */
+bool pack (const std::string& dir,
+		uint8_t encoding = TransportForm::SEC_ENCODING_GZIP, int level = -1,
+		unsigned threads = 0);
 
 bool create_file_index (const std::filesystem::path& dir, DynamicBuffer<uint8_t>& dst, size_t& size);
 bool create_config_files (const std::filesystem::path& dir, DynamicBuffer<uint8_t>& dst, size_t& size,
 		const std::vector<std::regex>& patterns);
 
-/* Be aware that this calls exec and does not close open fds. Make sure to
+/* Start tar in a child process, which writes the archive to the pipe @param
+ * fd. The caller reads the archive from there and then calls
+ * finish_tar_archive, which closes fd.
+ *
+ * Be aware that this calls exec and does not close open fds. Make sure to
  * set the CLOEXEC flag on them! */
-bool create_tar_archive (const std::string& dir, DynamicBuffer<uint8_t>& dst, size_t& size);
+bool start_tar_archive (const std::string& dir, pid_t& pid, int& fd);
+bool finish_tar_archive (pid_t pid, int fd);
 
 #endif /* __PACK_H */
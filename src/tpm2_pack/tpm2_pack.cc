@@ -7,6 +7,7 @@
 #include <string>
 #include "tpm2_config.h"
 #include "pack.h"
+#include "section_codecs.h"
 
 extern "C" {
 #include <sys/types.h>
@@ -41,6 +42,16 @@ void print_help()
 "  --version               Print the program's version\n\n"
 
 "  --help                  Display this help\n\n"
+
+"  --codec=<none|gzip|xz|zstd>\n"
+"                          Compress the package's sections with the given\n"
+"                          codec. The default is gzip.\n\n"
+
+"  --level=<n>             Compression level for the chosen codec: 0-9 for gzip\n"
+"                          and xz, 1-19 for zstd\n\n"
+
+"  --threads=<n>           Compress on n threads. The default is one thread per\n"
+"                          CPU.\n\n"
 );
 }
 
@@ -54,6 +65,11 @@ struct ParserState
 
 	char unpacked_dir_state = NOT_SPECIFIED;
 	string unpacked_dir;
+
+	uint8_t encoding = TransportForm::SEC_ENCODING_GZIP;
+	int level = -1;
+	bool level_specified = false;
+	unsigned threads = 0;
 };
 
 
@@ -73,6 +89,14 @@ int _main (int argc, char** argv)
 		if (parameter.rfind ("--", 0) == 0)
 		{
 			auto option = parameter.substr(2);
+			string value;
+
+			auto pos = option.find ('=');
+			if (pos != string::npos)
+			{
+				value = option.substr (pos + 1);
+				option = option.substr (0, pos);
+			}
 
 			if (option == "version")
 			{
@@ -84,6 +108,58 @@ int _main (int argc, char** argv)
 				print_help();
 				return 0;
 			}
+			else if (option == "codec")
+			{
+				auto encoding = TransportForm::encoding_from_string (value);
+				if (!encoding)
+				{
+					fprintf (stderr, "Invalid codec \"%s\".\n", value.c_str());
+					return 2;
+				}
+
+				state.encoding = *encoding;
+
+				if (!TransportForm::encoding_supported (state.encoding))
+				{
+					fprintf (stderr, "This build does not support the codec \"%s\".\n",
+							value.c_str());
+					return 2;
+				}
+			}
+			else if (option == "level")
+			{
+				try
+				{
+					size_t idx;
+					state.level = stoi (value, &idx);
+					if (idx != value.size() || state.level < 0)
+						throw invalid_argument ("level");
+
+					state.level_specified = true;
+				}
+				catch (const logic_error&)
+				{
+					fprintf (stderr, "Invalid compression level \"%s\".\n", value.c_str());
+					return 2;
+				}
+			}
+			else if (option == "threads")
+			{
+				try
+				{
+					size_t idx;
+					int threads = stoi (value, &idx);
+					if (idx != value.size() || threads < 1)
+						throw invalid_argument ("threads");
+
+					state.threads = threads;
+				}
+				catch (const logic_error&)
+				{
+					fprintf (stderr, "Invalid number of threads \"%s\".\n", value.c_str());
+					return 2;
+				}
+			}
 			else
 			{
 				fprintf (stderr, "Invalid argument \"--%s\".\n", option.c_str());
@@ -113,7 +189,29 @@ int _main (int argc, char** argv)
 		return 2;
 	}
 
-	return pack (state.unpacked_dir) ? 0 : 1;
+	/* The level can only be checked once the codec is known */
+	if (state.level_specified)
+	{
+		auto range = TransportForm::compression_level_range (state.encoding);
+		auto codec = TransportForm::encoding_to_string (state.encoding);
+
+		if (!range)
+		{
+			fprintf (stderr, "The codec \"%s\" does not take a compression level.\n",
+					codec.c_str());
+			return 2;
+		}
+
+		if (state.level < range->first || state.level > range->second)
+		{
+			fprintf (stderr, "Invalid compression level %d for codec \"%s\", "
+					"must be between %d and %d.\n",
+					state.level, codec.c_str(), range->first, range->second);
+			return 2;
+		}
+	}
+
+	return pack (state.unpacked_dir, state.encoding, state.level, state.threads) ? 0 : 1;
 }
 
 
@@ -3,11 +3,19 @@
 Unpack the transport form into the current directory.
 """
 import argparse
+import io
 import os
 import shutil
 import struct
 import subprocess
+import lzma
 import tempfile
+import zlib
+
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
 
 if os.path.exists('/usr/bin/pigz'):
     GZIP = 'pigz'
@@ -142,6 +150,70 @@ def write_script(size, f, name):
         f.seek(size, 1)
 
 
+def process_section(type_, size, f):
+    if type_ == 0x00:
+        read_meta_data(size, f)
+    elif type_ == 0x01:
+        read_index(size, f)
+    elif type_ == 0x02:
+        read_config_files(size, f)
+    elif type_ == 0x20:
+        write_script(size, f, 'preinst')
+    elif type_ == 0x21:
+        write_script(size, f, 'configure')
+    elif type_ == 0x22:
+        write_script(size, f, 'unconfigure')
+    elif type_ == 0x23:
+        write_script(size, f, 'postrm')
+    elif type_ == 0x80:
+        extract_archive(size, f)
+    else:
+        print("Skipping unknown section of type 0x%02x." % type_)
+        f.seek(size, 1)
+
+
+def decode_section(encoding, data):
+    """
+    Sections of version 2 may be stored or consist of one or more gzip, xz or
+    zstd members.
+    """
+    if encoding == 0x00:
+        return data
+
+    elif encoding == 0x01:
+        out = b''
+        while data:
+            d = zlib.decompressobj(31)
+            out += d.decompress(data)
+            data = d.unused_data
+
+        return out
+
+    elif encoding == 0x02:
+        out = b''
+        while data:
+            d = lzma.LZMADecompressor(lzma.FORMAT_XZ)
+            out += d.decompress(data)
+            data = d.unused_data
+
+        return out
+
+    elif encoding == 0x03:
+        if zstandard is None:
+            raise ValueError("Decoding zstd sections requires the module zstandard.")
+
+        out = b''
+        while data:
+            d = zstandard.ZstdDecompressor().decompressobj()
+            out += d.decompress(data)
+            data = d.unused_data
+
+        return out
+
+    else:
+        raise ValueError("Unsupported section encoding 0x%02x." % encoding)
+
+
 def main():
     global unpack
 
@@ -194,38 +266,41 @@ def main():
 
         with open(file_, 'rb') as f:
             version = struct.unpack('<B', f.read(1))[0]
-            if version != 1:
+            if version not in (1, 2, 3):
                 print("Unsupported version: %d." % version)
                 exit(1)
 
             cnt_sections = struct.unpack('<B', f.read(1))[0]
-            toc_ = f.read(9 * cnt_sections)
-
-            for i in range(cnt_sections):
-                sec = toc_[i*9 : (i+1) * 9]
-                type_ = struct.unpack('<B', sec[0:1])[0]
-                start = struct.unpack('<I', sec[1:5])[0]
-                size = struct.unpack('<I', sec[5:9])[0]
-
-                if type_ == 0x00:
-                    read_meta_data(size, f)
-                elif type_ == 0x01:
-                    read_index(size, f)
-                elif type_ == 0x02:
-                    read_config_files(size, f)
-                elif type_ == 0x20:
-                    write_script(size, f, 'preinst')
-                elif type_ == 0x21:
-                    write_script(size, f, 'configure')
-                elif type_ == 0x22:
-                    write_script(size, f, 'unconfigure')
-                elif type_ == 0x23:
-                    write_script(size, f, 'postrm')
-                elif type_ == 0x80:
-                    extract_archive(size, f)
-                else:
-                    print("Skipping unknown section of type 0x%02x." % type_)
-                    f.seek(size, 1)
+
+            if version == 1:
+                toc_ = f.read(9 * cnt_sections)
+
+                for i in range(cnt_sections):
+                    sec = toc_[i*9 : (i+1) * 9]
+                    type_ = struct.unpack('<B', sec[0:1])[0]
+                    start = struct.unpack('<I', sec[1:5])[0]
+                    size = struct.unpack('<I', sec[5:9])[0]
+
+                    process_section(type_, size, f)
+
+            else:
+                # Each section is encoded independently at its own offset;
+                # version 3 uses 64 bit fields.
+                entry_size, fmt = (18, '<IIII') if version == 2 else (34, '<QQQQ')
+                toc_ = f.read(entry_size * cnt_sections)
+
+                for i in range(cnt_sections):
+                    sec = toc_[i*entry_size : (i+1) * entry_size]
+                    type_, encoding = struct.unpack('<BB', sec[0:2])
+                    start, size, offset, encoded_size = struct.unpack(fmt, sec[2:entry_size])
+
+                    f.seek(offset)
+                    data = decode_section(encoding, f.read(encoded_size))
+                    if len(data) != size:
+                        print("Section of type 0x%02x has invalid size." % type_)
+                        exit(1)
+
+                    process_section(type_, size, io.BytesIO(data))
 
     exit(0)
 